@@ -0,0 +1,267 @@
+/*
+ * Simulated NOR flash backend for redsimg
+ *
+ * Timing is a plain sum of bus transfers and device busy times, one transaction
+ * after another, which is how redsfs drives flash.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flashsim.h"
+
+static flashsim_config sim_cfg;
+static flashsim_stats sim_stats;
+static uint8_t * sim_mem;
+static uint32_t sim_size;
+static uint32_t * sim_erase_cnt;   // Per sector
+
+int flashsim_parse ( flashsim_config * cfg, char * spec )
+{
+    char * key;
+    char * val;
+    char * save;
+
+    // A W25Q style SPI NOR part
+    cfg->sector = 4096;
+    cfg->page = 256;
+    cfg->bus = 1;
+    cfg->mhz = 80;
+    cfg->cmd_ns = 500;
+    cfg->prog_us = 700;
+    cfg->erase_ms = 45;
+    cfg->strict = 0;
+
+    for ( key = strtok_r( spec, ",", &save ); key != NULL; key = strtok_r( NULL, ",", &save ) ) {
+        val = strchr( key, '=' );
+        if ( val != NULL )
+            *val++ = 0;
+        if ( strcmp( key, "defaults" ) == 0 )
+            continue;
+        if ( strcmp( key, "strict" ) == 0 ) {
+            cfg->strict = ( val == NULL ) ? 1 : strtoul( val, 0, 0 );
+            continue;
+        }
+        if ( val == NULL )
+            return -1;
+        if ( strcmp( key, "sector" ) == 0 ) cfg->sector = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "page" ) == 0 ) cfg->page = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "bus" ) == 0 ) cfg->bus = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "mhz" ) == 0 ) cfg->mhz = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "cmd_ns" ) == 0 ) cfg->cmd_ns = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "prog_us" ) == 0 ) cfg->prog_us = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "erase_ms" ) == 0 ) cfg->erase_ms = strtoul( val, 0, 0 );
+        else return -1;
+    }
+    return 0;
+}
+
+int flashsim_init ( flashsim_config * cfg, uint8_t * mem, uint32_t size )
+{
+    if ( ( cfg->sector == 0 ) || ( cfg->sector & ( cfg->sector - 1 ) ) || ( size % cfg->sector ) ||
+         ( cfg->page == 0 ) || ( cfg->page & ( cfg->page - 1 ) ) ||
+         ( cfg->bus == 0 ) || ( cfg->mhz == 0 ) )
+        return -1;
+
+    sim_cfg = *cfg;
+    memset( &sim_stats, 0, sizeof(sim_stats) );
+    sim_mem = mem;
+    sim_size = size;
+    sim_erase_cnt = calloc( size / cfg->sector, sizeof(uint32_t) );
+    if ( sim_erase_cnt == NULL )
+        return -1;
+    return 0;
+}
+
+void flashsim_free ()
+{
+    free( sim_erase_cnt );
+    sim_erase_cnt = NULL;
+}
+
+// Time to clock bytes over the bus
+static uint64_t flashsim_xfer_ns ( uint32_t bytes )
+{
+    return (uint64_t)bytes * 8 * 1000 / ( sim_cfg.bus * sim_cfg.mhz );
+}
+
+static int flashsim_range ( uint32_t addr, uint32_t size )
+{
+    if ( ( addr > sim_size ) || ( size > sim_size - addr ) ) {
+        printf("Flash sim: access at %x size %u past the end\r\n", addr, size);
+        return -1;
+    }
+    return 0;
+}
+
+static void flashsim_read_at ( uint32_t addr, uint32_t size, uint8_t * dest, uint8_t cmd )
+{
+    uint64_t t = flashsim_xfer_ns( size );
+
+    if ( cmd ) {
+        t += sim_cfg.cmd_ns;
+        sim_stats.reads++;
+    }
+    memcpy( dest, sim_mem + addr, size );
+    sim_stats.read_bytes += size;
+    sim_stats.read_ns += t;
+    sim_stats.time_ns += t;
+}
+
+uint32_t flashsim_read ( uint32_t addr, uint32_t size, uint8_t * dest )
+{
+    if ( flashsim_range( addr, size ) < 0 )
+        return -1;
+
+    flashsim_read_at( addr, size, dest, 1 );
+    return 0;
+}
+
+// Pieces carrying on from the last one are the same read command still clocking data
+uint32_t flashsim_readv ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+    uint32_t end = 0;
+
+    for ( i = 0; i < cnt; i++ ) {
+        if ( flashsim_range( iov[i].addr, iov[i].size ) < 0 )
+            return -1;
+        flashsim_read_at( iov[i].addr, iov[i].size, iov[i].buf, ( i == 0 ) || ( iov[i].addr != end ) );
+        end = iov[i].addr + iov[i].size;
+    }
+    return 0;
+}
+
+// One command for the lot. A gap between pieces is clocked through when that is
+// quicker than starting a fresh read command after it.
+uint32_t flashsim_readstride ( uint32_t addr, uint32_t size, uint32_t stride, uint32_t cnt, uint8_t * dest )
+{
+    uint64_t gap_ns;
+    uint32_t i;
+
+    if ( ( cnt > 0 ) && ( flashsim_range( addr, ( cnt - 1 ) * stride + size ) < 0 ) )
+        return -1;
+
+    gap_ns = ( stride > size ) ? flashsim_xfer_ns( stride - size ) : 0;
+    for ( i = 0; i < cnt; i++ ) {
+        if ( ( i > 0 ) && ( gap_ns > 0 ) ) {
+            if ( gap_ns < sim_cfg.cmd_ns ) {
+                sim_stats.read_ns += gap_ns;
+                sim_stats.time_ns += gap_ns;
+            } else {
+                sim_stats.read_ns += sim_cfg.cmd_ns;
+                sim_stats.time_ns += sim_cfg.cmd_ns;
+            }
+        }
+        flashsim_read_at( addr + i * stride, size, dest + i * size, i == 0 );
+    }
+    return 0;
+}
+
+// One page program per page touched. A cell only goes from erased to programmed,
+// so a bit redsfs wants back to 0 needs an erase first.
+uint32_t flashsim_write ( uint32_t addr, uint32_t size, uint8_t * src )
+{
+    uint32_t len;
+    uint32_t i;
+    uint8_t bad = 0;
+    uint64_t t;
+
+    if ( flashsim_range( addr, size ) < 0 )
+        return -1;
+
+    sim_stats.progs++;
+    sim_stats.prog_bytes += size;
+    while ( size > 0 ) {
+        len = sim_cfg.page - ( addr & ( sim_cfg.page - 1 ) );
+        if ( len > size )
+            len = size;
+
+        for ( i = 0; i < len; i++ ) {
+            if ( sim_mem[addr + i] & ~src[i] )
+                bad = 1;
+            sim_mem[addr + i] = sim_cfg.strict ? ( sim_mem[addr + i] | src[i] ) : src[i];
+        }
+
+        t = sim_cfg.cmd_ns + flashsim_xfer_ns( len ) + (uint64_t)sim_cfg.prog_us * 1000;
+        sim_stats.prog_pages++;
+        sim_stats.prog_ns += t;
+        sim_stats.time_ns += t;
+        addr += len;
+        src += len;
+        size -= len;
+    }
+    sim_stats.violations += bad;
+    return 0;
+}
+
+uint32_t flashsim_writev ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    for ( i = 0; i < cnt; i++ ) {
+        if ( flashsim_write( iov[i].addr, iov[i].size, iov[i].buf ) != 0 )
+            return -1;
+    }
+    return 0;
+}
+
+// Erase every sector the range touches
+uint32_t flashsim_erase ( uint32_t addr, uint32_t size )
+{
+    uint32_t sec;
+    uint64_t t;
+
+    if ( flashsim_range( addr, size ) < 0 )
+        return -1;
+
+    for ( sec = addr / sim_cfg.sector; sec * sim_cfg.sector < addr + size; sec++ ) {
+        memset( sim_mem + sec * sim_cfg.sector, 0, sim_cfg.sector );
+        sim_erase_cnt[sec]++;
+        t = sim_cfg.cmd_ns + (uint64_t)sim_cfg.erase_ms * 1000000;
+        sim_stats.erases++;
+        sim_stats.erase_ns += t;
+        sim_stats.time_ns += t;
+    }
+    return 0;
+}
+
+flashsim_stats * flashsim_get_stats ()
+{
+    return &sim_stats;
+}
+
+void flashsim_report ( FILE * out )
+{
+    uint32_t sectors = sim_size / sim_cfg.sector;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint32_t i;
+
+    fprintf( out, "Flash sim: sector %u page %u bus x%u at %u MHz%s\r\n", sim_cfg.sector, sim_cfg.page,
+             sim_cfg.bus, sim_cfg.mhz, sim_cfg.strict ? ", strict" : "" );
+    fprintf( out, " time %.6f ms (read %.6f, program %.6f, erase %.6f)\r\n", sim_stats.time_ns / 1e6,
+             sim_stats.read_ns / 1e6, sim_stats.prog_ns / 1e6, sim_stats.erase_ns / 1e6 );
+    fprintf( out, " reads %llu (%llu bytes), programs %llu (%llu pages, %llu bytes), erases %llu\r\n",
+             (unsigned long long)sim_stats.reads, (unsigned long long)sim_stats.read_bytes,
+             (unsigned long long)sim_stats.progs, (unsigned long long)sim_stats.prog_pages,
+             (unsigned long long)sim_stats.prog_bytes, (unsigned long long)sim_stats.erases );
+    fprintf( out, " programs clearing bits without an erase %llu\r\n", (unsigned long long)sim_stats.violations );
+
+    for ( i = 0; i < sectors; i++ ) {
+        if ( sim_erase_cnt[i] < min )
+            min = sim_erase_cnt[i];
+        if ( sim_erase_cnt[i] > max )
+            max = sim_erase_cnt[i];
+    }
+    fprintf( out, " sector erases: min %u max %u mean %.3f over %u sectors\r\n", min, max,
+             sectors ? (double)sim_stats.erases / sectors : 0.0, sectors );
+    if ( max == 0 )
+        return;
+    fprintf( out, " erased sectors:" );
+    for ( i = 0; i < sectors; i++ ) {
+        if ( sim_erase_cnt[i] )
+            fprintf( out, " %u:%u", i, sim_erase_cnt[i] );
+    }
+    fprintf( out, "\r\n" );
+}
@@ -0,0 +1,62 @@
+/*
+ * Simulated NOR flash backend for redsimg
+ *
+ * Stands in for the SPI/FLASH read/write/erase calls a micro would map into
+ * redsfs, over the same memory image, while keeping a simulated clock and
+ * wear counts. redsfs treats 0 as erased, so a cell holds the inverse of the
+ * bit the filesystem sees: erase clears to 0 and a program can only set bits.
+ */
+
+#ifndef FLASHSIM_H
+#define FLASHSIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "redsfs.h"
+
+typedef struct flashsim__config {
+    uint32_t	sector;         // Erase sector size
+    uint32_t	page;           // Program page size, programs split on page boundaries
+    uint32_t	bus;            // Data lines (1 SPI, 2 dual, 4 quad, 8 octal)
+    uint32_t	mhz;            // Bus clock
+    uint32_t	cmd_ns;         // Command/address overhead per transaction
+    uint32_t	prog_us;        // Page program time
+    uint32_t	erase_ms;       // Sector erase time
+    uint8_t	strict;         // Programs only set bits, as the device would, instead of counting and carrying on
+} flashsim_config;
+
+typedef struct flashsim__stats {
+    uint64_t	time_ns;        // Total simulated time
+    uint64_t	read_ns;
+    uint64_t	prog_ns;
+    uint64_t	erase_ns;
+    uint64_t	reads;          // Read transactions
+    uint64_t	read_bytes;
+    uint64_t	progs;          // Program calls
+    uint64_t	prog_pages;     // Page programs they split into
+    uint64_t	prog_bytes;
+    uint64_t	erases;         // Sectors erased
+    uint64_t	violations;     // Programs that needed a bit cleared without an erase
+} flashsim_stats;
+
+// Parse "key=value,..." over the defaults (sector, page, bus, mhz, cmd_ns, prog_us,
+// erase_ms, strict), "defaults" keeps them all. Returns -1 on an unknown key.
+int flashsim_parse ( flashsim_config * cfg, char * spec );
+
+// Simulate over mem, size bytes, which holds the image as redsfs sees it
+int flashsim_init ( flashsim_config * cfg, uint8_t * mem, uint32_t size );
+void flashsim_free ();
+
+// redsfs calling functions
+uint32_t flashsim_read ( uint32_t addr, uint32_t size, uint8_t * dest );
+uint32_t flashsim_write ( uint32_t addr, uint32_t size, uint8_t * src );
+uint32_t flashsim_readv ( redsfs_iov * iov, uint32_t cnt );
+uint32_t flashsim_readstride ( uint32_t addr, uint32_t size, uint32_t stride, uint32_t cnt, uint8_t * dest );
+uint32_t flashsim_writev ( redsfs_iov * iov, uint32_t cnt );
+uint32_t flashsim_erase ( uint32_t addr, uint32_t size );
+
+flashsim_stats * flashsim_get_stats ();
+void flashsim_report ( FILE * out );
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * Synthetic workload benchmark for redsimg
+ *
+ * Each round writes the file set, lists it, reads it back and checks the
+ * contents, then deletes it. Wall clock latency is taken around every API call,
+ * callback counts are taken per phase, and the mount's own redsfs_stats close
+ * the report.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "redsbench.h"
+
+#define BENCH_OP_OPEN_W	0
+#define BENCH_OP_WRITE	1
+#define BENCH_OP_CLOSE	2
+#define BENCH_OP_NEXT	3
+#define BENCH_OP_OPEN_R	4
+#define BENCH_OP_READ	5
+#define BENCH_OP_DELETE	6
+#define BENCH_OPS	7
+
+#define BENCH_PHASES	4
+
+typedef struct bench__op {
+    const char *	name;
+    uint64_t *	ns;             // Every call's latency
+    uint32_t	cnt;
+    uint32_t	cap;
+    uint64_t	bytes;
+    uint64_t	total_ns;
+} bench_op;
+
+typedef struct bench__io {
+    uint64_t	read;
+    uint64_t	read_bytes;
+    uint64_t	readv;
+    uint64_t	readv_bytes;
+    uint64_t	write;
+    uint64_t	write_bytes;
+    uint64_t	writev;
+    uint64_t	writev_bytes;
+    uint64_t	erase;
+    uint64_t	erase_bytes;
+} bench_io;
+
+static const char * bench_op_names[BENCH_OPS] = { "open_w", "write", "close", "next_file", "open_r", "read", "delete" };
+static const char * bench_phase_names[BENCH_PHASES] = { "write", "list", "read", "delete" };
+static const char * bench_redsfs_op_names[REDSFS_OPS] = { "mount", "unmount", "open", "close", "read", "write", "seek",
+                                                          "size", "delete", "next_file", "sync", "flush", "gc" };
+static const char * bench_dist_names[] = { "fixed", "uniform", "log" };
+
+static bench_op bench_ops[BENCH_OPS];
+static bench_io bench_cnt;
+static bench_io bench_phase[BENCH_PHASES];
+
+// The callbacks the counting wrappers pass on to
+static flash_read bench_read_f;
+static flash_write bench_write_f;
+static flash_readv bench_readv_f;
+static flash_readstride bench_readstride_f;
+static flash_writev bench_writev_f;
+static flash_erase bench_erase_f;
+
+static uint32_t bench_read ( uint32_t addr, uint32_t size, uint8_t * dest )
+{
+    bench_cnt.read++;
+    bench_cnt.read_bytes += size;
+    return bench_read_f( addr, size, dest );
+}
+
+static uint32_t bench_write ( uint32_t addr, uint32_t size, uint8_t * src )
+{
+    bench_cnt.write++;
+    bench_cnt.write_bytes += size;
+    return bench_write_f( addr, size, src );
+}
+
+static uint32_t bench_readv ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    bench_cnt.readv++;
+    for ( i = 0; i < cnt; i++ )
+        bench_cnt.readv_bytes += iov[i].size;
+    return bench_readv_f( iov, cnt );
+}
+
+// A strided read is one transaction, counted with the vectored ones
+static uint32_t bench_readstride ( uint32_t addr, uint32_t size, uint32_t stride, uint32_t cnt, uint8_t * dest )
+{
+    bench_cnt.readv++;
+    bench_cnt.readv_bytes += size * cnt;
+    return bench_readstride_f( addr, size, stride, cnt, dest );
+}
+
+static uint32_t bench_writev ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    bench_cnt.writev++;
+    for ( i = 0; i < cnt; i++ )
+        bench_cnt.writev_bytes += iov[i].size;
+    return bench_writev_f( iov, cnt );
+}
+
+static uint32_t bench_erase ( uint32_t addr, uint32_t size )
+{
+    bench_cnt.erase++;
+    bench_cnt.erase_bytes += size;
+    return bench_erase_f( addr, size );
+}
+
+void redsbench_hook ( redsfs_fs * fs )
+{
+    bench_read_f = fs->call_read_f;
+    bench_write_f = fs->call_write_f;
+    bench_readv_f = fs->call_readv_f;
+    bench_readstride_f = fs->call_readstride_f;
+    bench_writev_f = fs->call_writev_f;
+    bench_erase_f = fs->call_erase_f;
+
+    fs->call_read_f = bench_read;
+    fs->call_write_f = bench_write;
+    // The optional ones stay unset so redsfs keeps its own fallback
+    if ( fs->call_readv_f )
+        fs->call_readv_f = bench_readv;
+    if ( fs->call_readstride_f )
+        fs->call_readstride_f = bench_readstride;
+    if ( fs->call_writev_f )
+        fs->call_writev_f = bench_writev;
+    if ( fs->call_erase_f )
+        fs->call_erase_f = bench_erase;
+}
+
+int redsbench_parse ( redsbench_config * cfg, char * spec )
+{
+    char * key;
+    char * val;
+    char * save;
+
+    cfg->files = 100;
+    cfg->min = 0;
+    cfg->max = 4096;
+    cfg->dist = BENCH_DIST_UNIFORM;
+    cfg->chunk = 256;
+    cfg->rounds = 1;
+    cfg->seed = 1;
+    cfg->hint = 0;
+
+    for ( key = strtok_r( spec, ",", &save ); key != NULL; key = strtok_r( NULL, ",", &save ) ) {
+        val = strchr( key, '=' );
+        if ( val != NULL )
+            *val++ = 0;
+        if ( strcmp( key, "defaults" ) == 0 )
+            continue;
+        if ( strcmp( key, "hint" ) == 0 ) {
+            cfg->hint = ( val == NULL ) ? 1 : strtoul( val, 0, 0 );
+            continue;
+        }
+        if ( val == NULL )
+            return -1;
+        if ( strcmp( key, "files" ) == 0 ) cfg->files = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "min" ) == 0 ) cfg->min = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "max" ) == 0 ) cfg->max = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "chunk" ) == 0 ) cfg->chunk = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "rounds" ) == 0 ) cfg->rounds = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "seed" ) == 0 ) cfg->seed = strtoul( val, 0, 0 );
+        else if ( strcmp( key, "dist" ) == 0 ) {
+            if ( strcmp( val, "fixed" ) == 0 ) cfg->dist = BENCH_DIST_FIXED;
+            else if ( strcmp( val, "uniform" ) == 0 ) cfg->dist = BENCH_DIST_UNIFORM;
+            else if ( strcmp( val, "log" ) == 0 ) cfg->dist = BENCH_DIST_LOG;
+            else return -1;
+        }
+        else return -1;
+    }
+
+    if ( ( cfg->files == 0 ) || ( cfg->chunk == 0 ) || ( cfg->rounds == 0 ) || ( cfg->min > cfg->max ) )
+        return -1;
+    return 0;
+}
+
+// xorshift32, so a seed gives the same file set on every libc
+static uint32_t bench_rand ( uint32_t * state )
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint32_t bench_size ( redsbench_config * cfg, uint32_t * state )
+{
+    uint32_t span = cfg->max - cfg->min;
+    uint32_t lo;
+    uint32_t hi;
+
+    if ( ( cfg->dist == BENCH_DIST_FIXED ) || ( span == 0 ) )
+        return cfg->max;
+    if ( cfg->dist == BENCH_DIST_UNIFORM )
+        return cfg->min + bench_rand( state ) % ( span + 1 );
+
+    // Pick a power of two band between min and max, then uniform inside it
+    lo = cfg->min ? cfg->min : 1;
+    hi = lo;
+    while ( ( hi < cfg->max / 2 ) && ( bench_rand( state ) & 1 ) )
+        hi *= 2;
+    if ( hi * 2 > cfg->max )
+        return hi + bench_rand( state ) % ( cfg->max - hi + 1 );
+    return hi + bench_rand( state ) % hi;
+}
+
+// Contents depend on the file and offset, so a block from the wrong place shows
+static void bench_fill ( uint8_t * buf, uint32_t file, uint32_t off, uint32_t len, uint32_t seed )
+{
+    uint32_t i;
+    uint32_t base = ( file + 1 ) * 2654435761u ^ seed;
+
+    for ( i = 0; i < len; i++ )
+        buf[i] = (uint8_t)( base + ( off + i ) * 7 + ( ( off + i ) >> 8 ) );
+}
+
+static uint64_t bench_now ()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_record ( uint8_t op, uint64_t start, uint64_t bytes )
+{
+    bench_op * o = &bench_ops[op];
+    uint64_t ns = bench_now() - start;
+
+    if ( o->cnt == o->cap ) {
+        o->cap = o->cap ? o->cap * 2 : 256;
+        o->ns = realloc( o->ns, o->cap * sizeof(uint64_t) );
+        if ( o->ns == NULL ) {
+            printf("Bench: out of memory\r\n");
+            exit(-1);
+        }
+    }
+    o->ns[o->cnt++] = ns;
+    o->bytes += bytes;
+    o->total_ns += ns;
+}
+
+static void bench_phase_end ( uint8_t phase, bench_io * start )
+{
+    bench_io * p = &bench_phase[phase];
+
+    p->read += bench_cnt.read - start->read;
+    p->read_bytes += bench_cnt.read_bytes - start->read_bytes;
+    p->readv += bench_cnt.readv - start->readv;
+    p->readv_bytes += bench_cnt.readv_bytes - start->readv_bytes;
+    p->write += bench_cnt.write - start->write;
+    p->write_bytes += bench_cnt.write_bytes - start->write_bytes;
+    p->writev += bench_cnt.writev - start->writev;
+    p->writev_bytes += bench_cnt.writev_bytes - start->writev_bytes;
+    p->erase += bench_cnt.erase - start->erase;
+    p->erase_bytes += bench_cnt.erase_bytes - start->erase_bytes;
+    *start = bench_cnt;
+}
+
+static int bench_cmp ( const void * a, const void * b )
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return ( x > y ) - ( x < y );
+}
+
+static void bench_report_op ( FILE * out, bench_op * o )
+{
+    double secs = o->total_ns / 1e9;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t max = 0;
+
+    if ( o->cnt ) {
+        qsort( o->ns, o->cnt, sizeof(uint64_t), bench_cmp );
+        p50 = o->ns[( o->cnt - 1 ) * 50 / 100];
+        p99 = o->ns[( o->cnt - 1 ) * 99 / 100];
+        max = o->ns[o->cnt - 1];
+    }
+    fprintf( out, "op=%s count=%u bytes=%llu total_ns=%llu ops_s=%.1f mb_s=%.3f p50_ns=%llu p99_ns=%llu max_ns=%llu\n",
+             o->name, o->cnt, (unsigned long long)o->bytes, (unsigned long long)o->total_ns,
+             secs > 0 ? o->cnt / secs : 0.0, secs > 0 ? o->bytes / secs / 1e6 : 0.0,
+             (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)max );
+}
+
+int redsbench_run ( redsbench_config * cfg, redsfs_fs * fs, FILE * out )
+{
+    uint32_t * sizes;
+    int64_t * stored;           // Bytes that made it into each file, -1 when its open failed
+    uint8_t * buf;
+    uint8_t * want;
+    char name[32];
+    uint32_t state;
+    uint32_t round;
+    uint32_t i;
+    uint32_t off;
+    uint32_t len;
+    uint64_t t;
+    size_t n;
+    bench_io mark;
+    redsfs_stats * st;
+    uint32_t listed = 0;
+    uint32_t full = 0;
+    uint32_t failed = 0;
+    uint64_t total = 0;
+
+    sizes = malloc( cfg->files * sizeof(uint32_t) );
+    stored = malloc( cfg->files * sizeof(int64_t) );
+    buf = malloc( cfg->chunk );
+    want = malloc( cfg->chunk );
+    if ( !sizes || !stored || !buf || !want ) {
+        printf("Bench: out of memory\r\n");
+        exit(-1);
+    }
+
+    memset( bench_ops, 0, sizeof(bench_ops) );
+    memset( bench_phase, 0, sizeof(bench_phase) );
+    for ( i = 0; i < BENCH_OPS; i++ )
+        bench_ops[i].name = bench_op_names[i];
+
+    state = cfg->seed ? cfg->seed : 1;
+    for ( i = 0; i < cfg->files; i++ ) {
+        sizes[i] = bench_size( cfg, &state );
+        total += sizes[i];
+    }
+
+    mark = bench_cnt;
+    for ( round = 0; round < cfg->rounds; round++ ) {
+        // Write the set, stopping each file where the image runs out
+        for ( i = 0; i < cfg->files; i++ ) {
+            snprintf( name, sizeof(name), "bench%05u", i );
+            t = bench_now();
+            if ( ( cfg->hint ? redsfs_open_ex( name, MODE_WRITE, sizes[i] ) : redsfs_open( name, MODE_WRITE ) ) < 0 ) {
+                stored[i] = -1;
+                full++;
+                continue;
+            }
+            bench_record( BENCH_OP_OPEN_W, t, 0 );
+            stored[i] = 0;
+            for ( off = 0; off < sizes[i]; off += len ) {
+                len = sizes[i] - off;
+                if ( len > cfg->chunk )
+                    len = cfg->chunk;
+                bench_fill( buf, i, off, len, cfg->seed );
+                t = bench_now();
+                n = redsfs_write( (char *)buf, len );
+                bench_record( BENCH_OP_WRITE, t, n );
+                stored[i] += n;
+                if ( n < len ) {
+                    full++;
+                    break;
+                }
+            }
+            t = bench_now();
+            redsfs_close();
+            bench_record( BENCH_OP_CLOSE, t, 0 );
+        }
+        bench_phase_end( 0, &mark );
+
+        // List, the final call that finds nothing left included
+        do {
+            t = bench_now();
+            n = ( redsfs_next_file() != NULL );
+            bench_record( BENCH_OP_NEXT, t, 0 );
+            listed += n;
+        } while ( n );
+        bench_phase_end( 1, &mark );
+
+        // Read back and check
+        for ( i = 0; i < cfg->files; i++ ) {
+            if ( stored[i] < 0 )
+                continue;
+            snprintf( name, sizeof(name), "bench%05u", i );
+            t = bench_now();
+            if ( redsfs_open( name, MODE_READ ) < 0 ) {
+                failed++;
+                continue;
+            }
+            bench_record( BENCH_OP_OPEN_R, t, 0 );
+            off = 0;
+            do {
+                t = bench_now();
+                n = redsfs_read( (char *)buf, cfg->chunk );
+                bench_record( BENCH_OP_READ, t, n );
+                bench_fill( want, i, off, n, cfg->seed );
+                if ( memcmp( buf, want, n ) != 0 )
+                    break;
+                off += n;
+            } while ( n == cfg->chunk );
+            redsfs_close();
+            if ( off != stored[i] )
+                failed++;
+        }
+        bench_phase_end( 2, &mark );
+
+        for ( i = 0; i < cfg->files; i++ ) {
+            if ( stored[i] < 0 )
+                continue;
+            snprintf( name, sizeof(name), "bench%05u", i );
+            t = bench_now();
+            redsfs_delete( name );
+            bench_record( BENCH_OP_DELETE, t, 0 );
+        }
+        bench_phase_end( 3, &mark );
+    }
+
+    fprintf( out, "bench image=%u block=%u opts=%u files=%u min=%u max=%u dist=%s chunk=%u rounds=%u seed=%u hint=%u set_bytes=%llu\n",
+             fs->fs_end - fs->fs_start, fs->fs_block_size, fs->fs_opts, cfg->files, cfg->min, cfg->max,
+             bench_dist_names[cfg->dist], cfg->chunk, cfg->rounds, cfg->seed, cfg->hint, (unsigned long long)total );
+    for ( i = 0; i < BENCH_OPS; i++ ) {
+        bench_report_op( out, &bench_ops[i] );
+        free( bench_ops[i].ns );
+        bench_ops[i].ns = NULL;
+    }
+    for ( i = 0; i < BENCH_PHASES; i++ ) {
+        bench_io * p = &bench_phase[i];
+        fprintf( out, "phase=%s read=%llu read_bytes=%llu readv=%llu readv_bytes=%llu write=%llu write_bytes=%llu "
+                 "writev=%llu writev_bytes=%llu erase=%llu erase_bytes=%llu\n", bench_phase_names[i],
+                 (unsigned long long)p->read, (unsigned long long)p->read_bytes, (unsigned long long)p->readv,
+                 (unsigned long long)p->readv_bytes, (unsigned long long)p->write, (unsigned long long)p->write_bytes,
+                 (unsigned long long)p->writev, (unsigned long long)p->writev_bytes, (unsigned long long)p->erase,
+                 (unsigned long long)p->erase_bytes );
+    }
+    st = redsfs_get_stats();
+    fprintf( out, "stats allocs=%u alloc_scan=%u cache_hits=%u cache_misses=%u index_probes=%u read_blocks=%u write_blocks=%u"
+             " rcache_hits=%u rcache_misses=%u readahead=%u crc_errors=%u\n",
+             st->allocs, st->alloc_scan, st->cache_hits, st->cache_misses, st->index_probes, st->read_blocks, st->write_blocks,
+             st->rcache_hits, st->rcache_misses, st->readahead, st->crc_errors );
+    for ( i = 0; i < REDSFS_OPS; i++ ) {
+        if ( st->op[i].calls == 0 )
+            continue;
+        fprintf( out, "opstat=%s calls=%u reads=%u read_bytes=%u writes=%u write_bytes=%u erases=%u blocks=%u\n",
+                 bench_redsfs_op_names[i], st->op[i].calls, st->op[i].reads, st->op[i].read_bytes, st->op[i].writes,
+                 st->op[i].write_bytes, st->op[i].erases, st->op[i].blocks );
+    }
+    fprintf( out, "result listed=%u short=%u failed=%u\n", listed, full, failed );
+
+    free( sizes );
+    free( stored );
+    free( buf );
+    free( want );
+    return failed;
+}
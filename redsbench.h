@@ -0,0 +1,43 @@
+/*
+ * Synthetic workload benchmark for redsimg
+ *
+ * Writes, lists, reads back and deletes a generated file set through the
+ * redsfs API on the mounted image, timing every call and counting what each
+ * phase asks of the flash callbacks. Results are printed as key=value lines so
+ * runs against different releases can be diffed.
+ */
+
+#ifndef REDSBENCH_H
+#define REDSBENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "redsfs.h"
+
+#define BENCH_DIST_FIXED	0   // Every file max bytes
+#define BENCH_DIST_UNIFORM	1   // Uniform from min to max
+#define BENCH_DIST_LOG		2   // Log-uniform from min to max, mostly small files
+
+typedef struct redsbench__config {
+    uint32_t	files;          // Files in the set
+    uint32_t	min;            // Smallest file
+    uint32_t	max;            // Largest file
+    uint8_t	dist;           // BENCH_DIST_*
+    uint32_t	chunk;          // Bytes per redsfs_write/redsfs_read call
+    uint32_t	rounds;         // Times the whole workload runs
+    uint32_t	seed;
+    uint8_t	hint;           // Open for write with the file size as a hint
+} redsbench_config;
+
+// Parse "key=value,..." over the defaults (files, min, max, dist=fixed|uniform|log,
+// chunk, rounds, seed, hint), "defaults" keeps them all. Returns -1 on a bad spec.
+int redsbench_parse ( redsbench_config * cfg, char * spec );
+
+// Route the mount's flash callbacks through counting wrappers, before it is mounted
+void redsbench_hook ( redsfs_fs * fs );
+
+// Run against the mounted filesystem, returns the number of files that failed to verify
+int redsbench_run ( redsbench_config * cfg, redsfs_fs * fs, FILE * out );
+
+#endif
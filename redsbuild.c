@@ -0,0 +1,301 @@
+/*
+ * Offline image builder for redsimg
+ *
+ * All inputs are stat'ed first and given their blocks in name order, so the
+ * layout is known before any data moves. Every block header follows from a
+ * file's size alone, which leaves the workers nothing to share but the next
+ * file to take. Small files are given an entry in a pack block instead, whose
+ * header is written up front, and workers fill in their own entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "redsbuild.h"
+
+typedef struct build__ent {
+    char	name[BLK_NAME_SIZE + 1];
+    uint32_t	size;
+    uint32_t	blk;            // First block of the run, or the pack block
+    uint32_t	blocks;
+    uint32_t	off;            // Entry offset in the pack block, 0 if not packed
+} build_ent;
+
+typedef struct build__job {
+    uint8_t *	image;
+    uint32_t	blk_sz;
+    char *	dir;
+    build_ent *	ent;
+    uint32_t	cnt;
+    uint32_t	next;           // Next file for a worker to take
+    uint32_t	failed;
+} build_job;
+
+// Blocks a file of size bytes takes, as redsfs_open_ex reserves them: the block
+// holding the end of file is a fresh one when the data fills the one before.
+static uint32_t build_blocks ( uint32_t blk_sz, uint32_t size )
+{
+    if ( size < blk_sz - BLK_OFFSET_FIRST_EXT )
+        return 1;
+    return 2 + ( size - ( blk_sz - BLK_OFFSET_FIRST_EXT ) ) / ( blk_sz - BLK_OFFSET_CHUNK );
+}
+
+static int build_cmp ( const void * a, const void * b )
+{
+    return strcmp( ((const build_ent *)a)->name, ((const build_ent *)b)->name );
+}
+
+// Entry header and name, then the data read straight in after them
+static int build_packed ( build_job * job, build_ent * e )
+{
+    uint8_t * base = job->image + e->blk * job->blk_sz + e->off;
+    redsfs_pack_ent ent;
+    uint32_t got = 0;
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    ent.name_len = strlen( e->name );
+    ent.flags = 0;
+    ent.size = e->size;
+    memcpy( base, &ent, sizeof(ent) );
+    memcpy( base + sizeof(ent), e->name, ent.name_len );
+    base += sizeof(ent) + ent.name_len;
+
+    snprintf( path, sizeof(path), "%s/%s", job->dir, e->name );
+    fd = open( path, O_RDONLY );
+    if ( fd < 0 ) {
+        printf("Build: can not open %s\r\n", path);
+        return -1;
+    }
+    while ( got < e->size ) {
+        n = read( fd, base + got, e->size - got );
+        if ( n <= 0 ) {
+            printf("Build: %s shorter than when it was planned\r\n", path);
+            close( fd );
+            return -1;
+        }
+        got += n;
+    }
+    close( fd );
+    return 0;
+}
+
+// Headers for the whole chain, then the data scattered into the blocks after them
+static int build_file ( build_job * job, build_ent * e, uint8_t * buf )
+{
+    uint32_t blk_sz = job->blk_sz;
+    uint8_t * base = job->image + e->blk * blk_sz;
+    redsfs_fb hdr;
+    uint32_t left = e->size;
+    uint32_t cap;
+    uint32_t k;
+    uint32_t off;
+    uint32_t got;
+    uint32_t piece;
+    char path[PATH_MAX];
+    ssize_t n;
+    int fd;
+
+    if ( e->off != 0 )
+        return build_packed( job, e );
+
+    for ( k = 0; k < e->blocks; k++ ) {
+        memset( &hdr, 0, sizeof(hdr) );
+        cap = ( k == 0 ) ? blk_sz - BLK_OFFSET_FIRST_EXT : blk_sz - BLK_OFFSET_CHUNK;
+        hdr.flags = ( k == 0 ) ? ( FB_IS_USED | FB_IS_FIRST | FB_HAS_EXTENTS | FB_IS_SIZED ) : ( FB_IS_USED | FB_IS_CONT );
+        if ( k == e->blocks - 1 )
+            hdr.flags |= FB_IS_LAST;
+        else
+            hdr.next_blk_addr = ( e->blk + k + 1 ) * blk_sz;
+        hdr.data.size = ( left < cap ) ? left : cap;
+        left -= hdr.data.size;
+        if ( k == 0 ) {
+            memcpy( hdr.data.namedata, e->name, strnlen( e->name, BLK_NAME_SIZE ) );
+            hdr.data.file_size = e->size;
+            hdr.data.last_blk_addr = ( e->blk + e->blocks - 1 ) * blk_sz;
+            hdr.data.ext[0].start_addr = e->blk * blk_sz;
+            hdr.data.ext[0].blocks = e->blocks;
+            memcpy( base, &hdr, BLK_OFFSET_FIRST_EXT );
+        } else {
+            memcpy( base + k * blk_sz, &hdr, BLK_OFFSET_CHUNK );
+        }
+    }
+
+    snprintf( path, sizeof(path), "%s/%s", job->dir, e->name );
+    fd = open( path, O_RDONLY );
+    if ( fd < 0 ) {
+        printf("Build: can not open %s\r\n", path);
+        return -1;
+    }
+
+    k = 0;
+    off = BLK_OFFSET_FIRST_EXT;
+    left = e->size;
+    while ( left > 0 ) {
+        n = read( fd, buf, ( left < BUILD_READ_SIZE ) ? left : BUILD_READ_SIZE );
+        if ( n <= 0 ) {
+            printf("Build: %s shorter than when it was planned\r\n", path);
+            close( fd );
+            return -1;
+        }
+        left -= n;
+        for ( got = 0; got < (uint32_t)n; got += piece ) {
+            if ( off == blk_sz ) {
+                k++;
+                off = BLK_OFFSET_CHUNK;
+            }
+            piece = blk_sz - off;
+            if ( piece > n - got )
+                piece = n - got;
+            memcpy( base + k * blk_sz + off, buf + got, piece );
+            off += piece;
+        }
+    }
+    close( fd );
+
+#if REDSFS_BLOCK_CRC
+    // Every block of the file is whole now
+    for ( k = 0; k < e->blocks; k++ ) {
+        ((redsfs_fb*)( base + k * blk_sz ))->flags |= FB_HAS_CRC;
+        ((redsfs_fb*)( base + k * blk_sz ))->crc = redsfs_block_crc( base + k * blk_sz, NULL, blk_sz );
+    }
+#endif
+    return 0;
+}
+
+static void * build_worker ( void * arg )
+{
+    build_job * job = arg;
+    uint8_t * buf = malloc( BUILD_READ_SIZE );
+    uint32_t i;
+
+    if ( buf == NULL ) {
+        __atomic_fetch_add( &job->failed, 1, __ATOMIC_RELAXED );
+        return NULL;
+    }
+    while ( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->cnt ) {
+        if ( build_file( job, &job->ent[i], buf ) < 0 )
+            __atomic_fetch_add( &job->failed, 1, __ATOMIC_RELAXED );
+    }
+    free( buf );
+    return NULL;
+}
+
+int redsbuild_dir ( uint8_t * image, uint32_t size, uint32_t blk_sz, uint32_t first_blk, char * dir, uint32_t threads )
+{
+    build_job job;
+    pthread_t * tid;
+    DIR * d;
+    struct dirent * de;
+    struct stat st;
+    char path[PATH_MAX];
+    redsfs_fb hdr;
+    uint32_t cap = 0;
+    uint32_t blk = first_blk;
+    uint32_t pack_blk = 0;
+    uint32_t pack_off = blk_sz;
+    uint32_t len;
+    uint32_t i;
+
+    memset( &job, 0, sizeof(job) );
+    job.image = image;
+    job.blk_sz = blk_sz;
+    job.dir = dir;
+
+    d = opendir( dir );
+    if ( d == NULL ) {
+        printf("Build: can not open directory %s\r\n", dir);
+        return -1;
+    }
+    while ( ( de = readdir( d ) ) != NULL ) {
+        snprintf( path, sizeof(path), "%s/%s", dir, de->d_name );
+        if ( ( stat( path, &st ) < 0 ) || !S_ISREG( st.st_mode ) )
+            continue;
+        if ( strlen( de->d_name ) > BLK_NAME_SIZE ) {
+            printf("Build: skipping %s, names are at most %d characters\r\n", de->d_name, BLK_NAME_SIZE);
+            continue;
+        }
+        if ( (uint64_t)st.st_size >= size ) {
+            printf("Build: %s is bigger than the image\r\n", de->d_name);
+            closedir( d );
+            free( job.ent );
+            return -1;
+        }
+        if ( job.cnt == cap ) {
+            cap = cap ? cap * 2 : 64;
+            job.ent = realloc( job.ent, cap * sizeof(build_ent) );
+            if ( job.ent == NULL ) {
+                printf("Build: out of memory\r\n");
+                closedir( d );
+                return -1;
+            }
+        }
+        strcpy( job.ent[job.cnt].name, de->d_name );
+        job.ent[job.cnt].size = st.st_size;
+        job.cnt++;
+    }
+    closedir( d );
+
+    // Name order, so the same directory always builds the same image
+    qsort( job.ent, job.cnt, sizeof(build_ent), build_cmp );
+    for ( i = 0; i < job.cnt; i++ ) {
+        if ( job.ent[i].size <= REDSFS_PACK_MAX ) {
+            // Packed after the last small file, or at the start of a fresh pack block
+            len = sizeof(redsfs_pack_ent) + strlen( job.ent[i].name ) + job.ent[i].size;
+            if ( pack_off + len > blk_sz ) {
+                pack_blk = blk++;
+                pack_off = BLK_OFFSET_CHUNK;
+            }
+            job.ent[i].blk = pack_blk;
+            job.ent[i].off = pack_off;
+            job.ent[i].blocks = 0;
+            pack_off += len;
+            continue;
+        }
+        job.ent[i].blk = blk;
+        job.ent[i].off = 0;
+        job.ent[i].blocks = build_blocks( blk_sz, job.ent[i].size );
+        blk += job.ent[i].blocks;
+    }
+    if ( blk > size / blk_sz ) {
+        printf("Build: %u files need %u blocks, the image has %u\r\n", job.cnt, blk, size / blk_sz);
+        free( job.ent );
+        return -1;
+    }
+    // Pack block headers, the entries go in with the data
+    for ( i = 0; i < job.cnt; i++ ) {
+        if ( job.ent[i].off == BLK_OFFSET_CHUNK ) {
+            memset( &hdr, 0, sizeof(hdr) );
+            hdr.flags = FB_IS_USED | FB_IS_PACK | FB_IS_LAST;
+            memcpy( image + job.ent[i].blk * blk_sz, &hdr, BLK_OFFSET_CHUNK );
+        }
+    }
+
+    if ( threads < 1 )
+        threads = 1;
+    if ( threads > job.cnt )
+        threads = job.cnt ? job.cnt : 1;
+    tid = malloc( threads * sizeof(pthread_t) );
+    for ( i = 0; ( tid != NULL ) && ( i < threads ); i++ ) {
+        if ( pthread_create( &tid[i], NULL, build_worker, &job ) != 0 )
+            break;
+    }
+    // No thread would start, do the work here
+    if ( i == 0 )
+        build_worker( &job );
+    while ( i > 0 )
+        pthread_join( tid[--i], NULL );
+    free( tid );
+
+    printf("Built %u files in %u blocks with %u threads\r\n", job.cnt, blk - first_blk, threads);
+    free( job.ent );
+    return job.failed ? -1 : (int)job.cnt;
+}
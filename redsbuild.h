@@ -0,0 +1,26 @@
+/*
+ * Offline image builder for redsimg
+ *
+ * Lays a directory of files out in an empty image directly, each file one
+ * contiguous run of blocks recorded as its extent, with the same block headers
+ * redsfs_write and redsfs_close would have written. Files of up to
+ * REDSFS_PACK_MAX bytes share pack blocks. Input files are read by worker
+ * threads straight into their blocks of the mapped image.
+ */
+
+#ifndef REDSBUILD_H
+#define REDSBUILD_H
+
+#include <stdint.h>
+
+#include "redsfs.h"
+
+// Bytes a worker reads from an input file at a time
+#define BUILD_READ_SIZE ( 1024 * 1024 )
+
+// Build every regular file in dir into the zeroed image of size bytes at image,
+// from block first_blk on (blocks before it are left free, e.g. for a superblock).
+// Returns the number of files written, -1 if they do not fit or one can not be read.
+int redsbuild_dir ( uint8_t * image, uint32_t size, uint32_t blk_sz, uint32_t first_blk, char * dir, uint32_t threads );
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Parallel export for redsimg
+ *
+ * Opening a file takes the mount lock for the index lookup, reading it only
+ * touches the worker's own handle, so the workers run side by side over the
+ * mapped image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "redsexport.h"
+
+typedef struct export__job {
+    redsfs_fs *	fs;
+    char *	dir;
+    char	(*names)[BLK_NAME_SIZE + 1];
+    uint32_t	cnt;
+    uint32_t	next;           // Next file for a worker to take
+    uint32_t	failed;
+    uint64_t	bytes;
+} export_job;
+
+static pthread_mutex_t export_mutex;
+static pthread_once_t export_once = PTHREAD_ONCE_INIT;
+
+// Recursive, the mount's block cache takes the lock inside other locked sections
+static void export_lock_init ( void )
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &export_mutex, &attr );
+    pthread_mutexattr_destroy( &attr );
+}
+
+void redsexport_lock ( redsfs_fs * fs, uint8_t take )
+{
+    (void)fs;
+    pthread_once( &export_once, export_lock_init );
+    if ( take )
+        pthread_mutex_lock( &export_mutex );
+    else
+        pthread_mutex_unlock( &export_mutex );
+}
+
+static int export_file ( export_job * job, char * name, char * buf )
+{
+    redsfs_fh fh;
+    char path[PATH_MAX];
+    size_t n;
+    ssize_t w;
+    size_t done;
+    ssize_t size;
+    uint64_t got = 0;
+    int8_t bad;
+    int fd;
+
+    memset( &fh, 0, sizeof(fh) );
+    if ( redsfs_open_r( job->fs, &fh, name, MODE_READ ) < 0 ) {
+        printf("Export: can not open %s\r\n", name);
+        return -1;
+    }
+
+    snprintf( path, sizeof(path), "%s/%s", job->dir, name );
+    fd = open( path, O_CREAT | O_TRUNC | O_WRONLY, 0644 );
+    if ( fd < 0 ) {
+        printf("Export: can not create %s\r\n", path);
+        redsfs_close_r( &fh );
+        return -1;
+    }
+
+    while ( ( n = redsfs_read_r( &fh, buf, EXPORT_BUF_SIZE ) ) > 0 ) {
+        for ( done = 0; done < n; done += w ) {
+            w = write( fd, buf + done, n - done );
+            if ( w <= 0 ) {
+                printf("Export: writing %s failed\r\n", path);
+                close( fd );
+                redsfs_close_r( &fh );
+                return -1;
+            }
+        }
+        __atomic_fetch_add( &job->bytes, n, __ATOMIC_RELAXED );
+        got += n;
+    }
+
+    // A read that stops early is not the end of the file
+    size = redsfs_cur_file_size_r( &fh );
+    bad = redsfs_error_r( &fh );
+    close( fd );
+    redsfs_close_r( &fh );
+    if ( bad < 0 ) {
+        printf("Export: %s has a block failing its CRC\r\n", name);
+        return -1;
+    }
+    if ( got != (uint64_t)size ) {
+        printf("Export: %s ended after %llu of %lld bytes\r\n", name, (unsigned long long)got, (long long)size);
+        return -1;
+    }
+    return 0;
+}
+
+static void * export_worker ( void * arg )
+{
+    export_job * job = arg;
+    char * buf = malloc( EXPORT_BUF_SIZE );
+    uint32_t i;
+
+    if ( buf == NULL ) {
+        __atomic_fetch_add( &job->failed, 1, __ATOMIC_RELAXED );
+        return NULL;
+    }
+    while ( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->cnt ) {
+        if ( export_file( job, job->names[i], buf ) < 0 )
+            __atomic_fetch_add( &job->failed, 1, __ATOMIC_RELAXED );
+    }
+    free( buf );
+    return NULL;
+}
+
+int redsexport_dir ( redsfs_fs * fs, char * dir, uint32_t threads )
+{
+    export_job job;
+    pthread_t * tid;
+    struct stat st;
+    char * name;
+    char ( *names )[BLK_NAME_SIZE + 1];
+    uint32_t cap = 0;
+    uint32_t i;
+
+    memset( &job, 0, sizeof(job) );
+    job.fs = fs;
+    job.dir = dir;
+
+    if ( stat( dir, &st ) == -1 )
+        mkdir( dir, 0755 );
+
+    // The listing position is mount state, so the names are taken once up front
+    while ( ( name = redsfs_next_file_r( fs ) ) != NULL ) {
+        if ( job.cnt == cap ) {
+            cap = cap ? cap * 2 : 64;
+            names = realloc( job.names, cap * sizeof(*job.names) );
+            if ( names == NULL ) {
+                printf("Export: out of memory\r\n");
+                free( job.names );
+                return -1;
+            }
+            job.names = names;
+        }
+        strncpy( job.names[job.cnt], name, BLK_NAME_SIZE );
+        job.names[job.cnt][BLK_NAME_SIZE] = 0;
+        job.cnt++;
+    }
+
+    if ( threads < 1 )
+        threads = 1;
+    if ( threads > job.cnt )
+        threads = job.cnt ? job.cnt : 1;
+    tid = malloc( threads * sizeof(pthread_t) );
+    if ( tid == NULL ) {
+        printf("Export: out of memory\r\n");
+        free( job.names );
+        return -1;
+    }
+    for ( i = 0; i < threads; i++ ) {
+        if ( pthread_create( &tid[i], NULL, export_worker, &job ) != 0 )
+            break;
+    }
+    // No thread would start, do the work here
+    if ( i == 0 )
+        export_worker( &job );
+    while ( i > 0 )
+        pthread_join( tid[--i], NULL );
+    free( tid );
+
+    printf("Exported %u files (%llu bytes) with %u threads\r\n", job.cnt - job.failed,
+           (unsigned long long)job.bytes, threads);
+    free( job.names );
+    return job.failed ? -1 : (int)job.cnt;
+}
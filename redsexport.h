@@ -0,0 +1,25 @@
+/*
+ * Parallel export for redsimg
+ *
+ * Lists the files of a reentrant mount once, then worker threads each open
+ * their own handle on it and copy files out in large reads and writes.
+ */
+
+#ifndef REDSEXPORT_H
+#define REDSEXPORT_H
+
+#include <stdint.h>
+
+#include "redsfs.h"
+
+// Bytes a worker reads from redsfs and writes out at a time
+#define EXPORT_BUF_SIZE ( 1024 * 1024 )
+
+// Mount lock for the call_lock_f of the mount handed to redsexport_dir
+void redsexport_lock ( redsfs_fs * fs, uint8_t take );
+
+// Copy every file of the mounted fs into dir, creating it if needed, with threads workers.
+// Returns the number of files exported, -1 if any could not be.
+int redsexport_dir ( redsfs_fs * fs, char * dir, uint32_t threads );
+
+#endif
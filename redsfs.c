@@ -7,423 +7,4090 @@
 
 // GLOBAL Vars
 
+// Mount and file used by the single file global API below, the _r calls
+// take their own instances.
 redsfs_fs r_fsys;
 redsfs_fh r_fhand;
-uint32_t seek_chunk; // For seeking through filesystem (ls)
 
-// File in/out cache
-uint8_t * redsfs_cache;
+#define INDEX_MIN_CAP 64
+#define DIR_MIN_CAP 16
 
-// File Seeker cache (only needs to seek headers 40bytes, but keeping 256 for strictness)
-// separate to file cache so we dont damage the file cache when seeking new blank blocks
-uint8_t * redsfs_seek_cache;
+// Serialise changes to the shared mount state (free map, index, listing)
+#define REDSFS_LOCK(fs)   do { if ( (fs)->call_lock_f ) (fs)->call_lock_f( (fs), 1 ); } while (0)
+#define REDSFS_UNLOCK(fs) do { if ( (fs)->call_lock_f ) (fs)->call_lock_f( (fs), 0 ); } while (0)
 
-// Helper functions
-int32_t redsfs_next_empty_block()
+// Add n to a counter of the mount's stats
+#if REDSFS_USE_STATS
+#define REDSFS_COUNT(fs, field, n) do { (fs)->stats.field += (n); } while (0)
+#else
+#define REDSFS_COUNT(fs, field, n) do { } while (0)
+#endif
+
+// Heap, only ever asked for in a static build to grow something, which it then does without
+#if REDSFS_STATIC
+#define REDSFS_MALLOC(size)       NULL
+#define REDSFS_CALLOC(cnt, size)  NULL
+#define REDSFS_REALLOC(ptr, size) NULL
+#define REDSFS_FREE(ptr)          do { } while (0)
+#else
+#define REDSFS_MALLOC(size)       malloc( size )
+#define REDSFS_CALLOC(cnt, size)  calloc( cnt, size )
+#define REDSFS_REALLOC(ptr, size) realloc( ptr, size )
+#define REDSFS_FREE(ptr)          free( ptr )
+#endif
+
+static void redsfs_super_dirty( redsfs_fs * fs );
+static int32_t redsfs_do_gc( redsfs_fs * fs, uint32_t budget );
+static int8_t redsfs_do_sync( redsfs_fs * fs );
+#if REDSFS_USE_LZ
+static int8_t redsfs_lz_reset( redsfs_fh * fh );
+#endif
+
+// Flash access, counted in the mount's stats
+
+#if REDSFS_USE_STATS
+// Blocks a transfer touches
+static uint32_t redsfs_io_span( redsfs_fs * fs, uint32_t addr, uint32_t size )
 {
-    uint32_t chunk;
-    uint8_t rres;
+    if ( size == 0 )
+        return 0;
+    return ( addr - fs->fs_start + size - 1 ) / BLK_SZ(fs) - ( addr - fs->fs_start ) / BLK_SZ(fs) + 1;
+}
+#endif
 
-    // Check we are mounted
-    if (r_fsys.mounted != 1) {
-        printf("Not mounted error\r\n");
+static uint32_t redsfs_io_flash_read( redsfs_fs * fs, uint32_t addr, uint32_t size, uint8_t * dst )
+{
+    REDSFS_COUNT( fs, reads, 1 );
+    REDSFS_COUNT( fs, read_bytes, size );
+    REDSFS_COUNT( fs, read_blocks, redsfs_io_span( fs, addr, size ) );
+    return fs->call_read_f( addr, size, dst );
+}
+
+#if REDSFS_USE_CACHE
+// Mount block cache (fs_cache_blocks). Whole block reads fill it, reads that fall
+// inside a cached block are served from it, and anything written or erased over
+// a cached block drops it. Misses on headers alone leave it be, so the mount scan
+// and header walks do not fetch whole blocks.
+
+// Slot holding the block at chunk, -1 if it is not cached
+static int32_t redsfs_rc_find( redsfs_fs * fs, uint32_t chunk )
+{
+    uint32_t i;
+
+    for ( i = 0; i < fs->fs_cache_blocks; i++ ) {
+        if ( fs->rcache_slot[i].blk == chunk )
+            return i;
+    }
+    return -1;
+}
+
+// Serve a read of size bytes at off in the block at chunk from the cache. A miss on
+// a whole block fills the least recently used slot, and up to ra blocks following on
+// in flash go into the slots after it in the same request.
+// Returns -1 when the read has to go to flash.
+static int8_t redsfs_rc_read( redsfs_fs * fs, uint32_t chunk, uint32_t off, uint32_t size, uint8_t * dst, uint32_t ra )
+{
+    uint32_t slot;
+    uint32_t cnt;
+    uint32_t i;
+    int32_t hit;
+
+    REDSFS_LOCK(fs);
+    hit = redsfs_rc_find( fs, chunk );
+    if ( hit >= 0 ) {
+        REDSFS_COUNT( fs, rcache_hits, 1 );
+        fs->rcache_slot[hit].used = ++fs->rcache_tick;
+        memcpy( dst, fs->rcache + hit * BLK_SZ(fs) + off, size );
+        REDSFS_UNLOCK(fs);
+        return 0;
+    }
+    if ( size != BLK_SZ(fs) ) {
+        REDSFS_UNLOCK(fs);
         return -1;
     }
 
-    // Check the filesystem and find the first block not marked as used.
-    for ( chunk = r_fsys.fs_start; chunk < r_fsys.fs_end; chunk += r_fsys.fs_block_size )
-    {
-        rres = r_fsys.call_read_f ( chunk, 40, redsfs_seek_cache );
-        if ( ((redsfs_fb*)redsfs_seek_cache)->flags & ( FB_IS_USED ) ) {
-	    continue;
-	} else {
-            return chunk;
-	}
+    // Read ahead up to the first block already cached
+    if ( ra > fs->fs_cache_blocks / 2 )
+        ra = fs->fs_cache_blocks / 2;
+    if ( ra > ( fs->fs_end - chunk ) / BLK_SZ(fs) - 1 )
+        ra = ( fs->fs_end - chunk ) / BLK_SZ(fs) - 1;
+    for ( cnt = 1; ( cnt <= ra ) && ( redsfs_rc_find( fs, chunk + cnt * BLK_SZ(fs) ) < 0 ); cnt++ )
+        ;
+
+    slot = 0;
+    for ( i = 1; i < fs->fs_cache_blocks; i++ ) {
+        if ( fs->rcache_slot[i].used < fs->rcache_slot[slot].used )
+            slot = i;
     }
-    printf("Out of space\r\n");
-    return -2;
+    if ( slot + cnt > fs->fs_cache_blocks )
+        slot = fs->fs_cache_blocks - cnt;
+
+    REDSFS_COUNT( fs, rcache_misses, 1 );
+    REDSFS_COUNT( fs, readahead, cnt - 1 );
+    redsfs_io_flash_read( fs, chunk, cnt * BLK_SZ(fs), fs->rcache + slot * BLK_SZ(fs) );
+    for ( i = 0; i < cnt; i++ ) {
+        fs->rcache_slot[slot + i].blk = chunk + i * BLK_SZ(fs);
+        fs->rcache_slot[slot + i].used = ++fs->rcache_tick;
+    }
+    memcpy( dst, fs->rcache + slot * BLK_SZ(fs), size );
+    REDSFS_UNLOCK(fs);
+    return 0;
 }
+#endif
 
-char * redsfs_next_file()
+// Drop the cached blocks size bytes at addr touch, ahead of writing or erasing them
+static void redsfs_rc_drop( redsfs_fs * fs, uint32_t addr, uint32_t size )
 {
-    uint32_t chunk;
-    uint8_t rres;
+#if REDSFS_USE_CACHE
+    uint32_t first = addr - ( addr - fs->fs_start ) % BLK_SZ(fs);
+    uint32_t i;
 
-    // Check we are mounted
-    if (r_fsys.mounted != 1) {
-        return NULL;
+    if ( ( fs->rcache == NULL ) || ( size == 0 ) )
+        return;
+
+    REDSFS_LOCK(fs);
+    for ( i = 0; i < fs->fs_cache_blocks; i++ ) {
+        if ( ( fs->rcache_slot[i].blk != REDSFS_NO_BLK ) && ( fs->rcache_slot[i].blk >= first ) &&
+             ( fs->rcache_slot[i].blk < addr + size ) ) {
+            fs->rcache_slot[i].blk = REDSFS_NO_BLK;
+            fs->rcache_slot[i].used = 0;
+        }
     }
+    REDSFS_UNLOCK(fs);
+#else
+    (void)fs;
+    (void)addr;
+    (void)size;
+#endif
+}
 
-    // Check and seek through the file system
-    for ( chunk = seek_chunk; chunk < r_fsys.fs_end; chunk += r_fsys.fs_block_size ) {
-        rres = r_fsys.call_read_f ( chunk, 40, redsfs_seek_cache );
-	// Do we have a new file header block?
-        if ( ((redsfs_fb*)redsfs_seek_cache)->flags & ( FB_IS_FIRST ) ) {
-            // Update our current seeking mark to the next one
-	    seek_chunk = chunk + r_fsys.fs_block_size;
-	    // Read the current full block, with filename
-	    rres = r_fsys.call_read_f ( chunk, 256, redsfs_seek_cache );
-	    // Return the file name of the current block
-            return ((redsfs_fb*)redsfs_seek_cache)->data.namedata;
-	} else {
-	    // Keep going until we find the next populated first block
+static uint32_t redsfs_io_read( redsfs_fs * fs, uint32_t addr, uint32_t size, uint8_t * dst )
+{
+#if REDSFS_USE_CACHE
+    uint32_t off = ( addr - fs->fs_start ) % BLK_SZ(fs);
+
+    if ( ( fs->rcache != NULL ) && ( size > 0 ) && ( off + size <= BLK_SZ(fs) ) &&
+         ( redsfs_rc_read( fs, addr - off, off, size, dst, 0 ) == 0 ) )
+        return 0;
+#endif
+    return redsfs_io_flash_read( fs, addr, size, dst );
+}
+
+// Whole block for a reader, with ra blocks after it fetched into the cache too
+static uint32_t redsfs_io_read_ahead( redsfs_fs * fs, uint32_t chunk, uint8_t * dst, uint32_t ra )
+{
+#if REDSFS_USE_CACHE
+    if ( ( fs->rcache != NULL ) && ( redsfs_rc_read( fs, chunk, 0, BLK_SZ(fs), dst, ra ) == 0 ) )
+        return 0;
+#else
+    (void)ra;
+#endif
+    return redsfs_io_flash_read( fs, chunk, BLK_SZ(fs), dst );
+}
+
+static uint32_t redsfs_io_write( redsfs_fs * fs, uint32_t addr, uint32_t size, uint8_t * src )
+{
+    redsfs_rc_drop( fs, addr, size );
+    REDSFS_COUNT( fs, writes, 1 );
+    REDSFS_COUNT( fs, write_bytes, size );
+    REDSFS_COUNT( fs, write_blocks, redsfs_io_span( fs, addr, size ) );
+    return fs->call_write_f( addr, size, src );
+}
+
+#if REDSFS_USE_STATS
+// Bytes and blocks of a vectored transfer, pieces of one block count it once
+static uint32_t redsfs_io_iov( redsfs_fs * fs, redsfs_iov * iov, uint32_t cnt, uint32_t * bytes )
+{
+    uint32_t blocks = 0;
+    uint32_t last = REDSFS_NO_BLK;
+    uint32_t first;
+    uint32_t i;
+
+    *bytes = 0;
+    for ( i = 0; i < cnt; i++ ) {
+        *bytes += iov[i].size;
+        if ( iov[i].size == 0 )
             continue;
-	}
+        first = ( iov[i].addr - fs->fs_start ) / BLK_SZ(fs);
+        blocks += redsfs_io_span( fs, iov[i].addr, iov[i].size ) - ( first == last );
+        last = ( iov[i].addr - fs->fs_start + iov[i].size - 1 ) / BLK_SZ(fs);
     }
-    // Update (the last block)
-    seek_chunk = chunk;
-    // Finish up returning NULL, like readdir.
-    return NULL;
+    return blocks;
 }
+#endif
 
-ssize_t redsfs_cur_file_size()
+static uint32_t redsfs_io_readv( redsfs_fs * fs, redsfs_iov * iov, uint32_t cnt )
 {
-    uint32_t chunk;
-    ssize_t fileSize = 0;
-    uint8_t rres;
+#if REDSFS_USE_STATS
+    uint32_t bytes;
 
-    // Check mount and file
-    if ( (r_fsys.mounted != 1) || (r_fhand.handle < 1) ) {
-        return 0;
+    REDSFS_COUNT( fs, reads, 1 );
+    REDSFS_COUNT( fs, read_blocks, redsfs_io_iov( fs, iov, cnt, &bytes ) );
+    REDSFS_COUNT( fs, read_bytes, bytes );
+#endif
+    return fs->call_readv_f( iov, cnt );
+}
+
+static uint32_t redsfs_io_writev( redsfs_fs * fs, redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+#if REDSFS_USE_STATS
+    uint32_t bytes;
+#endif
+
+    for ( i = 0; i < cnt; i++ )
+        redsfs_rc_drop( fs, iov[i].addr, iov[i].size );
+#if REDSFS_USE_STATS
+    REDSFS_COUNT( fs, writes, 1 );
+    REDSFS_COUNT( fs, write_blocks, redsfs_io_iov( fs, iov, cnt, &bytes ) );
+    REDSFS_COUNT( fs, write_bytes, bytes );
+#endif
+    return fs->call_writev_f( iov, cnt );
+}
+
+// cnt reads of size bytes stride apart, packed into dst. One transaction through
+// call_readstride_f or call_readv_f, a read each without either. Pieces are taken
+// to be in blocks of their own.
+static void redsfs_io_read_stride( redsfs_fs * fs, uint32_t addr, uint32_t size, uint32_t stride,
+                                   uint32_t cnt, uint8_t * dst )
+{
+    redsfs_iov iov[REDSFS_SCAN_BATCH];
+    uint32_t n;
+    uint32_t i;
+
+    if ( fs->call_readstride_f != NULL ) {
+        REDSFS_COUNT( fs, reads, 1 );
+        REDSFS_COUNT( fs, read_bytes, size * cnt );
+        REDSFS_COUNT( fs, read_blocks, cnt );
+        fs->call_readstride_f( addr, size, stride, cnt, dst );
+        return;
     }
 
-    // Scan and add file sizes.
-    // Start with first
-    chunk = r_fhand.f_start_blk;
-    rres = r_fsys.call_read_f ( chunk, 40, redsfs_seek_cache );
-    if ( ((redsfs_fb*)redsfs_seek_cache)->data.size > 0 ) {
-      while ( ( ((redsfs_fb*)redsfs_seek_cache)->flags & FB_IS_LAST) == 0) 
-      {
-        fileSize += ((redsfs_fb*)redsfs_seek_cache)->data.size;
-	chunk = r_fsys.fs_start + ((redsfs_fb*)redsfs_seek_cache)->next_blk_addr;
-        if (chunk > (r_fsys.fs_end - r_fsys.fs_block_size) )
-          break;
-	rres = r_fsys.call_read_f ( chunk, 40, redsfs_seek_cache );
-      }
-      if ( ( ((redsfs_fb*)redsfs_seek_cache)->flags & FB_IS_LAST) ) 
-        fileSize += ((redsfs_fb*)redsfs_seek_cache)->data.size;
+    while ( cnt > 0 ) {
+        n = ( cnt < REDSFS_SCAN_BATCH ) ? cnt : REDSFS_SCAN_BATCH;
+        if ( fs->call_readv_f != NULL ) {
+            for ( i = 0; i < n; i++ ) {
+                iov[i].addr = addr + i * stride;
+                iov[i].size = size;
+                iov[i].buf = dst + i * size;
+            }
+            redsfs_io_readv( fs, iov, n );
+        } else {
+            for ( i = 0; i < n; i++ )
+                redsfs_io_flash_read( fs, addr + i * stride, size, dst + i * size );
+        }
+        addr += n * stride;
+        dst += n * size;
+        cnt -= n;
     }
+}
 
-    return fileSize;
+static uint32_t redsfs_io_erase( redsfs_fs * fs, uint32_t addr, uint32_t size )
+{
+    redsfs_rc_drop( fs, addr, size );
+    REDSFS_COUNT( fs, erases, 1 );
+    REDSFS_COUNT( fs, erase_bytes, size );
+    return fs->call_erase_f( addr, size );
 }
 
-// Seek the file chunk pointer and size pointer to one past the last byte of the current file.
-void redsfs_seek_to_end()
+// Helper functions
+static void redsfs_map_mark( redsfs_fs * fs, uint32_t chunk, uint8_t used )
 {
-    uint32_t chunk;
-    uint32_t file_size;
-    uint32_t block_size;
-    int rres;
+    uint32_t blk = ( chunk - fs->fs_start ) / BLK_SZ(fs);
 
-    // Check we are mounted
-    if (r_fsys.mounted != 1)
+    if ( blk >= fs->blk_count )
         return;
-   
-    // Check we have an open file!
-    if (r_fhand.handle < 1)
-	return;
 
-    // Loop through file system to last written byte.
-    // assume we have the current chunk in the redsfs_cache
-    chunk = r_fhand.f_start_blk;
-    while ( chunk < r_fsys.fs_end )
-    {
-	rres = r_fsys.call_read_f ( chunk, 256, redsfs_cache );
-	// Check if this is the last block, if not go to next one.
-        if (( ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_USED ) &&
-              ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_LAST ) ) )
-	{
-	    // Set the pointer to the current data size, dependant on whether first or othe block.
-	    if ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_FIRST ) {
-                r_fhand.blk_curoffset = ((redsfs_fb*)redsfs_cache)->data.size + BLK_OFFSET_FIRST;
-	    } else {
-		r_fhand.blk_curoffset = ((redsfs_fb*)redsfs_cache)->data.size + BLK_OFFSET_CHUNK;
-	    }
+    // Blocks about to change, a clean checkpoint has to stop claiming otherwise
+    redsfs_super_dirty( fs );
 
-	    // Set the current chunk in handle
-	    r_fhand.f_cur_blk = chunk;
-	    break;
-	} else { // Not the last block, increment and next.
-            chunk += r_fsys.fs_block_size;
-	}
+    if ( used ) {
+        fs->free_map[blk >> 3] |= _BV(blk & 7);
+    } else {
+        fs->free_map[blk >> 3] &= ~_BV(blk & 7);
+        // Freed space below the hint has to be found again
+        if ( blk < fs->free_hint )
+            fs->free_hint = blk;
     }
-    //printf("Returning at chunk %d with offset at %d\r\n", r_fhand.f_cur_blk, r_fhand.blk_curoffset );
-    return;
 }
 
-// Main function calls
-int8_t redsfs_mount(redsfs_fs *rfs)
+// Mark or clear the block at chunk as one a scan for a file has to look at
+static void redsfs_head_mark( redsfs_fs * fs, uint32_t chunk, uint8_t head )
 {
-    // Check for header of file system, return true if function calls for read succeed with header
-    r_fsys.fs_start = rfs->fs_start;
-    r_fsys.fs_block_size = rfs->fs_block_size;
-    r_fsys.fs_end = rfs->fs_end;
- 
-    // Calling functions copied
-    r_fsys.call_read_f = rfs->call_read_f;
-    r_fsys.call_write_f = rfs->call_write_f;
-    r_fsys.mounted = 1;
-    
-    // Seeking/ls for file system
-    seek_chunk = r_fsys.fs_start;
+    uint32_t blk = ( chunk - fs->fs_start ) / BLK_SZ(fs);
 
-    // Allocate memory and clear
-    redsfs_cache = malloc(r_fsys.fs_block_size);
-    memset (redsfs_cache, 0, r_fsys.fs_block_size);
-    redsfs_seek_cache = malloc(r_fsys.fs_block_size);
-    memset (redsfs_seek_cache, 0, r_fsys.fs_block_size);
+    if ( ( fs->head_map == NULL ) || ( blk >= fs->blk_count ) )
+        return;
 
-    return 0;
+    if ( head )
+        fs->head_map[blk >> 3] |= _BV(blk & 7);
+    else
+        fs->head_map[blk >> 3] &= ~_BV(blk & 7);
+}
 
+// Block at chunk may start a file or hold packed ones, always without the head map
+static uint8_t redsfs_is_head( redsfs_fs * fs, uint32_t chunk )
+{
+    uint32_t blk = ( chunk - fs->fs_start ) / BLK_SZ(fs);
+
+    if ( fs->head_map == NULL )
+        return 1;
+    return ( fs->head_map[blk >> 3] & _BV(blk & 7) ) != 0;
 }
 
-uint8_t redsfs_unmount()
+#if REDSFS_USE_INDEX
+// FNV-1a over the stored part of a file name
+static uint32_t redsfs_name_hash( const char * name )
 {
-    // Check if mounted flag set, unset.
-    if (r_fsys.mounted == 1) r_fsys.mounted = 0;
-        else return -1;
+    uint32_t hash = 2166136261u;
+    size_t i;
 
-    // If file open close it
-    if (r_fhand.handle != 0) {
-      redsfs_close();
+    for ( i = 0; ( i < BLK_NAME_SIZE ) && name[i]; i++ ) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    // Free/release allocated memory
-    free(redsfs_cache);
-    redsfs_cache = 0;
-    free(redsfs_seek_cache);
-    redsfs_seek_cache = 0;
+static void redsfs_index_put( redsfs_idx_ent * tbl, uint32_t cap, uint32_t hash, uint32_t blk )
+{
+    uint32_t slot = hash & ( cap - 1 );
 
-    return 0;
+    while ( tbl[slot].blk )
+        slot = ( slot + 1 ) & ( cap - 1 );
+    tbl[slot].hash = hash;
+    tbl[slot].blk = blk;
 }
+#endif
 
-int8_t redsfs_open(char * fname, uint8_t mode)
+// Add the first block of a file to the index, growing the table past 3/4 full
+static void redsfs_index_add( redsfs_fs * fs, const char * name, uint32_t chunk )
 {
-    int32_t chunk;
-    uint8_t rres;
+#if REDSFS_USE_INDEX
+    redsfs_idx_ent * tbl;
+    uint32_t cap;
+    uint32_t i;
 
-    r_fhand.handle = 0;
+    if ( fs->index == NULL )
+        return;
 
-    // Check to see if filename is in the filesystem
-    // Cycle through all blocks until file is found or not
-    for (chunk = r_fsys.fs_start; chunk < r_fsys.fs_end; chunk += r_fsys.fs_block_size)
-    {
-        rres = r_fsys.call_read_f ( chunk, r_fsys.fs_block_size, redsfs_cache );
-        // Check if block is USED and is FIRST
-	if ( ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_FIRST ) &&
-	     ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_USED ) ) {
-            // Check the file name
-	    char * fb_fname = ((redsfs_fb*)redsfs_cache)->data.namedata;
-	    // Found the file in this block
-	    if ( strcmp( fb_fname, fname ) == 0 )
-	    {
-                r_fhand.handle = 1;
-		r_fhand.f_start_blk = chunk;
-		r_fhand.f_cur_blk = chunk;
-		r_fhand.blk_curoffset = BLK_OFFSET_FIRST;
-		r_fhand.mode = mode;
-		if ( mode == MODE_APPEND )
-                    redsfs_seek_to_end();
-		return 0;
-	    }
-	}
+    if ( ( fs->index_cnt + 1 ) * 4 > fs->index_cap * 3 ) {
+        cap = fs->index_cap * 2;
+        tbl = REDSFS_CALLOC( cap, sizeof(redsfs_idx_ent) );
+        if ( tbl == NULL ) {
+            // Out of memory, drop the index and go back to scanning
+            REDSFS_FREE( fs->index );
+            fs->index = NULL;
+            return;
+        }
+        for ( i = 0; i < fs->index_cap; i++ ) {
+            if ( fs->index[i].blk )
+                redsfs_index_put( tbl, cap, fs->index[i].hash, fs->index[i].blk );
+        }
+        REDSFS_FREE( fs->index );
+        fs->index = tbl;
+        fs->index_cap = cap;
     }
-    // If we were just opening to read and didnt find the file, we're out here with a fail
-    if ( mode == MODE_READ )
-        return -1;
 
-    // If we are opening to write, we can create a file stub here...
-    // must also setup the cache memory chunk
-    if ( r_fhand.handle == 0 ) {
-        chunk = redsfs_next_empty_block();
+    redsfs_index_put( fs->index, fs->index_cap, redsfs_name_hash( name ),
+                      ( chunk - fs->fs_start ) / BLK_SZ(fs) + 1 );
+    fs->index_cnt++;
+#else
+    (void)fs;
+    (void)name;
+    (void)chunk;
+#endif
+}
 
-	//printf("Next chunk found at %d\r\n", chunk);
-        if (chunk < 0)
-            return -1;
+// Remove the first block of a file from the index
+static void redsfs_index_del( redsfs_fs * fs, const char * name, uint32_t chunk )
+{
+#if REDSFS_USE_INDEX
+    uint32_t blk = ( chunk - fs->fs_start ) / BLK_SZ(fs) + 1;
+    uint32_t mask = fs->index_cap - 1;
+    uint32_t slot;
+    uint32_t next;
+    uint32_t home;
 
-        r_fhand.handle = 1; 
-	r_fhand.mode = MODE_WRITE;
-        r_fhand.f_start_blk = chunk;
-        r_fhand.f_cur_blk = chunk;
-        r_fhand.blk_curoffset = BLK_OFFSET_FIRST;
-	// Clear the memory structure for file cache of block.
-	memset ( redsfs_cache, 0, r_fsys.fs_block_size );
-        // Setup the first block flags and used flags
-	((redsfs_fb*)redsfs_cache)->flags |= ( FB_IS_USED | FB_IS_FIRST );
-	// Setup the first block filename part of struct (not used in other blocks)
-	//printf("Copying file name to block... %d size and %s name..:%p: old name ...", strlen(fname), fname, ((redsfs_fb*)redsfs_cache)->data.namedata );
-	memcpy( ((redsfs_fb*)redsfs_cache)->data.namedata, fname, strlen(fname) );
+    if ( fs->index == NULL )
+        return;
+
+    for ( slot = redsfs_name_hash( name ) & mask; fs->index[slot].blk != blk; slot = ( slot + 1 ) & mask ) {
+        if ( fs->index[slot].blk == 0 )
+            return;
+    }
+
+    // Backward shift the rest of the probe run so lookups never see a hole
+    next = ( slot + 1 ) & mask;
+    while ( fs->index[next].blk ) {
+        home = fs->index[next].hash & mask;
+        if ( ( ( next - home ) & mask ) >= ( ( next - slot ) & mask ) ) {
+            fs->index[slot] = fs->index[next];
+            slot = next;
+        }
+        next = ( next + 1 ) & mask;
     }
-    //printf(" Returning open file %d \r\n", r_fhand.handle);
-    return r_fhand.handle;
+    fs->index[slot].blk = 0;
+    fs->index_cnt--;
+#else
+    (void)fs;
+    (void)name;
+    (void)chunk;
+#endif
 }
 
-void redsfs_close()
+#if REDSFS_USE_PACK
+// Packed files
+
+// Bytes an entry takes in its pack block
+static uint32_t redsfs_pack_len( redsfs_pack_ent * ent )
 {
-    // Invalidate our handle
-    r_fhand.handle = 0;
-    
-    // If we are writing, then a block exists in cache to write to memory
-    if ( ( r_fhand.mode == MODE_WRITE ) || (r_fhand.mode == MODE_APPEND ) ) {
-        // Complete the flags (ensure "FB_IS_LAST" is set)
-        ((redsfs_fb*)redsfs_cache)->flags |= ( FB_IS_USED | FB_IS_LAST );
-        // Write to mem
-	//printf("Committing rest of file to flash at chunk %d .\r\n", r_fhand.f_cur_blk);
-        r_fsys.call_write_f ( r_fhand.f_cur_blk, 256, redsfs_cache );
+    return sizeof(redsfs_pack_ent) + ent->name_len + ent->size;
+}
 
-        // Clear file handle vars
-        r_fhand.f_start_blk = 0;
-        r_fhand.f_cur_blk = 0;
-        r_fhand.blk_curoffset = 0;
-	r_fhand.mode = 0;
-    }
+// Copy out the entry header at off in the pack block in buf, entries need not be aligned.
+// Returns 0 where the entries end.
+static uint8_t redsfs_pack_ent_at( redsfs_fs * fs, uint8_t * buf, uint32_t off, redsfs_pack_ent * ent )
+{
+    if ( off + sizeof(redsfs_pack_ent) > BLK_SZ(fs) )
+        return 0;
+    memcpy( ent, buf + off, sizeof(redsfs_pack_ent) );
+    if ( ( ent->name_len == 0 ) || ( ent->name_len > BLK_NAME_SIZE ) ||
+         ( off + redsfs_pack_len( ent ) > BLK_SZ(fs) ) )
+        return 0;
+    return 1;
 }
 
-uint8_t redsfs_delete( char * name )
+// Offset of the first live entry at or after off in the pack block in buf, 0 if none
+static uint32_t redsfs_pack_next( redsfs_fs * fs, uint8_t * buf, uint32_t off )
 {
-    // Open the file for reading ( open file at the beginning )
-    redsfs_open ( name, MODE_READ );
+    redsfs_pack_ent ent;
 
-    // For all the bits of the file scrub and delete
-    while ( ((redsfs_fb*)redsfs_cache)->next_blk_addr )
-    {
-        uint32_t nextBlk = r_fsys.fs_start + ((redsfs_fb*)redsfs_cache)->next_blk_addr;
-        memset( redsfs_cache, 0, r_fsys.fs_block_size );
-	r_fsys.call_write_f ( r_fhand.f_cur_blk, r_fsys.fs_block_size, redsfs_cache );
-	r_fsys.call_read_f ( nextBlk, r_fsys.fs_block_size, redsfs_cache );
-    } 
-    // Last block wont have a next address, just remove it
-    memset( redsfs_cache, 0, r_fsys.fs_block_size );
-    r_fsys.call_write_f ( r_fhand.f_cur_blk, r_fsys.fs_block_size, redsfs_cache );
+    for ( ; redsfs_pack_ent_at( fs, buf, off, &ent ); off += redsfs_pack_len( &ent ) ) {
+        if ( ( ent.flags & PACK_DEAD ) == 0 )
+            return off;
+    }
+    return 0;
+}
+
+// Offset of the live entry of fname in the pack block in buf, 0 if it is not there
+static uint32_t redsfs_pack_find( redsfs_fs * fs, uint8_t * buf, const char * fname )
+{
+    redsfs_pack_ent ent;
+    size_t len = strnlen( fname, BLK_NAME_SIZE );
+    uint32_t off;
 
+    for ( off = redsfs_pack_next( fs, buf, BLK_OFFSET_CHUNK ); off != 0;
+          off = redsfs_pack_next( fs, buf, off + redsfs_pack_len( &ent ) ) ) {
+        memcpy( &ent, buf + off, sizeof(ent) );
+        if ( ( ent.name_len == len ) && ( memcmp( buf + off + sizeof(ent), fname, len ) == 0 ) )
+            return off;
+    }
     return 0;
 }
 
-size_t redsfs_read( char * buf, size_t size )
+// Name of the entry at off in the pack block in buf, terminated
+static void redsfs_pack_name( uint8_t * buf, uint32_t off, char * name )
 {
-    size_t toFetch = size;
-    size_t cacheLeft = 0;
-    size_t readSz = 0;
-    size_t readBytes = 0;
-    int rres;
-    uint32_t chunk = 0;
+    redsfs_pack_ent ent;
 
-    while (toFetch > 0) {
-        // Request the block/chunk into memory.
-        chunk = r_fhand.f_cur_blk;
-        rres = r_fsys.call_read_f ( chunk, 256, redsfs_cache );
-    
-        // Caclculate the amount left in the current block, depends on if it is first
-        if ( ((redsfs_fb*)redsfs_cache)->flags & FB_IS_FIRST) {
-          cacheLeft = ( ((redsfs_fb*)redsfs_cache)->data.size + BLK_OFFSET_FIRST) - r_fhand.blk_curoffset;
-	} else {
-          cacheLeft = ( ((redsfs_fb*)redsfs_cache)->data.size + BLK_OFFSET_CHUNK) - r_fhand.blk_curoffset;
-        }
-        
-	// Might get to the end of the buffer and still have more to request? Break here.
-	if (cacheLeft <= 0)
-            break;
+    memcpy( &ent, buf + off, sizeof(ent) );
+    memcpy( name, buf + off + sizeof(ent), ent.name_len );
+    name[ent.name_len] = 0;
+}
+#endif
 
-        // If the requested amount is greater or equal to what's left
-        if (toFetch >= cacheLeft) {
-            readSz = cacheLeft;
-	} else { // The requested amount is less than what's left in the cache
-            readSz = toFetch;
-        }
+#if REDSFS_USE_INDEX
+// Find a file through the index, leaves the first len bytes of its first block in the
+// cache given, or all of it for a packed file. Returns the block address, the entry
+// address for a packed file, or -1 if the file does not exist.
+static int32_t redsfs_index_find( redsfs_fs * fs, const char * fname, uint8_t * cache, uint32_t len )
+{
+    uint32_t hash = redsfs_name_hash( fname );
+    uint32_t mask = fs->index_cap - 1;
+    uint32_t slot;
+    uint32_t chunk;
+#if REDSFS_USE_PACK
+    uint32_t off;
+#endif
 
-        // Copy to the return buffer, the requested file size, if the current block is used up only fill a bit
-        memcpy( buf + (size - toFetch), redsfs_cache + r_fhand.blk_curoffset, readSz );
-    
-        // Are we into the next block?
-        if ( (r_fhand.blk_curoffset + readSz) >= BLK_SIZE ) {
-            // If we are at the end of the block, move to the next block
-            r_fhand.f_cur_blk = r_fsys.fs_start + ((redsfs_fb*)redsfs_cache)->next_blk_addr;
-    	    // Set the next block's offset
-            r_fhand.blk_curoffset = BLK_OFFSET_CHUNK; // Chunk offset, the next block wont be a header
-        } else {
-    	    // Increase the current offset
-    	    r_fhand.blk_curoffset += readSz;
+    for ( slot = hash & mask; fs->index[slot].blk; slot = ( slot + 1 ) & mask ) {
+        if ( fs->index[slot].hash != hash )
+            continue;
+        chunk = fs->fs_start + ( fs->index[slot].blk - 1 ) * BLK_SZ(fs);
+        REDSFS_COUNT( fs, index_probes, 1 );
+        redsfs_io_read( fs, chunk, len, cache );
+#if REDSFS_USE_PACK
+        if ( ( ((redsfs_fb*)cache)->flags & ( FB_IS_USED | FB_IS_PACK | FB_IS_DEAD ) ) == ( FB_IS_USED | FB_IS_PACK ) ) {
+            if ( len < BLK_SZ(fs) )
+                redsfs_io_read( fs, chunk + len, BLK_SZ(fs) - len, cache + len );
+            off = redsfs_pack_find( fs, cache, fname );
+            if ( off != 0 )
+                return chunk + off;
+            continue;
         }
-
-        // Update the amount left to fetch
-        toFetch -= readSz;
-	readBytes += readSz;
+#endif
+        if ( ( ((redsfs_fb*)cache)->flags & FB_IS_FIRST ) &&
+             ( ((redsfs_fb*)cache)->flags & FB_IS_USED ) &&
+             ( ( ((redsfs_fb*)cache)->flags & FB_IS_DEAD ) == 0 ) &&
+             ( strncmp( ((redsfs_fb*)cache)->data.namedata, fname, BLK_NAME_SIZE ) == 0 ) )
+            return chunk;
     }
-    // Return the amount read from the file
-    return readBytes;
+    return -1;
 }
+#endif
 
-size_t redsfs_write( char * buf, size_t size )
+// CRC32C. With the CRC instructions (SSE4.2, or ARMv8 CRC32) where the build targets
+// them or, built by GCC for x86-64, the CPU turns out to have them. Otherwise slice-by-8
+// tables when every block read is checked, bitwise to stay small when not.
+#define CRC32C_POLY 0x82f63b78
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define REDSFS_CRC_HW 1
+static uint32_t redsfs_crc32c_hw( uint32_t crc, const uint8_t * buf, size_t len )
 {
-    size_t toWrite = size;
-    size_t writeSz = 0;
-    size_t cacheLeft = 0;
-    size_t writtenBytes = 0;
-    int32_t nextBlkAddr = 0;
-    int rres;
+    uint64_t v;
 
-    // While we have bytes to write.
-    while (toWrite > 0)
-    {
-        // Check to see how many bytes are left in this chunk
-	cacheLeft = BLK_SIZE - r_fhand.blk_curoffset;
+    for ( ; len >= 8; buf += 8, len -= 8 ) {
+        memcpy( &v, buf, 8 );
+        crc = __crc32cd( crc, v );
+    }
+    while ( len-- )
+        crc = __crc32cb( crc, *buf++ );
+    return crc;
+}
+#define redsfs_crc_hw_ok() 1
+#elif defined(__x86_64__) && defined(__GNUC__)
+#define REDSFS_CRC_HW 1
+__attribute__((target("sse4.2")))
+static uint32_t redsfs_crc32c_hw( uint32_t crc, const uint8_t * buf, size_t len )
+{
+    uint64_t c = crc;
+    uint64_t v;
 
-	// If the amount to write is less than the cache leftover ensure we dont over write
-	if (toWrite >= cacheLeft) {
-	    writeSz = cacheLeft;
-	} else {  // If what we have will fit in the cache then just use that amount.
-	    writeSz = toWrite;
-        }
+    for ( ; len >= 8; buf += 8, len -= 8 ) {
+        memcpy( &v, buf, 8 );
+        c = __builtin_ia32_crc32di( c, v );
+    }
+    crc = (uint32_t)c;
+    while ( len-- )
+        crc = __builtin_ia32_crc32qi( crc, *buf++ );
+    return crc;
+}
+#define redsfs_crc_hw_ok() __builtin_cpu_supports("sse4.2")
+#endif
 
-	//printf(" Perform cache prep %s \r\n", buf);
-        //printf(" Copy to cache offset %d from %d of buf\r\n", r_fhand.blk_curoffset, (size - toWrite));
-	if (writeSz > 0) {
-	    // Copy to the cache from buffer
-	    memcpy( redsfs_cache + r_fhand.blk_curoffset, buf + (size - toWrite), writeSz );
-	}
-        // Update block size information
-	((redsfs_fb*)redsfs_cache)->data.size += writeSz;
+#if REDSFS_BLOCK_CRC
+// Entry k of table n is the CRC of byte k followed by n zero bytes
+static uint32_t redsfs_crc_tbl[8][256];
+static uint8_t redsfs_crc_tbl_ok;
 
-	// Update amount we have left to write in toWrite
-	toWrite -= writeSz;
-	writtenBytes += writeSz;
+static void redsfs_crc_tbl_init( void )
+{
+    uint32_t crc;
+    uint32_t i;
+    int k;
 
-	//printf(" toWrite now %d, writeSz was %d, chunk size is currently %d \r\n", toWrite, writeSz, ((redsfs_fb*)redsfs_cache)->data.size);
-        // Have we filled the current block?
-	if ( (r_fhand.blk_curoffset + writeSz) >= BLK_SIZE )  {
-	    // Unset the last block flag
-            ((redsfs_fb*)redsfs_cache)->flags &= ~(FB_IS_LAST);
-
-            // Next block pointer needs to be populated
-            // need to write usage flags to this current block first
-            rres = r_fsys.call_write_f ( r_fhand.f_cur_blk, 256, redsfs_cache );
-
-	    // Find the next available block
-	    nextBlkAddr = redsfs_next_empty_block();
-	    ((redsfs_fb*)redsfs_cache)->next_blk_addr = nextBlkAddr - r_fsys.fs_start;
-            
-	    // Re-Commit this block to memory with next block addr and setup the new one.
-            rres = r_fsys.call_write_f ( r_fhand.f_cur_blk, 256, redsfs_cache );
-
-	    // If we've not got a new block (no space left) exit
-	    if (nextBlkAddr >= 0) 
-	      ((redsfs_fb*)redsfs_cache)->next_blk_addr = nextBlkAddr - r_fsys.fs_start;
-            else
-              return nextBlkAddr;
+    for ( i = 0; i < 256; i++ ) {
+        crc = i;
+        for ( k = 0; k < 8; k++ )
+            crc = ( crc >> 1 ) ^ ( CRC32C_POLY & ( 0 - ( crc & 1 ) ) );
+        redsfs_crc_tbl[0][i] = crc;
+    }
+    for ( i = 0; i < 256; i++ ) {
+        for ( k = 1; k < 8; k++ )
+            redsfs_crc_tbl[k][i] = ( redsfs_crc_tbl[k - 1][i] >> 8 ) ^
+                                   redsfs_crc_tbl[0][redsfs_crc_tbl[k - 1][i] & 0xff];
+    }
+    redsfs_crc_tbl_ok = 1;
+}
 
-            // Setup new block
-	    r_fhand.f_cur_blk = nextBlkAddr;
-            r_fhand.blk_curoffset = BLK_OFFSET_CHUNK;
-            // Clear the memory structure for file cache of block.
-            memset ( redsfs_cache, 0, r_fsys.fs_block_size );
-            // Setup the first block flags and used flags
-            ((redsfs_fb*)redsfs_cache)->flags |= ( FB_IS_USED | FB_IS_CONT );
-            //printf("New chunk setup with size %d \r\n", ((redsfs_fb*)redsfs_cache)->data.size);
-	}
-        else { // We've finished writing but not the block yet
-	    r_fhand.blk_curoffset += writeSz;
-	}
+// Eight bytes a step, words taken little endian as the headers are
+static uint32_t redsfs_crc32c_sw( uint32_t crc, const uint8_t * buf, size_t len )
+{
+    uint32_t lo;
+    uint32_t hi;
+
+    if ( !redsfs_crc_tbl_ok )
+        redsfs_crc_tbl_init();
+    for ( ; len >= 8; buf += 8, len -= 8 ) {
+        memcpy( &lo, buf, 4 );
+        memcpy( &hi, buf + 4, 4 );
+        lo ^= crc;
+        crc = redsfs_crc_tbl[7][lo & 0xff] ^ redsfs_crc_tbl[6][( lo >> 8 ) & 0xff] ^
+              redsfs_crc_tbl[5][( lo >> 16 ) & 0xff] ^ redsfs_crc_tbl[4][lo >> 24] ^
+              redsfs_crc_tbl[3][hi & 0xff] ^ redsfs_crc_tbl[2][( hi >> 8 ) & 0xff] ^
+              redsfs_crc_tbl[1][( hi >> 16 ) & 0xff] ^ redsfs_crc_tbl[0][hi >> 24];
     }
-    return writtenBytes;
+    while ( len-- )
+        crc = redsfs_crc_tbl[0][( crc ^ *buf++ ) & 0xff] ^ ( crc >> 8 );
+    return crc;
+}
+#else
+static uint32_t redsfs_crc32c_sw( uint32_t crc, const uint8_t * buf, size_t len )
+{
+    int k;
+
+    while ( len-- ) {
+        crc ^= *buf++;
+        for ( k = 0; k < 8; k++ )
+            crc = ( crc >> 1 ) ^ ( CRC32C_POLY & ( 0 - ( crc & 1 ) ) );
+    }
+    return crc;
 }
+#endif
 
+uint32_t redsfs_crc32c( uint32_t crc, const uint8_t * buf, size_t len )
+{
+#ifdef REDSFS_CRC_HW
+    static int8_t hw = -1;
+
+    if ( hw < 0 )
+        hw = redsfs_crc_hw_ok() ? 1 : 0;
+    if ( hw )
+        return ~redsfs_crc32c_hw( ~crc, buf, len );
+#endif
+    return ~redsfs_crc32c_sw( ~crc, buf, len );
+}
+
+uint32_t redsfs_block_crc( const uint8_t * hdr, const uint8_t * data, uint32_t blk_sz )
+{
+    const redsfs_fb * fb = (const redsfs_fb*)hdr;
+    uint32_t hdr_len = BLK_OFFSET_CHUNK;
+    uint32_t size = fb->data.size;
+    uint32_t crc;
+
+    if ( fb->flags & FB_IS_FIRST )
+        hdr_len = ( fb->flags & FB_HAS_EXTENTS ) ? BLK_OFFSET_FIRST_EXT : BLK_OFFSET_FIRST;
+    if ( size > blk_sz - hdr_len )
+        size = blk_sz - hdr_len;
+    if ( data == NULL )
+        data = hdr + hdr_len;
+
+    crc = redsfs_crc32c( 0, hdr + offsetof(redsfs_fb, next_blk_addr), hdr_len - offsetof(redsfs_fb, next_blk_addr) );
+    return redsfs_crc32c( crc, data, size );
+}
+
+// Give a file block about to go to flash whole its CRC
+static void redsfs_blk_seal( redsfs_fs * fs, uint8_t * hdr, const uint8_t * data )
+{
+#if REDSFS_BLOCK_CRC
+    ((redsfs_fb*)hdr)->flags |= FB_HAS_CRC;
+    ((redsfs_fb*)hdr)->crc = redsfs_block_crc( hdr, data, BLK_SZ(fs) );
+#else
+    (void)fs;
+    (void)hdr;
+    (void)data;
+#endif
+}
+
+// Check a file block read back whole against its CRC, -1 if it does not match.
+// A mismatch stays latched on the handle for redsfs_error_r.
+static int8_t redsfs_blk_check( redsfs_fh * fh, uint32_t chunk, const uint8_t * hdr, const uint8_t * data )
+{
+#if REDSFS_BLOCK_CRC
+    redsfs_fs * fs = fh->fs;
+
+    if ( ( ((redsfs_fb*)hdr)->flags & FB_HAS_CRC ) &&
+         ( ((redsfs_fb*)hdr)->crc != redsfs_block_crc( hdr, data, BLK_SZ(fs) ) ) ) {
+        REDSFS_COUNT( fs, crc_errors, 1 );
+        fh->err = 1;
+        printf("CRC error in block %x\r\n", chunk);
+        return -1;
+    }
+#else
+    (void)fh;
+    (void)chunk;
+    (void)hdr;
+    (void)data;
+#endif
+    return 0;
+}
+
+// Add a file to the end of the directory table
+static void redsfs_dir_add( redsfs_fs * fs, const char * name, uint32_t chunk, int32_t size )
+{
+#if REDSFS_USE_SUPER
+    redsfs_dirent * tbl;
+
+    if ( fs->dir == NULL )
+        return;
+
+    if ( fs->dir_cnt == fs->dir_cap ) {
+        tbl = REDSFS_REALLOC( fs->dir, fs->dir_cap * 2 * sizeof(redsfs_dirent) );
+        if ( tbl == NULL ) {
+            // Out of memory, list by scanning and never checkpoint this mount
+            REDSFS_FREE( fs->dir );
+            fs->dir = NULL;
+            fs->sb.magic = 0;
+            return;
+        }
+        fs->dir = tbl;
+        fs->dir_cap *= 2;
+    }
+    memset( &fs->dir[fs->dir_cnt], 0, sizeof(redsfs_dirent) );
+    strncpy( fs->dir[fs->dir_cnt].name, name, BLK_NAME_SIZE );
+    fs->dir[fs->dir_cnt].first_blk_addr = chunk - fs->fs_start;
+    fs->dir[fs->dir_cnt].file_size = size;
+    fs->dir_cnt++;
+#else
+    (void)fs;
+    (void)name;
+    (void)chunk;
+    (void)size;
+#endif
+}
+
+// Directory table entry of the file starting at chunk, -1 if none
+static int32_t redsfs_dir_find( redsfs_fs * fs, uint32_t chunk )
+{
+#if REDSFS_USE_SUPER
+    uint32_t i;
+
+    if ( fs->dir == NULL )
+        return -1;
+
+    for ( i = 0; i < fs->dir_cnt; i++ ) {
+        if ( fs->dir[i].first_blk_addr == chunk - fs->fs_start )
+            return i;
+    }
+#else
+    (void)fs;
+    (void)chunk;
+#endif
+    return -1;
+}
+
+// Remove a file from the directory table, keeping the listing order
+static void redsfs_dir_del( redsfs_fs * fs, uint32_t chunk )
+{
+    int32_t i = redsfs_dir_find( fs, chunk );
+
+    if ( i < 0 )
+        return;
+
+    memmove( &fs->dir[i], &fs->dir[i + 1], ( fs->dir_cnt - i - 1 ) * sizeof(redsfs_dirent) );
+    fs->dir_cnt--;
+    if ( (uint32_t)i < fs->dir_pos )
+        fs->dir_pos--;
+}
+
+// Remember a deleted file's chain for redsfs_gc_r. Out of memory it stays on flash
+// flagged dead until a later mount finds it again.
+static void redsfs_dead_add( redsfs_fs * fs, uint32_t chunk )
+{
+    uint32_t * list;
+    uint32_t cap;
+
+    if ( fs->dead_cnt == fs->dead_cap ) {
+        cap = fs->dead_cap ? fs->dead_cap * 2 : DIR_MIN_CAP;
+        list = REDSFS_REALLOC( fs->dead, cap * sizeof(uint32_t) );
+        if ( list == NULL )
+            return;
+        fs->dead = list;
+        fs->dead_cap = cap;
+    }
+    fs->dead[fs->dead_cnt++] = chunk;
+}
+
+#if REDSFS_USE_SUPER
+// Superblock slots in each of its blocks
+#define SB_SLOTS(fs) ( ( BLK_SZ(fs) - BLK_OFFSET_CHUNK ) / sizeof(redsfs_sb) )
+
+// Blocks of the erase sector the fs starts on, 1 if it can not be erased on its own
+static uint32_t redsfs_super_area( redsfs_fs * fs )
+{
+    if ( ( fs->call_erase_f == NULL ) || ( fs->fs_erase_size <= BLK_SZ(fs) ) ||
+         ( fs->fs_start % fs->fs_erase_size ) || ( fs->fs_erase_size / BLK_SZ(fs) >= fs->blk_count ) )
+        return 1;
+    return fs->fs_erase_size / BLK_SZ(fs);
+}
+
+// The superblock's blocks are a whole erase sector, to start over in when its slots run out
+static uint8_t redsfs_super_wraps( redsfs_fs * fs )
+{
+    uint32_t sector = fs->fs_erase_size ? fs->fs_erase_size : BLK_SZ(fs);
+
+    return ( fs->call_erase_f != NULL ) && ( fs->fs_start % sector == 0 ) &&
+           ( fs->sb_blocks * BLK_SZ(fs) == sector ) && ( fs->sb_blocks * SB_SLOTS(fs) >= 2 );
+}
+
+static void redsfs_super_put( redsfs_fs * fs, uint32_t slot )
+{
+    fs->sb.sb_crc = redsfs_crc32c( 0, (uint8_t*)&fs->sb, offsetof(redsfs_sb, sb_crc) );
+    redsfs_io_write( fs, fs->fs_start + ( slot / SB_SLOTS(fs) ) * BLK_SZ(fs) + BLK_OFFSET_CHUNK +
+                         ( slot % SB_SLOTS(fs) ) * sizeof(redsfs_sb), sizeof(redsfs_sb), (uint8_t*)&fs->sb );
+    fs->sb_slot = slot;
+}
+
+// Start the superblock's blocks over, erasing them first if asked, with a header
+// each and the superblock in the first slot
+static void redsfs_super_fresh( redsfs_fs * fs, uint8_t erase )
+{
+    uint32_t blk[BLK_OFFSET_CHUNK / 4];
+    redsfs_fb * fb = (redsfs_fb*)blk;
+    uint32_t i;
+
+    if ( erase )
+        redsfs_io_erase( fs, fs->fs_start, fs->sb_blocks * BLK_SZ(fs) );
+    memset( blk, 0, sizeof(blk) );
+    fb->flags = FB_IS_USED | FB_IS_META;
+    fb->data.size = REDSFS_SB_MAGIC;
+    for ( i = 0; i < fs->sb_blocks; i++ )
+        redsfs_io_write( fs, fs->fs_start + i * BLK_SZ(fs), sizeof(blk), (uint8_t*)blk );
+    redsfs_super_put( fs, 0 );
+}
+
+// Room for a clean superblock and the one marking it stale after it
+static uint8_t redsfs_super_room( redsfs_fs * fs )
+{
+    return ( fs->call_erase_f == NULL ) || ( fs->sb_slot + 2 < fs->sb_blocks * SB_SLOTS(fs) ) ||
+           redsfs_super_wraps( fs );
+}
+
+// Write the superblock to the next slot. Flash without call_erase_f is taken to be
+// rewritable and it goes over the last one in place.
+static void redsfs_super_write( redsfs_fs * fs )
+{
+    uint32_t ones = 0xffffffff;
+    uint32_t i;
+
+    if ( fs->call_erase_f == NULL ) {
+        redsfs_super_put( fs, fs->sb_slot );
+    } else if ( fs->sb_slot + 1 < fs->sb_blocks * SB_SLOTS(fs) ) {
+        redsfs_super_put( fs, fs->sb_slot + 1 );
+    } else if ( redsfs_super_wraps( fs ) ) {
+        redsfs_super_fresh( fs, 1 );
+    } else {
+        // Out of slots after a torn write. Setting every sb_crc bit spoils them all and
+        // the next mount scans.
+        for ( i = 0; i < fs->sb_blocks * SB_SLOTS(fs); i++ )
+            redsfs_io_write( fs, fs->fs_start + ( i / SB_SLOTS(fs) ) * BLK_SZ(fs) + BLK_OFFSET_CHUNK +
+                                 ( i % SB_SLOTS(fs) ) * sizeof(redsfs_sb) + offsetof(redsfs_sb, sb_crc),
+                             sizeof(ones), (uint8_t*)&ones );
+        fs->sb.magic = 0;
+    }
+}
+
+#endif
+
+// Mark the checkpoint stale on flash, ahead of the first change since it was taken
+static void redsfs_super_dirty( redsfs_fs * fs )
+{
+#if REDSFS_USE_SUPER
+    if ( fs->sb.clean == 0 )
+        return;
+
+    // A clean one only goes out with a slot left after it, see redsfs_super_room
+    fs->sb.clean = 0;
+    redsfs_super_write( fs );
+#else
+    (void)fs;
+#endif
+}
+
+#if REDSFS_USE_SUPER
+
+// Look for the superblock, the last good slot up to the first one never written. Its
+// slots run on into the blocks after block 0 with a superblock header. An image that
+// has one keeps it, whatever the mount options.
+static void redsfs_super_probe( redsfs_fs * fs )
+{
+    redsfs_fb * fb = (redsfs_fb*)fs->seek_cache;
+    redsfs_sb * sb;
+    uint32_t blk;
+    uint32_t i;
+    uint32_t n;
+    uint8_t end = 0;
+
+    memset( &fs->sb, 0, sizeof(redsfs_sb) );
+    fs->sb_slot = 0;
+    for ( blk = 0; blk < fs->blk_count; blk++ ) {
+        // Past the first slot never written only the headers are wanted, to count the blocks
+        redsfs_io_read( fs, fs->fs_start + blk * BLK_SZ(fs), end ? BLK_OFFSET_CHUNK : BLK_SZ(fs), fs->seek_cache );
+        if ( ( ( fb->flags & ( FB_IS_USED | FB_IS_META ) ) != ( FB_IS_USED | FB_IS_META ) ) ||
+             ( ( blk > 0 ) && ( fb->data.size != REDSFS_SB_MAGIC ) ) )
+            break;
+        fs->sb_blocks = blk + 1;
+        for ( i = 0; !end && ( i < SB_SLOTS(fs) ); i++ ) {
+            sb = (redsfs_sb*)( fs->seek_cache + BLK_OFFSET_CHUNK + i * sizeof(redsfs_sb) );
+            for ( n = 0; ( n < sizeof(redsfs_sb) ) && ( ((uint8_t*)sb)[n] == 0 ); n++ )
+                ;
+            end = ( n == sizeof(redsfs_sb) );
+            if ( end )
+                break;
+            fs->sb_slot = blk * SB_SLOTS(fs) + i;
+            if ( ( sb->magic == REDSFS_SB_MAGIC ) &&
+                 ( sb->sb_crc == redsfs_crc32c( 0, (uint8_t*)sb, offsetof(redsfs_sb, sb_crc) ) ) )
+                fs->sb = *sb;
+        }
+    }
+
+    if ( fs->sb.magic != REDSFS_SB_MAGIC ) {
+        fs->sb_blocks = 0;
+        return;
+    }
+    fs->fs_opts |= REDSFS_OPT_SUPER;
+}
+
+// Load the directory table and free map from a clean checkpoint, in place of a scan.
+// Returns -1 if there is no usable checkpoint.
+static int8_t redsfs_super_load( redsfs_fs * fs )
+{
+    uint32_t map_bytes = ( fs->blk_count + 7 ) / 8;
+    uint32_t len;
+    uint32_t got = 0;
+    uint32_t size;
+#if REDSFS_USE_PACK
+    uint32_t pack = REDSFS_NO_BLK;
+    uint32_t off;
+    redsfs_pack_ent ent;
+#endif
+    uint32_t i;
+    uint8_t * tbl;
+    redsfs_fb * hdr;
+    redsfs_dirent * dir;
+
+    len = fs->sb.dir_cnt * sizeof(redsfs_dirent) + fs->sb.dead_cnt * sizeof(uint32_t) + map_bytes * 2;
+    if ( ( fs->sb.magic != REDSFS_SB_MAGIC ) || ( fs->sb.clean == 0 ) ||
+         ( fs->sb.block_size != BLK_SZ(fs) ) || ( fs->sb.blk_count != fs->blk_count ) ||
+         ( fs->sb.table_blocks == 0 ) ||
+         ( fs->sb.table_addr / BLK_SZ(fs) + fs->sb.table_blocks > fs->blk_count ) ||
+         ( fs->sb.dir_cnt > fs->blk_count ) || ( fs->sb.dead_cnt > fs->blk_count ) ||
+         ( len > fs->sb.table_blocks * BLK_DATA_CHUNK(fs) ) )
+        return -1;
+
+    tbl = REDSFS_MALLOC( fs->sb.table_blocks * BLK_SZ(fs) );
+    if ( tbl == NULL )
+        return -1;
+    redsfs_io_read( fs, fs->fs_start + fs->sb.table_addr, fs->sb.table_blocks * BLK_SZ(fs), tbl );
+
+    // Pack the payloads down over the block headers
+    for ( i = 0; i < fs->sb.table_blocks; i++ ) {
+        hdr = (redsfs_fb*)( tbl + i * BLK_SZ(fs) );
+        size = hdr->data.size;
+        if ( ( ( hdr->flags & FB_IS_META ) == 0 ) || ( size > BLK_DATA_CHUNK(fs) ) )
+            break;
+        memmove( tbl + got, tbl + i * BLK_SZ(fs) + BLK_OFFSET_CHUNK, size );
+        got += size;
+    }
+    if ( ( got != len ) || ( redsfs_crc32c( 0, tbl, len ) != fs->sb.crc ) ) {
+        printf("Bad checkpoint, scanning\r\n");
+        REDSFS_FREE( tbl );
+        return -1;
+    }
+
+    if ( fs->sb.dir_cnt > fs->dir_cap ) {
+        dir = REDSFS_REALLOC( fs->dir, fs->sb.dir_cnt * sizeof(redsfs_dirent) );
+        if ( dir == NULL ) {
+            REDSFS_FREE( tbl );
+            return -1;
+        }
+        fs->dir = dir;
+        fs->dir_cap = fs->sb.dir_cnt;
+    }
+    memcpy( fs->dir, tbl, fs->sb.dir_cnt * sizeof(redsfs_dirent) );
+    fs->dir_cnt = fs->sb.dir_cnt;
+    got = fs->sb.dir_cnt * sizeof(redsfs_dirent);
+    for ( i = 0; i < fs->sb.dead_cnt; i++ ) {
+        redsfs_dead_add( fs, fs->fs_start + ((uint32_t*)( tbl + got ))[i] );
+        if ( fs->dead_cnt != i + 1 ) {
+            REDSFS_FREE( tbl );
+            return -1;
+        }
+    }
+    got += fs->sb.dead_cnt * sizeof(uint32_t);
+    memcpy( fs->free_map, tbl + got, map_bytes );
+    memcpy( fs->gone_map, tbl + got + map_bytes, map_bytes );
+    REDSFS_FREE( tbl );
+
+    for ( i = 0; i < fs->dir_cnt; i++ ) {
+        redsfs_index_add( fs, fs->dir[i].name, fs->fs_start + fs->dir[i].first_blk_addr );
+        redsfs_head_mark( fs, fs->fs_start + fs->dir[i].first_blk_addr, 1 );
+#if REDSFS_USE_PACK
+        off = fs->dir[i].first_blk_addr % BLK_SZ(fs);
+        if ( ( off != 0 ) && ( ( pack == REDSFS_NO_BLK ) || ( fs->fs_start + fs->dir[i].first_blk_addr - off > pack ) ) )
+            pack = fs->fs_start + fs->dir[i].first_blk_addr - off;
+#else
+        // A packed file, the scan turns the image down
+        if ( fs->dir[i].first_blk_addr % BLK_SZ(fs) )
+            return -1;
+#endif
+    }
+
+#if REDSFS_USE_PACK
+    // New entries go on in the last pack block with files in it, as after a scan
+    if ( pack != REDSFS_NO_BLK ) {
+        redsfs_io_read( fs, pack, BLK_SZ(fs), fs->seek_cache );
+        for ( off = BLK_OFFSET_CHUNK; redsfs_pack_ent_at( fs, fs->seek_cache, off, &ent ); off += redsfs_pack_len( &ent ) )
+            ;
+        fs->pack_blk = pack;
+        fs->pack_off = off;
+    }
+#endif
+
+    return 0;
+}
+
+// After a scan, take the superblock's blocks unless a file already has one of them,
+// erasing any redsfs_gc has taken. An image that had one carries on in its slots.
+// It goes out not clean, the first checkpoint makes it good.
+static void redsfs_super_claim( redsfs_fs * fs )
+{
+    uint32_t gen = fs->sb.gen;
+    uint32_t i;
+    uint8_t erase = 0;
+
+    if ( fs->dir == NULL ) {
+        fs->sb.magic = 0;
+        return;
+    }
+    if ( fs->sb_blocks > 0 )
+        return;
+
+    fs->sb_blocks = redsfs_super_area( fs );
+    for ( i = 0; i < fs->sb_blocks; i++ ) {
+        if ( fs->gone_map[i >> 3] & _BV(i & 7) )
+            erase = 1;
+        else if ( fs->free_map[i >> 3] & _BV(i & 7) )
+            break;
+    }
+    if ( ( i < fs->sb_blocks ) || ( erase && ( fs->call_erase_f != NULL ) && !redsfs_super_wraps( fs ) ) ) {
+        fs->sb_blocks = 0;
+        fs->sb.magic = 0;
+        return;
+    }
+    for ( i = 0; i < fs->sb_blocks; i++ ) {
+        fs->free_map[i >> 3] |= _BV(i & 7);
+        fs->gone_map[i >> 3] &= ~_BV(i & 7);
+    }
+
+    memset( &fs->sb, 0, sizeof(redsfs_sb) );
+    fs->sb.magic = REDSFS_SB_MAGIC;
+    fs->sb.gen = gen;
+    fs->sb.block_size = BLK_SZ(fs);
+    fs->sb.blk_count = fs->blk_count;
+    redsfs_super_fresh( fs, erase && ( fs->call_erase_f != NULL ) );
+}
+#endif
+
+#if REDSFS_USE_PACK
+// Pick up the packed files of a pack block the mount scan came to. A block with
+// nothing live left goes to redsfs_gc, the last with some takes the next entries.
+static void redsfs_pack_scan( redsfs_fs * fs, uint32_t chunk )
+{
+    redsfs_pack_ent ent;
+    uint32_t off;
+    uint32_t live = 0;
+    char name[BLK_NAME_SIZE + 1];
+
+    redsfs_io_read( fs, chunk, BLK_SZ(fs), fs->seek_cache );
+    for ( off = BLK_OFFSET_CHUNK; redsfs_pack_ent_at( fs, fs->seek_cache, off, &ent ); off += redsfs_pack_len( &ent ) ) {
+        if ( ent.flags & PACK_DEAD )
+            continue;
+        redsfs_pack_name( fs->seek_cache, off, name );
+        redsfs_index_add( fs, name, chunk + off );
+        redsfs_dir_add( fs, name, chunk + off, ent.size );
+        live++;
+    }
+
+    if ( live == 0 ) {
+        redsfs_dead_add( fs, chunk );
+        return;
+    }
+    redsfs_head_mark( fs, chunk, 1 );
+    fs->pack_blk = chunk;
+    fs->pack_off = off;
+}
+#endif
+
+// Read the headers of the first blocks in a batch the scan found, when the index or
+// directory table wants their names, all in one request when the fs can read vectored.
+static void redsfs_scan_heads( redsfs_fs * fs, uint32_t * firsts, uint32_t cnt, uint8_t * hdrs )
+{
+    redsfs_iov iov[REDSFS_SCAN_BATCH];
+    uint32_t i;
+
+    if ( fs->call_readv_f != NULL ) {
+        for ( i = 0; i < cnt; i++ ) {
+            iov[i].addr = firsts[i];
+            iov[i].size = BLK_OFFSET_FIRST;
+            iov[i].buf = hdrs + i * BLK_OFFSET_FIRST;
+        }
+        if ( cnt > 0 )
+            redsfs_io_readv( fs, iov, cnt );
+    } else {
+        for ( i = 0; i < cnt; i++ )
+            redsfs_io_flash_read( fs, firsts[i], BLK_OFFSET_FIRST, hdrs + i * BLK_OFFSET_FIRST );
+    }
+}
+
+// Build the free block map (and head map, filename index, directory table) with a single
+// pass over the block headers, or from the checkpoint when the image has a clean one.
+// The pass takes only the flags of REDSFS_SCAN_BATCH blocks at a time in one strided read,
+// then the rest of the headers of the first blocks among them if names are wanted.
+static int8_t redsfs_map_build( redsfs_fs * fs )
+{
+    uint32_t flags[REDSFS_SCAN_BATCH];
+    uint32_t firsts[REDSFS_SCAN_BATCH];
+    uint8_t * hdrs = NULL;
+    redsfs_fb * fb;
+    uint32_t chunk;
+    uint32_t blk;
+    uint32_t cnt;
+    uint32_t nfirst;
+    uint32_t i;
+
+    fs->blk_count = ( fs->fs_end - fs->fs_start ) / BLK_SZ(fs);
+#if REDSFS_STATIC
+    if ( fs->blk_count > REDSFS_MAX_BLOCKS ) {
+        printf("Image of %u blocks, built for %u\r\n", fs->blk_count, REDSFS_MAX_BLOCKS);
+        return -1;
+    }
+    fs->free_map = fs->fs_mem->free_map;
+    fs->head_map = fs->fs_mem->head_map;
+    fs->gone_map = fs->fs_mem->gone_map;
+    memset( fs->head_map, 0, ( fs->blk_count + 7 ) / 8 );
+#else
+    fs->free_map = malloc( ( fs->blk_count + 7 ) / 8 );
+    fs->gone_map = malloc( ( fs->blk_count + 7 ) / 8 );
+    if ( ( fs->free_map == NULL ) || ( fs->gone_map == NULL ) )
+        return -1;
+    // Without it scans look at every block
+    fs->head_map = calloc( ( fs->blk_count + 7 ) / 8, 1 );
+#endif
+    memset( fs->free_map, 0, ( fs->blk_count + 7 ) / 8 );
+    memset( fs->gone_map, 0, ( fs->blk_count + 7 ) / 8 );
+    fs->free_hint = 0;
+    fs->sb_blocks = 0;
+
+#if REDSFS_USE_SUPER
+    redsfs_super_probe( fs );
+#else
+    // Changes made here would leave a checkpoint claiming to be good when it is not
+    redsfs_io_read( fs, fs->fs_start, sizeof(uint32_t), (uint8_t*)flags );
+    if ( ( flags[0] & ( FB_IS_USED | FB_IS_META ) ) == ( FB_IS_USED | FB_IS_META ) ) {
+        printf("Image has a superblock, built without REDSFS_USE_SUPER\r\n");
+        return -1;
+    }
+    fs->fs_opts &= ~REDSFS_OPT_SUPER;
+#endif
+
+    fs->index_cnt = 0;
+#if REDSFS_USE_INDEX
+    if ( fs->fs_opts & ( REDSFS_OPT_INDEX | REDSFS_OPT_SUPER ) ) {
+#if REDSFS_STATIC
+        fs->index_cap = REDSFS_INDEX_SLOTS;
+        fs->index = fs->fs_mem->index;
+        memset( fs->index, 0, sizeof(fs->fs_mem->index) );
+#else
+        fs->index_cap = INDEX_MIN_CAP;
+        fs->index = calloc( fs->index_cap, sizeof(redsfs_idx_ent) );
+#endif
+    }
+#endif
+
+#if REDSFS_STATIC
+    fs->dead = fs->fs_mem->dead;
+    fs->dead_cap = REDSFS_MAX_DEAD;
+#else
+    fs->dead_cap = 0;
+#endif
+    fs->dead_cnt = 0;
+#if REDSFS_USE_PACK
+    fs->pack_blk = REDSFS_NO_BLK;
+#endif
+
+    fs->dir_cnt = 0;
+    fs->dir_pos = 0;
+#if REDSFS_USE_SUPER
+    if ( fs->fs_opts & REDSFS_OPT_SUPER ) {
+        fs->dir_cap = DIR_MIN_CAP;
+        fs->dir = malloc( fs->dir_cap * sizeof(redsfs_dirent) );
+        if ( ( fs->dir != NULL ) && ( redsfs_super_load( fs ) == 0 ) )
+            return 0;
+        // The scan starts over, finding the old checkpoint's blocks for redsfs_gc
+        fs->dead_cnt = 0;
+        fs->sb.table_blocks = 0;
+        memset( fs->free_map, 0, ( fs->blk_count + 7 ) / 8 );
+        memset( fs->gone_map, 0, ( fs->blk_count + 7 ) / 8 );
+        redsfs_super_dirty( fs );
+    }
+#endif
+
+    if ( ( fs->index != NULL ) || ( fs->dir != NULL ) ) {
+#if REDSFS_STATIC
+        // No file can be open yet, the headers go where their caches will be
+        hdrs = fs->fs_mem->fh_cache[0];
+#else
+        hdrs = malloc( REDSFS_SCAN_BATCH * BLK_OFFSET_FIRST );
+        if ( hdrs == NULL )
+            return -1;
+#endif
+    }
+
+    for ( blk = 0; blk < fs->blk_count; blk += cnt ) {
+        cnt = fs->blk_count - blk;
+        if ( cnt > REDSFS_SCAN_BATCH )
+            cnt = REDSFS_SCAN_BATCH;
+        redsfs_io_read_stride( fs, fs->fs_start + blk * BLK_SZ(fs), sizeof(uint32_t),
+                               BLK_SZ(fs), cnt, (uint8_t*)flags );
+
+        nfirst = 0;
+        for ( i = 0; i < cnt; i++ ) {
+            if ( ( ( flags[i] & ( FB_IS_USED | FB_IS_META | FB_IS_DEAD | FB_IS_GONE | FB_IS_FIRST ) ) == ( FB_IS_USED | FB_IS_FIRST ) ) &&
+                 ( hdrs != NULL ) )
+                firsts[nfirst++] = fs->fs_start + ( blk + i ) * BLK_SZ(fs);
+        }
+        redsfs_scan_heads( fs, firsts, nfirst, hdrs );
+
+        // In block order, so the directory lists as a scan would
+        nfirst = 0;
+        for ( i = 0; i < cnt; i++ ) {
+            chunk = fs->fs_start + ( blk + i ) * BLK_SZ(fs);
+            if ( ( flags[i] & FB_IS_USED ) == 0 )
+                continue;
+            fs->free_map[( blk + i ) >> 3] |= _BV(( blk + i ) & 7);
+            if ( flags[i] & FB_IS_META ) {
+                // A checkpoint this mount has not loaded is stale, it waits for its
+                // sector's erase like the taken blocks. The superblock's own stay.
+                if ( blk + i >= fs->sb_blocks )
+                    fs->gone_map[( blk + i ) >> 3] |= _BV(( blk + i ) & 7);
+            } else if ( flags[i] & FB_IS_GONE ) {
+                // Taken by redsfs_gc already, it only waits for its sector's erase
+                fs->gone_map[( blk + i ) >> 3] |= _BV(( blk + i ) & 7);
+            } else if ( flags[i] & FB_IS_DEAD ) {
+                redsfs_dead_add( fs, chunk );
+            } else if ( flags[i] & FB_IS_FIRST ) {
+                redsfs_head_mark( fs, chunk, 1 );
+                if ( hdrs == NULL )
+                    continue;
+                fb = (redsfs_fb*)( hdrs + nfirst++ * BLK_OFFSET_FIRST );
+                redsfs_index_add( fs, fb->data.namedata, chunk );
+                redsfs_dir_add( fs, fb->data.namedata, chunk,
+                                ( fb->flags & FB_IS_SIZED ) ? (int32_t)fb->data.file_size : -1 );
+            } else if ( flags[i] & FB_IS_PACK ) {
+#if REDSFS_USE_PACK
+                redsfs_pack_scan( fs, chunk );
+#else
+                printf("Image has packed files, built without REDSFS_USE_PACK\r\n");
+                REDSFS_FREE( hdrs );
+                return -1;
+#endif
+            }
+        }
+    }
+    REDSFS_FREE( hdrs );
+
+#if REDSFS_USE_SUPER
+    if ( fs->fs_opts & REDSFS_OPT_SUPER )
+        redsfs_super_claim( fs );
+#endif
+    return 0;
+}
+
+int32_t redsfs_next_empty_block_r( redsfs_fs * fs )
+{
+    uint32_t blk;
+
+    // Check we are mounted
+    if (fs->mounted != 1) {
+        printf("Not mounted error\r\n");
+        return -1;
+    }
+
+    // Search the free map from the hint, skipping fully used bytes at a time.
+    REDSFS_COUNT( fs, allocs, 1 );
+    blk = fs->free_hint;
+    while ( blk < fs->blk_count )
+    {
+        if ( ( ( blk & 7 ) == 0 ) && ( fs->free_map[blk >> 3] == 0xff ) ) {
+            blk += 8;
+            continue;
+        }
+        if ( ( fs->free_map[blk >> 3] & _BV(blk & 7) ) == 0 ) {
+            REDSFS_COUNT( fs, alloc_scan, blk - fs->free_hint );
+            fs->free_hint = blk;
+            return fs->fs_start + blk * BLK_SZ(fs);
+        }
+        blk++;
+    }
+    REDSFS_COUNT( fs, alloc_scan, fs->blk_count - fs->free_hint );
+    fs->free_hint = fs->blk_count;
+    printf("Out of space\r\n");
+    return -2;
+}
+
+// Find and claim a free block in one step, so two handles never get the same one
+static int32_t redsfs_alloc_block( redsfs_fs * fs )
+{
+    int32_t chunk;
+
+    REDSFS_LOCK(fs);
+    chunk = redsfs_next_empty_block_r( fs );
+    if ( chunk >= 0 )
+        redsfs_map_mark( fs, chunk, 1 );
+    REDSFS_UNLOCK(fs);
+
+    // Out of space, take back a batch of what deleted files left if there is any
+    if ( ( chunk < 0 ) && ( redsfs_do_gc( fs, REDSFS_GC_BATCH ) > 0 ) )
+        return redsfs_alloc_block( fs );
+
+    return chunk;
+}
+
+#if REDSFS_USE_EXTENTS || REDSFS_USE_SUPER
+// Find the first run of want free blocks in the free map, or failing that the longest
+// run there is. Returns the block number the run starts at and its length in *got.
+static uint32_t redsfs_find_run( redsfs_fs * fs, uint32_t want, uint32_t * got )
+{
+    uint32_t blk = fs->free_hint;
+    uint32_t run_start = 0;
+    uint32_t run = 0;
+    uint32_t best_start = 0;
+    uint32_t best = 0;
+
+    while ( ( blk < fs->blk_count ) && ( best < want ) )
+    {
+        // Whole bytes used or free at a time where we can
+        if ( ( ( blk & 7 ) == 0 ) && ( fs->free_map[blk >> 3] == 0xff ) ) {
+            run = 0;
+            blk += 8;
+            continue;
+        }
+        if ( fs->free_map[blk >> 3] & _BV(blk & 7) ) {
+            run = 0;
+            blk++;
+            continue;
+        }
+        if ( run == 0 )
+            run_start = blk;
+        if ( ( ( blk & 7 ) == 0 ) && ( fs->free_map[blk >> 3] == 0 ) &&
+             ( run + 8 <= want ) && ( blk + 8 <= fs->blk_count ) ) {
+            run += 8;
+            blk += 8;
+        } else {
+            run++;
+            blk++;
+        }
+        if ( run > best ) {
+            best = run;
+            best_start = run_start;
+        }
+    }
+    REDSFS_COUNT( fs, allocs, 1 );
+    REDSFS_COUNT( fs, alloc_scan, blk - fs->free_hint );
+    *got = ( best > want ) ? want : best;
+    return best_start;
+}
+#endif
+
+#if REDSFS_USE_EXTENTS
+// Reserve contiguous runs of blocks for a new file expected to be size_hint bytes,
+// taking the first run that fits or the longest ones there are, up to REDSFS_EXTENTS.
+static int8_t redsfs_reserve( redsfs_fh * fh, uint32_t size_hint )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t need;
+    uint32_t start;
+    uint32_t got;
+    uint32_t i;
+
+    // Blocks up to the one holding the end of file, which is a fresh one when the data fills a block
+    if ( size_hint < ( BLK_SZ(fs) - BLK_OFFSET_FIRST_EXT ) )
+        need = 1;
+    else
+        need = 2 + ( size_hint - ( BLK_SZ(fs) - BLK_OFFSET_FIRST_EXT ) ) / BLK_DATA_CHUNK(fs);
+
+    // Slots past ext_cnt go out with the first block too, so they have to read as empty
+    memset( fh->ext, 0, sizeof(fh->ext) );
+    fh->ext_cnt = 0;
+    fh->ext_alloc = 0;
+    REDSFS_LOCK(fs);
+    while ( ( need > 0 ) && ( fh->ext_cnt < REDSFS_EXTENTS ) ) {
+        start = redsfs_find_run( fs, need, &got );
+        if ( got == 0 )
+            break;
+        for ( i = 0; i < got; i++ )
+            redsfs_map_mark( fs, fs->fs_start + ( start + i ) * BLK_SZ(fs), 1 );
+        fh->ext[fh->ext_cnt].start_addr = start * BLK_SZ(fs);
+        fh->ext[fh->ext_cnt].blocks = got;
+        fh->ext_cnt++;
+        need -= got;
+    }
+    REDSFS_UNLOCK(fs);
+
+    return ( fh->ext_cnt > 0 ) ? 0 : -1;
+}
+
+// Where block blk_num of the chain is when it falls inside the file's runs,
+// REDSFS_NO_BLK otherwise. *run gets the blocks left in that run from it on.
+static uint32_t redsfs_ext_blk( redsfs_fh * fh, uint32_t blk_num, uint32_t * run )
+{
+    uint8_t i;
+
+    for ( i = 0; i < fh->ext_cnt; i++ ) {
+        if ( blk_num < fh->ext[i].blocks ) {
+            *run = fh->ext[i].blocks - blk_num;
+            return fh->fs->fs_start + fh->ext[i].start_addr + blk_num * BLK_SZ(fh->fs);
+        }
+        blk_num -= fh->ext[i].blocks;
+    }
+    *run = 0;
+    return REDSFS_NO_BLK;
+}
+#endif
+
+// Next block for a writer, from its reserved runs while they last
+static int32_t redsfs_fh_alloc( redsfs_fh * fh )
+{
+#if REDSFS_USE_EXTENTS
+    uint32_t chunk;
+    uint32_t run;
+
+    chunk = redsfs_ext_blk( fh, fh->ext_alloc, &run );
+    if ( chunk != REDSFS_NO_BLK ) {
+        fh->ext_alloc++;
+        return chunk;
+    }
+#endif
+    return redsfs_alloc_block( fh->fs );
+}
+
+#if REDSFS_USE_EXTENTS
+
+// Hand back reserved blocks a writer never used, leaving the runs its chain starts with
+static void redsfs_ext_trim( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t keep = fh->ext_alloc;
+    uint32_t i;
+    uint8_t e;
+
+    REDSFS_LOCK(fs);
+    for ( e = 0; e < fh->ext_cnt; e++ ) {
+        for ( i = keep; i < fh->ext[e].blocks; i++ )
+            redsfs_map_mark( fs, fs->fs_start + fh->ext[e].start_addr + i * BLK_SZ(fs), 0 );
+        if ( keep < fh->ext[e].blocks )
+            fh->ext[e].blocks = keep;
+        keep -= fh->ext[e].blocks;
+    }
+    REDSFS_UNLOCK(fs);
+
+    while ( ( fh->ext_cnt > 0 ) && ( fh->ext[fh->ext_cnt - 1].blocks == 0 ) )
+        fh->ext_cnt--;
+}
+#endif
+
+// Fill st from the first block at chunk, hdr holding at least its header and the start
+// of its data. A compressed file's size is in front of its stream.
+static void redsfs_stat_fill( redsfs_fs * fs, redsfs_stat * st, uint8_t * hdr, uint32_t chunk )
+{
+    redsfs_fb * fb = (redsfs_fb*)hdr;
+    uint32_t first_off = ( fb->flags & FB_HAS_EXTENTS ) ? BLK_OFFSET_FIRST_EXT : BLK_OFFSET_FIRST;
+    uint32_t raw;
+
+    memcpy( st->name, fb->data.namedata, BLK_NAME_SIZE );
+    st->name[BLK_NAME_SIZE] = 0;
+    st->first_blk = chunk - fs->fs_start;
+    st->flags = fb->flags;
+    st->size = ( fb->flags & FB_IS_SIZED ) ? (int32_t)fb->data.file_size : -1;
+    if ( ( fb->flags & FB_IS_COMP ) && ( fb->data.size >= sizeof(raw) ) ) {
+        memcpy( &raw, hdr + first_off, sizeof(raw) );
+        st->size = raw;
+    }
+}
+
+// Next file in the listing, st (if given) filled in from the block the listing reads anyway
+static char * redsfs_do_next_file( redsfs_fs * fs, redsfs_stat * st )
+{
+    uint32_t chunk;
+    uint32_t off;
+    uint8_t rres;
+    redsfs_pack_ent ent;
+    uint8_t hdr[BLK_OFFSET_FIRST_EXT + sizeof(uint32_t)];
+    char * fname = NULL;
+
+    // Check we are mounted
+    if (fs->mounted != 1) {
+        return NULL;
+    }
+
+    REDSFS_LOCK(fs);
+    // The directory table lists without touching flash
+    if ( fs->dir != NULL ) {
+        if ( fs->dir_pos < fs->dir_cnt ) {
+            memcpy( fs->seek_cache, fs->dir[fs->dir_pos].name, BLK_NAME_SIZE );
+            fs->seek_cache[BLK_NAME_SIZE] = 0;
+            fname = (char*)fs->seek_cache;
+            // Flags are not in the table, the header read is all this costs
+            if ( st != NULL ) {
+                chunk = fs->fs_start + fs->dir[fs->dir_pos].first_blk_addr;
+                off = ( chunk - fs->fs_start ) % BLK_SZ(fs);
+                if ( off != 0 ) {
+                    redsfs_io_read( fs, chunk, sizeof(ent), (uint8_t*)&ent );
+                    memcpy( st->name, fname, BLK_NAME_SIZE + 1 );
+                    st->first_blk = chunk - fs->fs_start;
+                    st->size = ent.size;
+                    st->flags = FB_IS_USED | FB_IS_PACK;
+                } else {
+                    redsfs_io_read( fs, chunk, sizeof(hdr), hdr );
+                    redsfs_stat_fill( fs, st, hdr, chunk );
+                }
+            }
+            fs->dir_pos++;
+        }
+        REDSFS_UNLOCK(fs);
+        return fname;
+    }
+
+    // Check and seek through the file system. Part way through a pack block seek_chunk
+    // is its next entry, and the block is still in the seek cache.
+    chunk = fs->seek_chunk;
+    off = ( chunk - fs->fs_start ) % BLK_SZ(fs);
+    chunk -= off;
+    for ( ; chunk < fs->fs_end; chunk += BLK_SZ(fs), off = 0 ) {
+        if ( off == 0 ) {
+            if ( !redsfs_is_head( fs, chunk ) )
+                continue;
+            rres = redsfs_io_read( fs, chunk, 40, fs->seek_cache );
+	    // Do we have a new file header block?
+            if ( ( ((redsfs_fb*)fs->seek_cache)->flags & ( FB_IS_FIRST | FB_IS_DEAD ) ) == FB_IS_FIRST ) {
+	        // Read the current full block, with filename
+	        rres = redsfs_io_read( fs, chunk, BLK_SZ(fs), fs->seek_cache );
+	        // Return the file name of the current block
+                fname = ((redsfs_fb*)fs->seek_cache)->data.namedata;
+                if ( st != NULL )
+                    redsfs_stat_fill( fs, st, fs->seek_cache, chunk );
+	        break;
+	    }
+	    // Keep going until we find the next populated first or pack block
+#if REDSFS_USE_PACK
+	    if ( ( ((redsfs_fb*)fs->seek_cache)->flags & ( FB_IS_USED | FB_IS_PACK | FB_IS_DEAD ) ) !=
+	         ( FB_IS_USED | FB_IS_PACK ) )
+	        continue;
+	    rres = redsfs_io_read( fs, chunk, BLK_SZ(fs), fs->seek_cache );
+	    off = BLK_OFFSET_CHUNK;
+#else
+	    continue;
+#endif
+        }
+#if REDSFS_USE_PACK
+        // Packed files one per call
+        off = redsfs_pack_next( fs, fs->seek_cache, off );
+        if ( off != 0 ) {
+            redsfs_pack_name( fs->seek_cache, off, fs->seek_name );
+            fname = fs->seek_name;
+            if ( st != NULL ) {
+                memcpy( &ent, fs->seek_cache + off, sizeof(ent) );
+                memcpy( st->name, fname, BLK_NAME_SIZE + 1 );
+                st->first_blk = chunk + off - fs->fs_start;
+                st->size = ent.size;
+                st->flags = FB_IS_USED | FB_IS_PACK;
+            }
+            break;
+        }
+#endif
+    }
+    // Update our current seeking mark to the next one (or the end)
+    if ( fname == NULL ) {
+        fs->seek_chunk = chunk;
+#if REDSFS_USE_PACK
+    } else if ( off != 0 ) {
+        memcpy( &ent, fs->seek_cache + off, sizeof(ent) );
+        fs->seek_chunk = chunk + off + redsfs_pack_len( &ent );
+#endif
+    } else {
+        fs->seek_chunk = chunk + BLK_SZ(fs);
+    }
+    REDSFS_UNLOCK(fs);
+
+    // Finish up returning NULL at the end, like readdir.
+    return fname;
+}
+
+// Every block but the last is full, so a file position maps straight to a chain
+// position and offset within that block.
+static uint32_t redsfs_pos_blk( redsfs_fh * fh, uint32_t pos, uint32_t * offset )
+{
+    redsfs_fs * fs = fh->fs;
+
+    if ( pos < ( BLK_SZ(fs) - fh->first_off ) ) {
+        *offset = fh->first_off + pos;
+        return 0;
+    }
+    pos -= ( BLK_SZ(fs) - fh->first_off );
+    *offset = BLK_OFFSET_CHUNK + ( pos % BLK_DATA_CHUNK(fs) );
+    return 1 + pos / BLK_DATA_CHUNK(fs);
+}
+
+// Give a handle its block cache, from the heap or a free slot of fs_mem
+static int8_t redsfs_fh_take( redsfs_fh * fh )
+{
+#if REDSFS_STATIC
+    redsfs_mem * mem = fh->fs->fs_mem;
+    uint8_t i;
+
+    fh->cache = NULL;
+    REDSFS_LOCK(fh->fs);
+    for ( i = 0; i < REDSFS_MAX_OPEN; i++ ) {
+        if ( ( mem->fh_used & ( 1u << i ) ) == 0 ) {
+            mem->fh_used |= 1u << i;
+            fh->slot = i;
+            fh->cache = mem->fh_cache[i];
+            break;
+        }
+    }
+    REDSFS_UNLOCK(fh->fs);
+#else
+    fh->cache = malloc( BLK_SZ(fh->fs) );
+#endif
+    return ( fh->cache != NULL ) ? 0 : -1;
+}
+
+// Let go of everything a handle was given
+static void redsfs_fh_drop( redsfs_fh * fh )
+{
+#if REDSFS_STATIC
+    if ( fh->cache != NULL ) {
+        REDSFS_LOCK(fh->fs);
+        fh->fs->fs_mem->fh_used &= ~( 1u << fh->slot );
+        REDSFS_UNLOCK(fh->fs);
+    }
+#endif
+    REDSFS_FREE( fh->cache );
+    fh->cache = 0;
+    REDSFS_FREE( fh->skip );
+    fh->skip = 0;
+    REDSFS_FREE( fh->lz );
+    fh->lz = NULL;
+}
+
+// Start the skip slots of a handle off with its first block
+static void redsfs_skip_init( redsfs_fh * fh, uint32_t chunk )
+{
+#if REDSFS_STATIC
+    fh->skip_cap = REDSFS_SKIP_SLOTS;
+    fh->skip = fh->fs->fs_mem->fh_skip[fh->slot];
+#else
+    fh->skip_cap = REDSFS_SKIP_STRIDE;
+    fh->skip = malloc( fh->skip_cap * sizeof(uint32_t) );
+#endif
+    fh->skip_stride = REDSFS_SKIP_STRIDE;
+    fh->skip_cnt = 0;
+    if ( fh->skip == NULL ) {
+        fh->skip_cap = 0;
+        return;
+    }
+    fh->skip[fh->skip_cnt++] = chunk;
+}
+
+// Remember where a block of the chain lives if it falls on the skip stride.
+// The slots grow with the file up to REDSFS_SKIP_MAX, after that they are
+// thinned out to every other one.
+static void redsfs_skip_note( redsfs_fh * fh, uint32_t blk_num, uint32_t chunk )
+{
+    uint32_t * grown;
+    uint16_t i;
+
+    if ( ( fh->skip == NULL ) || ( blk_num % fh->skip_stride ) )
+        return;
+
+    // Only extend the slots in order, so they always cover the chain from the start
+    if ( ( blk_num / fh->skip_stride ) != fh->skip_cnt )
+        return;
+
+    if ( fh->skip_cnt == fh->skip_cap ) {
+        grown = NULL;
+        if ( fh->skip_cap < REDSFS_SKIP_MAX )
+            grown = REDSFS_REALLOC( fh->skip, fh->skip_cap * 2 * sizeof(uint32_t) );
+        if ( grown != NULL ) {
+            fh->skip = grown;
+            fh->skip_cap *= 2;
+        } else {
+            for ( i = 0; i < fh->skip_cnt / 2; i++ )
+                fh->skip[i] = fh->skip[i * 2];
+            fh->skip_cnt /= 2;
+            fh->skip_stride *= 2;
+            if ( blk_num % fh->skip_stride )
+                return;
+        }
+    }
+
+    fh->skip[fh->skip_cnt++] = chunk;
+}
+
+static ssize_t redsfs_do_cur_file_size( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t chunk;
+    ssize_t fileSize = 0;
+    uint32_t steps = 0;
+    uint8_t rres;
+    redsfs_fb hdr;
+
+    // Check mount and file
+    if ( (fh->handle < 1) || (fs->mounted != 1) ) {
+        return 0;
+    }
+
+    if ( fh->lz != NULL )
+        return fh->lz->raw_size;
+
+    // Known from the first block header, or counted as we write
+    if ( fh->f_size >= 0 )
+        return fh->f_size;
+
+    // Files without a size in the header (never closed), scan and add block sizes.
+    // Headers only so the file's block cache is left alone.
+    // Start with first
+    chunk = fh->f_start_blk;
+    rres = redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+    if ( hdr.data.size > 0 ) {
+      while ( ( hdr.flags & FB_IS_LAST) == 0)
+      {
+        fileSize += hdr.data.size;
+	chunk = fs->fs_start + hdr.next_blk_addr;
+        // Stop at a pointer to nowhere, or going round a loop, rather than walk off through garbage
+        if ( (chunk > (fs->fs_end - BLK_SZ(fs)) ) || ( hdr.next_blk_addr % BLK_SZ(fs) ) ||
+             ( ++steps > fs->blk_count ) )
+          break;
+	rres = redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+        // Nothing from a block that is not one of ours counts
+        if ( ( ( hdr.flags & FB_IS_USED ) == 0 ) || ( hdr.data.size > BLK_DATA_CHUNK(fs) ) ) {
+          hdr.data.size = 0;
+          break;
+        }
+      }
+      if ( ( hdr.flags & FB_IS_LAST) )
+        fileSize += hdr.data.size;
+    }
+
+    fh->f_size = fileSize;
+    return fileSize;
+}
+
+// Seek the file chunk pointer and size pointer to one past the last byte of the current file.
+static void redsfs_do_seek_to_end( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t chunk;
+    uint32_t first_flags;
+    uint32_t fileSize = 0;
+    uint32_t blk_num = 0;
+    uint32_t offset;
+    int rres;
+    redsfs_fb hdr;
+
+    // Check we have an open file!
+    if (fh->handle < 1)
+	return;
+
+    // Check we are mounted
+    if (fs->mounted != 1)
+        return;
+
+    // The first block header says where the last block is, straight after open
+    // it is still in the file's cache.
+    if ( fh->cache_blk == fh->f_start_blk ) {
+        REDSFS_COUNT( fs, cache_hits, 1 );
+        memcpy( &hdr, fh->cache, BLK_OFFSET_FIRST );
+    } else {
+        REDSFS_COUNT( fs, cache_misses, 1 );
+        rres = redsfs_io_read( fs, fh->f_start_blk, BLK_OFFSET_FIRST, (uint8_t*)&hdr );
+    }
+    first_flags = hdr.flags;
+    if ( first_flags & FB_IS_SIZED ) {
+        chunk = fs->fs_start + hdr.data.last_blk_addr;
+        fh->f_size = hdr.data.file_size;
+        blk_num = redsfs_pos_blk( fh, fh->f_size, &offset );
+    } else {
+        chunk = fh->f_start_blk;
+    }
+
+    // Follow the chain to the last written block (only one step for sized files).
+    while ( chunk < fs->fs_end )
+    {
+        if ( chunk != fh->cache_blk ) {
+            REDSFS_COUNT( fs, cache_misses, 1 );
+	    rres = redsfs_io_read( fs, chunk, BLK_SZ(fs), fh->cache );
+	    fh->cache_blk = chunk;
+	} else {
+            REDSFS_COUNT( fs, cache_hits, 1 );
+        }
+	fileSize += ((redsfs_fb*)fh->cache)->data.size;
+	// Check if this is the last block, if not go to next one.
+        if (( ( ((redsfs_fb*)fh->cache)->flags & FB_IS_USED ) &&
+              ( ((redsfs_fb*)fh->cache)->flags & FB_IS_LAST ) ) )
+	{
+	    // Set the pointer to the current data size, dependant on whether first or othe block.
+	    if ( ((redsfs_fb*)fh->cache)->flags & FB_IS_FIRST ) {
+                fh->blk_curoffset = ((redsfs_fb*)fh->cache)->data.size + fh->first_off;
+	    } else {
+		fh->blk_curoffset = ((redsfs_fb*)fh->cache)->data.size + BLK_OFFSET_CHUNK;
+	    }
+
+	    // Set the current chunk in handle
+	    fh->f_cur_blk = chunk;
+	    if ( ( first_flags & FB_IS_SIZED ) == 0 )
+	        fh->f_size = fileSize;
+	    fh->f_pos = fh->f_size;
+	    fh->blk_num = blk_num;
+	    break;
+	} else if ( ((redsfs_fb*)fh->cache)->next_blk_addr == 0 ) {
+	    // Broken chain, nowhere left to go
+	    break;
+	} else { // Not the last block, follow it to the next one.
+            chunk = fs->fs_start + ((redsfs_fb*)fh->cache)->next_blk_addr;
+            redsfs_skip_note( fh, ++blk_num, chunk );
+	}
+    }
+    //printf("Returning at chunk %d with offset at %d\r\n", fh->f_cur_blk, fh->blk_curoffset );
+    return;
+}
+
+// Log files take appends through MODE_LOG only. Records gather in the handle's cache and
+// nothing of a log is programmed twice. A commit writes the data gained since the last
+// one after what is already on flash, then the bytes the block now holds into the next
+// free 4 byte marker slot, the slots running down from the end of the block towards the
+// data. A block's next block address and size go into its header once, when the log
+// moves on from it, so log blocks can end short and the tail's size is in its markers.
+
+// Commit marker slot i of a log block
+#define LOG_MARK(fs, i) ( BLK_SZ(fs) - ( (i) + 1 ) * sizeof(uint32_t) )
+
+// Bytes the log tail block in buf holds by its markers, with the slots taken in marks
+static uint32_t redsfs_log_marked( redsfs_fs * fs, uint8_t * buf, uint32_t hdr_len, uint16_t * marks )
+{
+    uint32_t size = 0;
+    uint32_t v;
+    uint16_t i;
+
+    for ( i = 0; ( i + 1 ) * sizeof(uint32_t) <= BLK_SZ(fs) - hdr_len; i++ ) {
+        memcpy( &v, buf + LOG_MARK(fs, i), sizeof(v) );
+        // A free slot, or not a marker at all
+        if ( ( v == 0 ) || ( v < size ) || ( v > LOG_MARK(fs, i) - hdr_len ) )
+            break;
+        size = v;
+    }
+    if ( marks != NULL )
+        *marks = i;
+    return size;
+}
+
+// Put the data the tail block has gained since it was last programmed on flash
+static void redsfs_log_program( redsfs_fh * fh )
+{
+    if ( fh->blk_curoffset > fh->prog_off )
+        redsfs_io_write( fh->fs, fh->f_cur_blk + fh->prog_off, fh->blk_curoffset - fh->prog_off,
+                           fh->cache + fh->prog_off );
+    fh->prog_off = fh->blk_curoffset;
+}
+
+// Program the header of a new log block, all of it but the next block address and size
+static void redsfs_log_start( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t hdr_len = ( fh->f_cur_blk == fh->f_start_blk ) ? fh->first_off : BLK_OFFSET_CHUNK;
+    uint32_t name_off = offsetof(redsfs_fb, data.namedata);
+
+    redsfs_io_write( fs, fh->f_cur_blk, sizeof(uint32_t), fh->cache );
+    if ( hdr_len > name_off )
+        redsfs_io_write( fs, fh->f_cur_blk + name_off, hdr_len - name_off, fh->cache + name_off );
+    fh->blk_curoffset = hdr_len;
+    fh->prog_off = hdr_len;
+    fh->log_marks = 0;
+}
+
+// Move on to a fresh block. It is claimed on flash before the tail points at it, then the
+// tail gets the rest of its data and its header is completed.
+static int32_t redsfs_log_next( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_fb * fb = (redsfs_fb*)fh->cache;
+    uint32_t link[2];
+    int32_t next;
+
+    next = redsfs_fh_alloc( fh );
+    if ( next < 0 )
+        return next;
+
+    redsfs_log_program( fh );
+    link[0] = next - fs->fs_start;
+    link[1] = fb->data.size;
+
+    memset( fh->cache, 0, BLK_SZ(fs) );
+    fb->flags = FB_IS_USED | FB_IS_CONT;
+    redsfs_io_write( fs, next, sizeof(uint32_t), fh->cache );
+    redsfs_io_write( fs, fh->f_cur_blk + offsetof(redsfs_fb, next_blk_addr), sizeof(link), (uint8_t*)link );
+
+    fh->f_cur_blk = next;
+    fh->cache_blk = next;
+    fh->blk_curoffset = BLK_OFFSET_CHUNK;
+    fh->prog_off = BLK_OFFSET_CHUNK;
+    fh->log_marks = 0;
+    redsfs_skip_note( fh, ++fh->blk_num, next );
+    return next;
+}
+
+static size_t redsfs_log_write( redsfs_fh * fh, char * buf, size_t size )
+{
+    redsfs_fs * fs = fh->fs;
+    size_t done = 0;
+    size_t n;
+    int32_t next;
+
+    while ( done < size ) {
+        // Data stops short of the next free marker slot
+        if ( fh->blk_curoffset >= LOG_MARK(fs, fh->log_marks) ) {
+            next = redsfs_log_next( fh );
+            if ( next < 0 )
+                return next;
+        }
+        n = LOG_MARK(fs, fh->log_marks) - fh->blk_curoffset;
+        if ( n > size - done )
+            n = size - done;
+        memcpy( fh->cache + fh->blk_curoffset, buf + done, n );
+        ((redsfs_fb*)fh->cache)->data.size += n;
+        fh->blk_curoffset += n;
+        fh->f_size += n;
+        fh->f_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+// Commit what has been logged so far, the new data and then a marker for it
+static void redsfs_log_commit( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t size = ((redsfs_fb*)fh->cache)->data.size;
+    uint32_t last = 0;
+    uint32_t mark;
+
+    redsfs_log_program( fh );
+    if ( fh->log_marks > 0 )
+        memcpy( &last, fh->cache + LOG_MARK(fs, fh->log_marks - 1), sizeof(last) );
+    if ( size == last )
+        return;
+
+    mark = LOG_MARK(fs, fh->log_marks);
+    memcpy( fh->cache + mark, &size, sizeof(size) );
+    redsfs_io_write( fs, fh->f_cur_blk + mark, sizeof(size), fh->cache + mark );
+    fh->log_marks++;
+}
+
+// Follow a log's chain from its first block, in the cache, to the tail, which is left
+// in the cache with its size from the markers. Sets the file size and position to the
+// end. Returns the marker slots the tail has taken, -1 if the chain is broken.
+static int32_t redsfs_log_tail( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_fb * fb = (redsfs_fb*)fh->cache;
+    uint32_t chunk = fh->f_start_blk;
+    uint32_t hdr_len = fh->first_off;
+    uint32_t total = 0;
+    uint16_t marks;
+    redsfs_fb hdr;
+
+    memcpy( &hdr, fh->cache, BLK_OFFSET_CHUNK );
+    fh->blk_num = 0;
+    while ( hdr.next_blk_addr != 0 ) {
+        total += hdr.data.size;
+        chunk = fs->fs_start + hdr.next_blk_addr;
+        // Stop at a pointer to nowhere, or going round a loop
+        if ( ( chunk > fs->fs_end - BLK_SZ(fs) ) || ( hdr.next_blk_addr % BLK_SZ(fs) ) ||
+             ( fh->blk_num >= fs->blk_count ) )
+            return -1;
+        redsfs_skip_note( fh, ++fh->blk_num, chunk );
+        redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+        hdr_len = BLK_OFFSET_CHUNK;
+    }
+
+    redsfs_io_read( fs, chunk, BLK_SZ(fs), fh->cache );
+    fb->data.size = redsfs_log_marked( fs, fh->cache, hdr_len, &marks );
+    fh->f_cur_blk = chunk;
+    fh->cache_blk = chunk;
+    fh->blk_curoffset = hdr_len + fb->data.size;
+    fh->f_size = total + fb->data.size;
+    fh->f_pos = fh->f_size;
+    return marks;
+}
+
+// Pick up a log at its committed end. Past that the tail may hold data whose commit never
+// got its marker, which is not written over: the log carries on in a fresh block instead.
+static int8_t redsfs_log_open( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    int32_t marks = redsfs_log_tail( fh );
+    uint32_t i;
+
+    if ( marks < 0 )
+        return -1;
+    fh->log_marks = marks;
+    fh->prog_off = fh->blk_curoffset;
+    for ( i = fh->blk_curoffset; i < LOG_MARK(fs, fh->log_marks); i++ ) {
+        if ( fh->cache[i] != 0 )
+            return ( redsfs_log_next( fh ) < 0 ) ? -1 : 0;
+    }
+    return 0;
+}
+
+// Logs can have short blocks, a seek follows the chain headers from the start
+static int32_t redsfs_log_seek( redsfs_fh * fh, uint32_t pos )
+{
+    redsfs_fs * fs = fh->fs;
+    uint32_t chunk = fh->f_start_blk;
+    uint32_t hdr_len = fh->first_off;
+    uint32_t left = pos;
+    uint32_t blk_num = 0;
+    redsfs_fb hdr;
+
+    redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+    while ( ( hdr.next_blk_addr != 0 ) && ( left >= hdr.data.size ) ) {
+        left -= hdr.data.size;
+        chunk = fs->fs_start + hdr.next_blk_addr;
+        if ( ( chunk > fs->fs_end - BLK_SZ(fs) ) || ( ++blk_num > fs->blk_count ) )
+            return -1;
+        redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+        hdr_len = BLK_OFFSET_CHUNK;
+    }
+
+    fh->f_cur_blk = chunk;
+    fh->blk_curoffset = hdr_len + left;
+    fh->blk_num = blk_num;
+    fh->f_pos = pos;
+    return pos;
+}
+
+#if REDSFS_USE_PACK
+// Set up a handle on the packed file with its entry at addr, its pack block is in the cache.
+// The file is laid out in the cache as a single block file, so reads never go to flash.
+// Appending carries it on as a new packed writer, whose entry replaces this one on close.
+static int8_t redsfs_pack_open( redsfs_fh * fh, uint32_t addr, uint8_t mode )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_fb * fb = (redsfs_fb*)fh->cache;
+    uint32_t off = ( addr - fs->fs_start ) % BLK_SZ(fs);
+    redsfs_pack_ent ent;
+    char name[BLK_NAME_SIZE];
+
+    if ( ( mode != MODE_READ ) && ( mode != MODE_APPEND ) )
+        return -1;
+
+    memcpy( &ent, fh->cache + off, sizeof(ent) );
+    memset( name, 0, sizeof(name) );
+    memcpy( name, fh->cache + off + sizeof(ent), ent.name_len );
+    memmove( fh->cache + BLK_OFFSET_FIRST, fh->cache + off + sizeof(ent) + ent.name_len, ent.size );
+    memset( fh->cache, 0, BLK_OFFSET_FIRST );
+    fb->flags = FB_IS_USED | FB_IS_FIRST;
+    memcpy( fb->data.namedata, name, BLK_NAME_SIZE );
+    fb->data.size = ent.size;
+
+    fh->handle = 1;
+    fh->packed = 1;
+    fh->mode = mode;
+    fh->first_off = BLK_OFFSET_FIRST;
+#if REDSFS_USE_EXTENTS
+    fh->ext_cnt = 0;
+    fh->ext_alloc = 0;
+#endif
+    fh->blk_num = 0;
+    fh->f_size = ent.size;
+    if ( mode == MODE_READ ) {
+        fb->flags |= FB_IS_LAST | FB_IS_SIZED;
+        fb->data.file_size = ent.size;
+        fb->data.last_blk_addr = addr - fs->fs_start;
+        fh->f_start_blk = addr;
+        fh->blk_curoffset = BLK_OFFSET_FIRST;
+        fh->f_pos = 0;
+    } else {
+        fh->f_start_blk = REDSFS_NO_BLK;
+        fh->blk_curoffset = BLK_OFFSET_FIRST + ent.size;
+        fh->f_pos = ent.size;
+        fh->pack_old = addr;
+    }
+    fh->f_cur_blk = fh->f_start_blk;
+    fh->cache_blk = fh->f_start_blk;
+    redsfs_skip_init( fh, fh->f_start_blk );
+    return 0;
+}
+
+// A packed writer that grows past REDSFS_PACK_MAX takes a first block of its own
+// and carries on as an ordinary file.
+static int32_t redsfs_pack_spill( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    int32_t chunk;
+
+    chunk = redsfs_alloc_block( fs );
+    if ( chunk < 0 )
+        return chunk;
+
+    fh->packed = 0;
+    fh->f_start_blk = chunk;
+    fh->f_cur_blk = chunk;
+    fh->cache_blk = chunk;
+    if ( fh->skip != NULL )
+        fh->skip[0] = chunk;
+    REDSFS_LOCK(fs);
+    redsfs_head_mark( fs, chunk, 1 );
+    redsfs_index_add( fs, ((redsfs_fb*)fh->cache)->data.namedata, chunk );
+    redsfs_dir_add( fs, ((redsfs_fb*)fh->cache)->data.namedata, chunk, 0 );
+    REDSFS_UNLOCK(fs);
+    return chunk;
+}
+
+// Write a packed writer's file as an entry after the others in the current pack block,
+// or at the start of a fresh one when it does not fit. The entry is built in the cache
+// at BLK_OFFSET_CHUNK, so a fresh block goes out whole, zeroed after the entry.
+// Returns -1 when there is no block for it.
+static int8_t redsfs_pack_add( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_fb * fb = (redsfs_fb*)fh->cache;
+    redsfs_pack_ent ent;
+    char name[BLK_NAME_SIZE + 1];
+    uint32_t len;
+    uint32_t addr;
+    int32_t chunk;
+
+    memset( name, 0, sizeof(name) );
+    memcpy( name, fb->data.namedata, BLK_NAME_SIZE );
+    ent.name_len = strlen( name );
+    ent.flags = 0;
+    ent.size = fh->f_size;
+    len = redsfs_pack_len( &ent );
+
+    memmove( fh->cache + BLK_OFFSET_CHUNK + sizeof(ent) + ent.name_len, fh->cache + BLK_OFFSET_FIRST, ent.size );
+    memcpy( fh->cache + BLK_OFFSET_CHUNK + sizeof(ent), name, ent.name_len );
+    memcpy( fh->cache + BLK_OFFSET_CHUNK, &ent, sizeof(ent) );
+    memset( fh->cache + BLK_OFFSET_CHUNK + len, 0, BLK_SZ(fs) - BLK_OFFSET_CHUNK - len );
+
+    REDSFS_LOCK(fs);
+    redsfs_super_dirty( fs );
+    if ( ( fs->pack_blk != REDSFS_NO_BLK ) && ( fs->pack_off + len <= BLK_SZ(fs) ) ) {
+        addr = fs->pack_blk + fs->pack_off;
+        fs->pack_off += len;
+        REDSFS_UNLOCK(fs);
+        redsfs_io_write( fs, addr, len, fh->cache + BLK_OFFSET_CHUNK );
+    } else {
+        REDSFS_UNLOCK(fs);
+        chunk = redsfs_alloc_block( fs );
+        if ( chunk < 0 )
+            return -1;
+        memset( fh->cache, 0, BLK_OFFSET_CHUNK );
+        fb->flags = FB_IS_USED | FB_IS_PACK | FB_IS_LAST;
+        redsfs_io_write( fs, chunk, BLK_SZ(fs), fh->cache );
+        addr = chunk + BLK_OFFSET_CHUNK;
+        // Whatever room the old block had is left unused
+        REDSFS_LOCK(fs);
+        redsfs_head_mark( fs, chunk, 1 );
+        fs->pack_blk = chunk;
+        fs->pack_off = BLK_OFFSET_CHUNK + len;
+        REDSFS_UNLOCK(fs);
+    }
+
+    REDSFS_LOCK(fs);
+    redsfs_index_add( fs, name, addr );
+    redsfs_dir_add( fs, name, addr, ent.size );
+    REDSFS_UNLOCK(fs);
+    return 0;
+}
+
+// Flag the packed file with its entry at addr dead, reading its block into buf (a handle's
+// cache it is done with). The block goes to redsfs_gc_r once nothing in it is live, unless
+// new entries are still going into it.
+static int8_t redsfs_pack_kill( redsfs_fs * fs, uint32_t addr, uint8_t * buf )
+{
+    uint32_t off = ( addr - fs->fs_start ) % BLK_SZ(fs);
+    uint32_t chunk = addr - off;
+    redsfs_pack_ent ent;
+    char name[BLK_NAME_SIZE + 1];
+    uint32_t flags;
+
+    REDSFS_LOCK(fs);
+    redsfs_io_read( fs, chunk, BLK_SZ(fs), buf );
+    memcpy( &ent, buf + off, sizeof(ent) );
+    redsfs_pack_name( buf, off, name );
+    redsfs_super_dirty( fs );
+    redsfs_index_del( fs, name, addr );
+    redsfs_dir_del( fs, addr );
+
+    ent.flags |= PACK_DEAD;
+    memcpy( buf + off, &ent, sizeof(ent) );
+    redsfs_io_write( fs, addr + offsetof(redsfs_pack_ent, flags), 1, &ent.flags );
+
+    if ( ( chunk != fs->pack_blk ) && ( redsfs_pack_next( fs, buf, BLK_OFFSET_CHUNK ) == 0 ) ) {
+        flags = ((redsfs_fb*)buf)->flags | FB_IS_DEAD;
+        redsfs_head_mark( fs, chunk, 0 );
+        redsfs_dead_add( fs, chunk );
+        redsfs_io_write( fs, chunk, sizeof(flags), (uint8_t*)&flags );
+    }
+    REDSFS_UNLOCK(fs);
+
+    return 0;
+}
+#endif
+
+// Find the file named, leaving the first len bytes of its first block in buf (all of it for
+// a packed file, buf is a whole block). Returns the block address, the entry address for a
+// packed file, or -1 if there is no such file.
+static int32_t redsfs_file_find( redsfs_fs * fs, const char * fname, uint8_t * buf, uint32_t len )
+{
+    redsfs_fb * fb = (redsfs_fb*)buf;
+#if REDSFS_USE_INDEX
+    int32_t chunk;
+#endif
+    uint32_t addr;
+#if REDSFS_USE_PACK
+    uint32_t off;
+#endif
+
+    // With the index the file is one lookup away, it also knows when there is no such file
+#if REDSFS_USE_INDEX
+    if ( fs->index != NULL ) {
+        REDSFS_LOCK(fs);
+        chunk = redsfs_index_find( fs, fname, buf, len );
+        REDSFS_UNLOCK(fs);
+        return chunk;
+    }
+#else
+    (void)len;
+#endif
+
+    // Cycle through all blocks until file is found or not
+    for ( addr = fs->fs_start; addr < fs->fs_end; addr += BLK_SZ(fs) ) {
+        // Nothing to find in blocks the mount saw were no file's first
+        if ( !redsfs_is_head( fs, addr ) )
+            continue;
+        redsfs_io_read( fs, addr, BLK_SZ(fs), buf );
+#if REDSFS_USE_PACK
+        // Packed files are looked for by name in their block
+        if ( ( fb->flags & ( FB_IS_USED | FB_IS_PACK | FB_IS_DEAD ) ) == ( FB_IS_USED | FB_IS_PACK ) ) {
+            off = redsfs_pack_find( fs, buf, fname );
+            if ( off != 0 )
+                return addr + off;
+            continue;
+        }
+#endif
+        if ( ( ( fb->flags & ( FB_IS_USED | FB_IS_FIRST | FB_IS_DEAD ) ) == ( FB_IS_USED | FB_IS_FIRST ) ) &&
+             ( strcmp( fb->data.namedata, fname ) == 0 ) )
+            return addr;
+    }
+    return -1;
+}
+
+// Point a handle at the start of an existing file, its first block is in the handle's cache.
+// Returns -1 if the file can not be opened in the mode asked for.
+static int8_t redsfs_open_found( redsfs_fh * fh, uint32_t chunk, uint8_t mode )
+{
+    redsfs_fb * fb = (redsfs_fb*)fh->cache;
+#if REDSFS_USE_EXTENTS
+    uint8_t i;
+#endif
+
+    // Logs only ever take appends through MODE_LOG, and only logs do
+    if ( ( mode != MODE_READ ) && ( ( mode == MODE_LOG ) != ( ( fb->flags & FB_IS_LOG ) != 0 ) ) )
+        return -1;
+
+    // Compressed files are written once, whole, and only read after that
+    if ( ( mode == MODE_WRITE_COMP ) || ( ( fb->flags & FB_IS_COMP ) && ( mode != MODE_READ ) ) )
+        return -1;
+
+#if REDSFS_USE_PACK
+    if ( fb->flags & FB_IS_PACK )
+        return redsfs_pack_open( fh, chunk, mode );
+#endif
+
+    fh->handle = 1;
+    fh->f_start_blk = chunk;
+    fh->f_cur_blk = chunk;
+    fh->cache_blk = chunk;
+    fh->ra_blk = chunk;
+
+    fh->first_off = ( fb->flags & FB_HAS_EXTENTS ) ? BLK_OFFSET_FIRST_EXT : BLK_OFFSET_FIRST;
+#if REDSFS_USE_EXTENTS
+    // Files created with a size hint have their runs in the first block,
+    // good once the file has been closed.
+    fh->ext_cnt = 0;
+    fh->ext_alloc = 0;
+    if ( ( fb->flags & FB_HAS_EXTENTS ) && ( fb->flags & FB_IS_SIZED ) ) {
+        for ( i = 0; ( i < REDSFS_EXTENTS ) && fb->data.ext[i].blocks; i++ ) {
+            fh->ext[i] = fb->data.ext[i];
+            fh->ext_alloc += fb->data.ext[i].blocks;
+        }
+        fh->ext_cnt = i;
+    }
+#endif
+    fh->blk_curoffset = fh->first_off;
+    fh->mode = mode;
+    fh->f_pos = 0;
+    fh->blk_num = 0;
+    redsfs_skip_init( fh, chunk );
+    if ( ((redsfs_fb*)fh->cache)->flags & FB_IS_SIZED )
+        fh->f_size = ((redsfs_fb*)fh->cache)->data.file_size;
+    else
+        fh->f_size = -1;
+    if ( mode == MODE_APPEND )
+        redsfs_do_seek_to_end( fh );
+    // A log's size comes from its tail, readers then go back to the start
+    fh->log = ( fb->flags & FB_IS_LOG ) != 0;
+    if ( fh->log ) {
+        if ( ( mode == MODE_LOG ) ? ( redsfs_log_open( fh ) < 0 ) : ( redsfs_log_tail( fh ) < 0 ) ) {
+            fh->handle = 0;
+            return -1;
+        }
+        if ( mode == MODE_READ ) {
+            fh->f_cur_blk = chunk;
+            fh->blk_curoffset = fh->first_off;
+            fh->blk_num = 0;
+            fh->f_pos = 0;
+        }
+        return 0;
+    }
+#if REDSFS_USE_LZ
+    if ( fb->flags & FB_IS_COMP ) {
+#if REDSFS_STATIC
+        fh->lz = &fh->fs->fs_mem->fh_lz[fh->slot];
+#else
+        fh->lz = malloc( sizeof(redsfs_lz) );
+#endif
+        if ( ( fh->lz == NULL ) || ( redsfs_lz_reset( fh ) < 0 ) ) {
+            REDSFS_FREE( fh->lz );
+            fh->lz = NULL;
+            fh->handle = 0;
+            return -1;
+        }
+    }
+#else
+    // Nothing here to decompress it with
+    if ( fb->flags & FB_IS_COMP ) {
+        fh->handle = 0;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Free/release the mount's memory
+static void redsfs_mount_free( redsfs_fs * fs )
+{
+    REDSFS_FREE(fs->seek_cache);
+    fs->seek_cache = 0;
+    REDSFS_FREE(fs->free_map);
+    fs->free_map = 0;
+    REDSFS_FREE(fs->head_map);
+    fs->head_map = 0;
+    REDSFS_FREE(fs->gone_map);
+    fs->gone_map = 0;
+    REDSFS_FREE(fs->index);
+    fs->index = 0;
+    REDSFS_FREE(fs->dir);
+    fs->dir = 0;
+    REDSFS_FREE(fs->dead);
+    fs->dead = 0;
+    REDSFS_FREE(fs->rcache);
+    fs->rcache = 0;
+    REDSFS_FREE(fs->rcache_slot);
+    fs->rcache_slot = 0;
+}
+
+// Main function calls
+static int8_t redsfs_do_mount( redsfs_fs * fs )
+{
+#if REDSFS_USE_CACHE
+    uint32_t i;
+#endif
+
+#if REDSFS_BLOCK_SIZE
+    // Built for the one block size, which the image can leave to the build
+    if ( fs->fs_block_size == 0 )
+        fs->fs_block_size = REDSFS_BLOCK_SIZE;
+    if ( fs->fs_block_size != REDSFS_BLOCK_SIZE ) {
+        printf("Bad block size %u, built for %u\r\n", fs->fs_block_size, REDSFS_BLOCK_SIZE);
+        return -1;
+    }
+#endif
+    // Block size has to be a power of two the headers and block offsets fit in
+    if ( ( fs->fs_block_size < BLK_SIZE_MIN ) || ( fs->fs_block_size > BLK_SIZE_MAX ) ||
+         ( fs->fs_block_size & ( fs->fs_block_size - 1 ) ) ) {
+        printf("Bad block size %u\r\n", fs->fs_block_size);
+        return -1;
+    }
+#if REDSFS_STATIC
+    if ( fs->fs_mem == NULL ) {
+        printf("No fs_mem to mount in\r\n");
+        return -1;
+    }
+    fs->fs_mem->fh_used = 0;
+#endif
+
+    // The caller has filled in the geometry and calling functions, the rest is ours.
+    fs->mounted = 1;
+    fs->free_map = NULL;
+    fs->head_map = NULL;
+    fs->gone_map = NULL;
+    fs->index = NULL;
+    fs->dir = NULL;
+    fs->dead = NULL;
+
+    // Seeking/ls for file system
+    fs->seek_chunk = fs->fs_start;
+
+    // Allocate memory and clear
+#if REDSFS_STATIC
+    fs->seek_cache = fs->fs_mem->seek_cache;
+#else
+    fs->seek_cache = malloc(BLK_SZ(fs));
+    if ( fs->seek_cache == NULL ) {
+        fs->mounted = 0;
+        return -1;
+    }
+#endif
+    memset (fs->seek_cache, 0, BLK_SZ(fs));
+
+    // Block cache, out of memory the mount goes without
+    fs->rcache = NULL;
+    fs->rcache_slot = NULL;
+    fs->rcache_tick = 0;
+#if REDSFS_USE_CACHE
+    if ( fs->fs_cache_blocks > 0 ) {
+#if REDSFS_STATIC
+        if ( fs->fs_cache_blocks > REDSFS_CACHE_BLOCKS )
+            fs->fs_cache_blocks = REDSFS_CACHE_BLOCKS;
+        fs->rcache = fs->fs_mem->rcache;
+        fs->rcache_slot = fs->fs_mem->rcache_slot;
+#else
+        fs->rcache = malloc( fs->fs_cache_blocks * BLK_SZ(fs) );
+        fs->rcache_slot = malloc( fs->fs_cache_blocks * sizeof(redsfs_rc_slot) );
+#endif
+        if ( ( fs->rcache == NULL ) || ( fs->rcache_slot == NULL ) ) {
+            REDSFS_FREE( fs->rcache );
+            REDSFS_FREE( fs->rcache_slot );
+            fs->rcache = NULL;
+            fs->rcache_slot = NULL;
+            fs->fs_cache_blocks = 0;
+        } else {
+            for ( i = 0; i < fs->fs_cache_blocks; i++ ) {
+                fs->rcache_slot[i].blk = REDSFS_NO_BLK;
+                fs->rcache_slot[i].used = 0;
+            }
+        }
+    }
+#else
+    fs->fs_cache_blocks = 0;
+#endif
+
+    // Work out which blocks are free
+    if ( redsfs_map_build( fs ) < 0 ) {
+        redsfs_mount_free( fs );
+        fs->mounted = 0;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+// Files opened on the mount must be closed before this.
+static uint8_t redsfs_do_unmount( redsfs_fs * fs )
+{
+    // Check if mounted flag set, unset.
+    if (fs->mounted != 1)
+        return -1;
+
+    // Leave a checkpoint so the next mount need not scan
+    if ( fs->fs_opts & REDSFS_OPT_SUPER )
+        redsfs_do_sync( fs );
+    fs->mounted = 0;
+
+    redsfs_mount_free( fs );
+    return 0;
+}
+
+// As redsfs_open_r, a new file expected to be about size_hint bytes has contiguous
+// runs of blocks reserved for it and recorded in its first block. REDSFS_NO_HINT
+// leaves it to grow a block at a time, 0 is a hint like any other (an empty file).
+static int8_t redsfs_do_open_ex( redsfs_fs * fs, redsfs_fh * fh, char * fname, uint8_t mode, uint32_t size_hint )
+{
+    int32_t chunk;
+
+    fh->handle = 0;
+    fh->fs = fs;
+    fh->lz = NULL;
+    fh->skip = NULL;
+    fh->log = 0;
+#if REDSFS_USE_PACK
+    fh->packed = 0;
+    fh->pack_old = REDSFS_NO_BLK;
+#endif
+    fh->ra_blk = REDSFS_NO_BLK;
+    fh->crc_blk = REDSFS_NO_BLK;
+    fh->err = 0;
+#if !REDSFS_USE_PACK && !REDSFS_USE_EXTENTS
+    (void)size_hint;
+#endif
+
+    if (fs->mounted != 1)
+        return -1;
+
+    // Writers change the blocks, the checkpoint can not be trusted from here
+    if ( mode != MODE_READ ) {
+        REDSFS_LOCK(fs);
+        redsfs_super_dirty( fs );
+        REDSFS_UNLOCK(fs);
+    }
+
+    // Every open file has its own block cache
+    if ( redsfs_fh_take( fh ) < 0 )
+        return -1;
+
+    // Logs only need the header, the rest of the block is never read back
+    chunk = redsfs_file_find( fs, fname, fh->cache, ( mode == MODE_LOG ) ? BLK_OFFSET_FIRST_EXT : BLK_SZ(fs) );
+    if ( chunk >= 0 ) {
+        if ( redsfs_open_found( fh, chunk, mode ) < 0 ) {
+            redsfs_fh_drop( fh );
+            return -1;
+        }
+        return 0;
+    }
+    // If we were just opening to read and didnt find the file, we're out here with a fail
+    if ( mode == MODE_READ ) {
+        redsfs_fh_drop( fh );
+        return -1;
+    }
+
+    // If we are opening to write, we can create a file stub here...
+    // must also setup the cache memory chunk
+    if ( fh->handle == 0 ) {
+        fh->fs = fs;
+        fh->first_off = BLK_OFFSET_FIRST;
+#if REDSFS_USE_EXTENTS
+        fh->ext_cnt = 0;
+        fh->ext_alloc = 0;
+#endif
+#if REDSFS_USE_PACK
+        if ( ( size_hint <= REDSFS_PACK_MAX ) && ( fname[0] != 0 ) &&
+             ( ( mode == MODE_WRITE ) || ( mode == MODE_APPEND ) ) ) {
+            // Small enough to pack, it gets its block and entry on close
+            fh->packed = 1;
+            chunk = 0;
+        } else
+#endif
+#if REDSFS_USE_EXTENTS
+        if ( ( size_hint != REDSFS_NO_HINT ) && ( mode != MODE_LOG ) && ( redsfs_reserve( fh, size_hint ) == 0 ) ) {
+            // First block is the start of the first run
+            chunk = redsfs_fh_alloc( fh );
+            fh->first_off = BLK_OFFSET_FIRST_EXT;
+        } else
+#endif
+        {
+            chunk = redsfs_alloc_block( fs );
+        }
+
+	//printf("Next chunk found at %d\r\n", chunk);
+        if (chunk < 0) {
+            redsfs_fh_drop( fh );
+            return -1;
+        }
+
+        fh->handle = 1;
+	fh->mode = ( mode == MODE_LOG ) ? MODE_LOG : MODE_WRITE;
+        fh->prog_off = 0;
+#if REDSFS_USE_PACK
+        fh->f_start_blk = fh->packed ? REDSFS_NO_BLK : (uint32_t)chunk;
+#else
+        fh->f_start_blk = chunk;
+#endif
+        fh->f_cur_blk = fh->f_start_blk;
+        fh->blk_curoffset = fh->first_off;
+        fh->cache_blk = fh->f_start_blk;
+        fh->f_size = 0;
+        fh->f_pos = 0;
+        fh->blk_num = 0;
+        redsfs_skip_init( fh, fh->f_start_blk );
+	// Clear the memory structure for file cache of block.
+	memset ( fh->cache, 0, BLK_SZ(fs) );
+        // Setup the first block flags and used flags
+	((redsfs_fb*)fh->cache)->flags |= ( FB_IS_USED | FB_IS_FIRST );
+	if ( fh->first_off == BLK_OFFSET_FIRST_EXT )
+	    ((redsfs_fb*)fh->cache)->flags |= FB_HAS_EXTENTS;
+	if ( mode == MODE_LOG )
+	    ((redsfs_fb*)fh->cache)->flags |= FB_IS_LOG;
+	if ( mode == MODE_WRITE_COMP )
+	    ((redsfs_fb*)fh->cache)->flags |= FB_IS_COMP;
+	// Setup the first block filename part of struct (not used in other blocks)
+	//printf("Copying file name to block... %d size and %s name..:%p: old name ...", strlen(fname), fname, ((redsfs_fb*)fh->cache)->data.namedata );
+	memcpy( ((redsfs_fb*)fh->cache)->data.namedata, fname, strlen(fname) );
+#if REDSFS_USE_PACK
+	if ( fh->packed == 0 )
+#endif
+	{
+	    REDSFS_LOCK(fs);
+	    redsfs_head_mark( fs, chunk, 1 );
+	    redsfs_index_add( fs, fname, chunk );
+	    redsfs_dir_add( fs, fname, chunk, 0 );
+	    REDSFS_UNLOCK(fs);
+	}
+	// A log is on flash from the start and only ever gains data after its header
+	if ( mode == MODE_LOG ) {
+	    fh->log = 1;
+	    redsfs_log_start( fh );
+	}
+    }
+    //printf(" Returning open file %d \r\n", fh->handle);
+    return fh->handle;
+}
+
+static void redsfs_do_close( redsfs_fh * fh )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_fb * hdr;
+    int32_t ent;
+
+    // Nothing to do for a handle that is not open
+    if ( fh->handle < 1 )
+        return;
+
+    // Invalidate our handle
+    fh->handle = 0;
+    REDSFS_FREE( fh->lz );
+    fh->lz = NULL;
+
+    if ( fh->mode == MODE_LOG ) {
+        redsfs_log_commit( fh );
+        REDSFS_LOCK(fs);
+        ent = redsfs_dir_find( fs, fh->f_start_blk );
+        if ( ent >= 0 )
+            fs->dir[ent].file_size = fh->f_size;
+        REDSFS_UNLOCK(fs);
+        fh->mode = 0;
+    }
+
+#if REDSFS_USE_PACK
+    // Still small enough, the file goes into a pack block
+    if ( fh->packed && ( ( fh->mode == MODE_WRITE ) || ( fh->mode == MODE_APPEND ) ) ) {
+        // Nowhere to put it, an appended file keeps its old entry
+        if ( redsfs_pack_add( fh ) < 0 ) {
+            fh->err = 1;
+            fh->pack_old = REDSFS_NO_BLK;
+        }
+        fh->mode = 0;
+    }
+#endif
+
+    // If we are writing, then a block exists in cache to write to memory
+    if ( ( fh->mode == MODE_WRITE ) || (fh->mode == MODE_APPEND ) ) {
+        // Complete the flags (ensure "FB_IS_LAST" is set)
+        ((redsfs_fb*)fh->cache)->flags |= ( FB_IS_USED | FB_IS_LAST );
+        REDSFS_LOCK(fs);
+        redsfs_map_mark( fs, fh->f_cur_blk, 1 );
+        REDSFS_UNLOCK(fs);
+#if REDSFS_USE_EXTENTS
+        if ( fh->ext_cnt > 0 )
+            redsfs_ext_trim( fh );
+#endif
+        REDSFS_LOCK(fs);
+        ent = redsfs_dir_find( fs, fh->f_start_blk );
+        if ( ent >= 0 )
+            fs->dir[ent].file_size = fh->f_size;
+        REDSFS_UNLOCK(fs);
+        if ( fh->f_cur_blk == fh->f_start_blk ) {
+            // Single block file, the size goes out with the data
+            if ( fh->f_size >= 0 ) {
+                ((redsfs_fb*)fh->cache)->flags |= FB_IS_SIZED;
+                ((redsfs_fb*)fh->cache)->data.file_size = fh->f_size;
+                ((redsfs_fb*)fh->cache)->data.last_blk_addr = fh->f_cur_blk - fs->fs_start;
+#if REDSFS_USE_EXTENTS
+                if ( fh->ext_cnt > 0 )
+                    memcpy( ((redsfs_fb*)fh->cache)->data.ext, fh->ext, sizeof(fh->ext) );
+#endif
+            }
+        }
+        // Write to mem
+	//printf("Committing rest of file to flash at chunk %d .\r\n", fh->f_cur_blk);
+        redsfs_blk_seal( fs, fh->cache, NULL );
+        redsfs_io_write( fs, fh->f_cur_blk, BLK_SZ(fs), fh->cache );
+
+        // Record the file size and where the last block is in the first block header,
+        // so size and append need not walk the chain. The cache is free for it now,
+        // and its data comes along when the CRC has to cover it.
+        if ( ( fh->f_cur_blk != fh->f_start_blk ) && ( fh->f_size >= 0 ) ) {
+            hdr = (redsfs_fb*)fh->cache;
+            redsfs_io_read( fs, fh->f_start_blk, REDSFS_BLOCK_CRC ? BLK_SZ(fs) : fh->first_off, fh->cache );
+            hdr->flags |= FB_IS_SIZED;
+            hdr->data.file_size = fh->f_size;
+            hdr->data.last_blk_addr = fh->f_cur_blk - fs->fs_start;
+#if REDSFS_USE_EXTENTS
+            if ( fh->ext_cnt > 0 )
+                memcpy( hdr->data.ext, fh->ext, sizeof(fh->ext) );
+#endif
+            redsfs_blk_seal( fs, fh->cache, NULL );
+            redsfs_io_write( fs, fh->f_start_blk, fh->first_off, fh->cache );
+        }
+
+        // Clear file handle vars
+        fh->f_start_blk = 0;
+        fh->f_cur_blk = 0;
+        fh->blk_curoffset = 0;
+	fh->mode = 0;
+    }
+
+#if REDSFS_USE_PACK
+    // An appended packed file is in its new place, the old entry goes
+    if ( fh->pack_old != REDSFS_NO_BLK ) {
+        redsfs_pack_kill( fs, fh->pack_old, fh->cache );
+        fh->pack_old = REDSFS_NO_BLK;
+    }
+#endif
+
+    redsfs_fh_drop( fh );
+}
+
+// Deleting only marks the first block (or pack entry) dead, the chain is taken back by redsfs_gc_r.
+// The file is looked up and not opened, a log's tail or a compressed stream is no concern here.
+static uint8_t redsfs_do_delete( redsfs_fs * fs, char * name )
+{
+    redsfs_fh fh;
+    int32_t chunk;
+    uint32_t flags;
+#if REDSFS_USE_PACK
+    int8_t ret;
+#endif
+
+    if ( fs->mounted != 1 )
+        return -1;
+    fh.fs = fs;
+    fh.skip = NULL;
+    fh.lz = NULL;
+    if ( redsfs_fh_take( &fh ) < 0 )
+        return -1;
+    chunk = redsfs_file_find( fs, name, fh.cache, BLK_OFFSET_FIRST );
+    if ( chunk < 0 ) {
+        redsfs_fh_drop( &fh );
+        return -1;
+    }
+    flags = ((redsfs_fb*)fh.cache)->flags;
+
+#if REDSFS_USE_PACK
+    // Packed files are only an entry in a shared block, the cache is free to read it into
+    if ( ( chunk - fs->fs_start ) % BLK_SZ(fs) != 0 ) {
+        ret = redsfs_pack_kill( fs, chunk, fh.cache );
+        redsfs_fh_drop( &fh );
+        return ret;
+    }
+#endif
+    redsfs_fh_drop( &fh );
+
+    REDSFS_LOCK(fs);
+    redsfs_super_dirty( fs );
+    redsfs_index_del( fs, name, chunk );
+    redsfs_dir_del( fs, chunk );
+    redsfs_head_mark( fs, chunk, 0 );
+    redsfs_dead_add( fs, chunk );
+    REDSFS_UNLOCK(fs);
+
+    flags |= FB_IS_DEAD;
+    redsfs_io_write( fs, chunk, sizeof(flags), (uint8_t*)&flags );
+
+    return 0;
+}
+
+// Read whole chunks from the start of the current block straight into dst with one
+// vectored request. Blocks after the current one are assumed to follow on in flash,
+// as the allocator hands them out, and only the run whose headers agree is kept.
+// run is the number of blocks known to be contiguous from the current one, from the
+// file's extents; without a vectored read such a run is read raw into dst in one go
+// and the payloads packed down over the headers.
+// Returns the bytes delivered, 0 at the end of the file.
+static size_t redsfs_read_blocks( redsfs_fh * fh, uint8_t * dst, size_t want, uint32_t run )
+{
+    redsfs_fs * fs = fh->fs;
+    redsfs_iov iov[REDSFS_READV_BLOCKS * 2];
+    uint8_t hdrs[REDSFS_READV_BLOCKS][BLK_OFFSET_CHUNK];
+    redsfs_fb * hdr;
+    uint32_t base = fh->f_cur_blk;
+    uint32_t chunk = base;
+    uint32_t cnt;
+    uint32_t i;
+    size_t got = 0;
+
+    if ( fs->call_readv_f != NULL )
+        cnt = want / BLK_DATA_CHUNK(fs);
+    else
+        cnt = want / BLK_SZ(fs);
+    if ( ( run > 0 ) && ( cnt > run ) )
+        cnt = run;
+    if ( cnt > REDSFS_READV_BLOCKS )
+        cnt = REDSFS_READV_BLOCKS;
+    if ( cnt > ( fs->fs_end - chunk ) / BLK_SZ(fs) )
+        cnt = ( fs->fs_end - chunk ) / BLK_SZ(fs);
+
+    if ( fs->call_readv_f != NULL ) {
+        for ( i = 0; i < cnt; i++ ) {
+            iov[i * 2].addr = chunk + i * BLK_SZ(fs);
+            iov[i * 2].size = BLK_OFFSET_CHUNK;
+            iov[i * 2].buf = hdrs[i];
+            iov[i * 2 + 1].addr = chunk + i * BLK_SZ(fs) + BLK_OFFSET_CHUNK;
+            iov[i * 2 + 1].size = BLK_DATA_CHUNK(fs);
+            iov[i * 2 + 1].buf = dst + i * BLK_DATA_CHUNK(fs);
+        }
+        redsfs_io_readv( fs, iov, cnt * 2 );
+    } else {
+        redsfs_io_read( fs, chunk, cnt * BLK_SZ(fs), dst );
+        // Headers out first, the packed payloads overwrite them
+        for ( i = 0; i < cnt; i++ )
+            memcpy( hdrs[i], dst + i * BLK_SZ(fs), BLK_OFFSET_CHUNK );
+        for ( i = 0; i < cnt; i++ )
+            memmove( dst + i * BLK_DATA_CHUNK(fs), dst + i * BLK_SZ(fs) + BLK_OFFSET_CHUNK,
+                     BLK_DATA_CHUNK(fs) );
+    }
+
+    for ( i = 0; i < cnt; i++ ) {
+        hdr = (redsfs_fb*)hdrs[i];
+        // Stop where the chain leaves the run we guessed, or at a block gone bad
+        if ( ( chunk != base + i * BLK_SZ(fs) ) || ( ( hdr->flags & FB_IS_USED ) == 0 ) ||
+             ( redsfs_blk_check( fh, chunk, hdrs[i], dst + i * BLK_DATA_CHUNK(fs) ) < 0 ) )
+            break;
+
+        // A short block ends the file, a full last block leaves us at its end
+        if ( hdr->data.size < BLK_DATA_CHUNK(fs) ) {
+            fh->blk_curoffset = BLK_OFFSET_CHUNK + hdr->data.size;
+            return got + hdr->data.size;
+        }
+        got += BLK_DATA_CHUNK(fs);
+        if ( hdr->flags & FB_IS_LAST ) {
+            fh->blk_curoffset = BLK_SZ(fs);
+            return got;
+        }
+
+        chunk = fs->fs_start + hdr->next_blk_addr;
+        fh->f_cur_blk = chunk;
+        redsfs_skip_note( fh, ++fh->blk_num, chunk );
+    }
+    return got;
+}
+
+// Bytes as they are stored in the chain, the compressed stream for FB_IS_COMP files
+static size_t redsfs_read_chain( redsfs_fh * fh, char * buf, size_t size )
+{
+    redsfs_fs * fs = fh->fs;
+    size_t toFetch = size;
+    size_t cacheLeft = 0;
+    size_t readSz = 0;
+    size_t readBytes = 0;
+    int rres;
+    uint32_t chunk = 0;
+    uint32_t run;
+
+    if ( fh->handle < 1 )
+        return 0;
+
+    while (toFetch > 0) {
+        // How many blocks from here on are known to sit back to back
+        run = 0;
+#if REDSFS_USE_EXTENTS
+        if ( ( fh->blk_curoffset == BLK_OFFSET_CHUNK ) &&
+             ( redsfs_ext_blk( fh, fh->blk_num, &run ) != fh->f_cur_blk ) )
+            run = 0;
+#endif
+
+        // Whole chunks go straight to the callers buffer, when the fs can read them vectored
+        // or the file's extents say they can be read in one go
+        if ( ( fh->blk_curoffset == BLK_OFFSET_CHUNK ) && !fh->log &&
+             ( ( ( fs->call_readv_f != NULL ) && ( toFetch >= BLK_DATA_CHUNK(fs) ) ) ||
+               ( ( run >= 2 ) && ( toFetch >= 2 * BLK_SZ(fs) ) ) ) ) {
+            readSz = redsfs_read_blocks( fh, (uint8_t*)buf + (size - toFetch), toFetch, run );
+            if ( readSz == 0 )
+                break;
+            toFetch -= readSz;
+            readBytes += readSz;
+            fh->f_pos += readSz;
+            continue;
+        }
+
+        // Request the block/chunk into memory, unless the cache already has it.
+        chunk = fh->f_cur_blk;
+        if ( chunk != fh->cache_blk ) {
+            REDSFS_COUNT( fs, cache_misses, 1 );
+            // Reading on through a chain laid out in order, the next blocks are likely wanted too
+            rres = redsfs_io_read_ahead( fs, chunk, fh->cache,
+                                         ( chunk == fh->ra_blk + BLK_SZ(fs) ) ? REDSFS_READAHEAD : 0 );
+            fh->ra_blk = chunk;
+            fh->cache_blk = chunk;
+            // A log's tail has its size in its markers
+            if ( fh->log && ( ((redsfs_fb*)fh->cache)->next_blk_addr == 0 ) )
+                ((redsfs_fb*)fh->cache)->data.size = redsfs_log_marked( fs, fh->cache,
+                    ( chunk == fh->f_start_blk ) ? fh->first_off : BLK_OFFSET_CHUNK, NULL );
+        } else {
+            REDSFS_COUNT( fs, cache_hits, 1 );
+        }
+
+        // Nothing more from a block that does not match its CRC
+        if ( ( fh->mode == MODE_READ ) && ( fh->crc_blk != fh->cache_blk ) ) {
+            if ( redsfs_blk_check( fh, fh->cache_blk, fh->cache, NULL ) < 0 )
+                break;
+            fh->crc_blk = fh->cache_blk;
+        }
+
+        // Caclculate the amount left in the current block, depends on if it is first
+        if ( ((redsfs_fb*)fh->cache)->flags & FB_IS_FIRST) {
+          cacheLeft = ( ((redsfs_fb*)fh->cache)->data.size + fh->first_off) - fh->blk_curoffset;
+	} else {
+          cacheLeft = ( ((redsfs_fb*)fh->cache)->data.size + BLK_OFFSET_CHUNK) - fh->blk_curoffset;
+        }
+
+	// Might get to the end of the buffer and still have more to request? Break here.
+	if (cacheLeft <= 0) {
+            // Unless it is a log block ending short, with more of the chain after it
+            if ( fh->log && ( ((redsfs_fb*)fh->cache)->next_blk_addr != 0 ) ) {
+                fh->f_cur_blk = fs->fs_start + ((redsfs_fb*)fh->cache)->next_blk_addr;
+                fh->blk_curoffset = BLK_OFFSET_CHUNK;
+                redsfs_skip_note( fh, ++fh->blk_num, fh->f_cur_blk );
+                continue;
+            }
+            break;
+        }
+
+        // If the requested amount is greater or equal to what's left
+        if (toFetch >= cacheLeft) {
+            readSz = cacheLeft;
+	} else { // The requested amount is less than what's left in the cache
+            readSz = toFetch;
+        }
+
+        // Copy to the return buffer, the requested file size, if the current block is used up only fill a bit
+        memcpy( buf + (size - toFetch), fh->cache + fh->blk_curoffset, readSz );
+
+        // Are we into the next block? A full last block (out of space on write) has nowhere to go.
+        if ( ( (fh->blk_curoffset + readSz) >= BLK_SZ(fs) ) &&
+             ( ( ((redsfs_fb*)fh->cache)->flags & FB_IS_LAST ) == 0 ) ) {
+            // If we are at the end of the block, move to the next block
+            fh->f_cur_blk = fs->fs_start + ((redsfs_fb*)fh->cache)->next_blk_addr;
+    	    // Set the next block's offset
+            fh->blk_curoffset = BLK_OFFSET_CHUNK; // Chunk offset, the next block wont be a header
+            redsfs_skip_note( fh, ++fh->blk_num, fh->f_cur_blk );
+        } else {
+    	    // Increase the current offset
+    	    fh->blk_curoffset += readSz;
+        }
+
+        // Update the amount left to fetch
+        toFetch -= readSz;
+	readBytes += readSz;
+	fh->f_pos += readSz;
+    }
+    // Return the amount read from the file
+    return readBytes;
+}
+
+// Compressed files
+#if REDSFS_USE_LZ
+
+// Next byte of the compressed stream, -1 at its end
+static int16_t redsfs_lz_in( redsfs_fh * fh )
+{
+    redsfs_lz * lz = fh->lz;
+
+    if ( lz->in_pos == lz->in_len ) {
+        lz->in_len = redsfs_read_chain( fh, (char*)lz->in, REDSFS_LZ_IN );
+        lz->in_pos = 0;
+        if ( lz->in_len == 0 )
+            return -1;
+    }
+    return lz->in[lz->in_pos++];
+}
+
+// Back to the start of the stream, with its uncompressed size read
+static int8_t redsfs_lz_reset( redsfs_fh * fh )
+{
+    redsfs_lz * lz = fh->lz;
+    uint8_t i;
+    int16_t c;
+
+    memset( lz, 0, sizeof(redsfs_lz) );
+    for ( i = 0; i < 4; i++ ) {
+        c = redsfs_lz_in( fh );
+        if ( c < 0 )
+            return -1;
+        lz->raw_size |= (uint32_t)c << ( i * 8 );
+    }
+    return 0;
+}
+
+// Decompress up to size bytes, buf NULL to skip them
+static size_t redsfs_lz_read( redsfs_fh * fh, uint8_t * buf, size_t size )
+{
+    redsfs_lz * lz = fh->lz;
+    size_t done = 0;
+    int16_t c;
+    int16_t hi;
+    uint16_t v;
+
+    while ( ( done < size ) && ( lz->out_pos < lz->raw_size ) ) {
+        if ( lz->match_left == 0 ) {
+            if ( lz->flag_bits == 0 ) {
+                c = redsfs_lz_in( fh );
+                if ( c < 0 )
+                    break;
+                lz->flags = c;
+                lz->flag_bits = 8;
+            }
+            c = redsfs_lz_in( fh );
+            if ( c < 0 )
+                break;
+            if ( ( lz->flags & 1 ) == 0 ) {
+                hi = redsfs_lz_in( fh );
+                if ( hi < 0 )
+                    break;
+                v = c | ( hi << 8 );
+                lz->match_dist = ( v & ( REDSFS_LZ_WINDOW - 1 ) ) + 1;
+                lz->match_left = ( v >> REDSFS_LZ_WINDOW_BITS ) + REDSFS_LZ_MIN;
+            }
+            lz->flags >>= 1;
+            lz->flag_bits--;
+        }
+        if ( lz->match_left > 0 ) {
+            c = lz->win[( lz->out_pos - lz->match_dist ) & ( REDSFS_LZ_WINDOW - 1 )];
+            lz->match_left--;
+        }
+        lz->win[lz->out_pos & ( REDSFS_LZ_WINDOW - 1 )] = c;
+        lz->out_pos++;
+        if ( buf != NULL )
+            buf[done] = c;
+        done++;
+    }
+    return done;
+}
+
+// Only the stream's start is a known place to decompress from, so going back
+// starts over and going forward decompresses the bytes in between.
+static int32_t redsfs_lz_seek( redsfs_fh * fh, int32_t offset, int whence )
+{
+    redsfs_lz * lz = fh->lz;
+    int64_t pos;
+    size_t skip;
+
+    switch ( whence ) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = (int64_t)lz->out_pos + offset; break;
+        case SEEK_END: pos = (int64_t)lz->raw_size + offset; break;
+        default: return -1;
+    }
+    if ( ( pos < 0 ) || ( pos > lz->raw_size ) )
+        return -1;
+
+    if ( pos < lz->out_pos ) {
+        fh->f_cur_blk = fh->f_start_blk;
+        fh->blk_num = 0;
+        fh->blk_curoffset = fh->first_off;
+        fh->f_pos = 0;
+        if ( redsfs_lz_reset( fh ) < 0 )
+            return -1;
+    }
+    skip = pos - lz->out_pos;
+    if ( redsfs_lz_read( fh, NULL, skip ) != skip )
+        return -1;
+    return pos;
+}
+#endif
+
+// The compressor's tables are heap, it is for building images on the host
+#if REDSFS_USE_LZ && !REDSFS_STATIC
+#define LZ_HASH_BITS 12
+#define LZ_DEPTH 16             // Candidates tried per position
+
+static uint16_t redsfs_lz_hash( const uint8_t * p )
+{
+    return ( ( p[0] << 8 ) ^ ( p[1] << 4 ) ^ p[2] ) * 2654435761u >> ( 32 - LZ_HASH_BITS );
+}
+
+size_t redsfs_lz_compress( const uint8_t * in, size_t len, uint8_t * out, size_t cap )
+{
+    int32_t * head;
+    int32_t * prev;
+    size_t pos = 0;
+    size_t o = 4;
+    size_t flag_at = 0;
+    uint8_t flag_bits = 8;
+    size_t best_len;
+    size_t best_dist;
+    size_t n;
+    int32_t cand;
+    uint8_t depth;
+    uint16_t v;
+
+    if ( ( cap < 4 ) || ( len > UINT32_MAX ) )
+        return 0;
+    head = malloc( ( 1 << LZ_HASH_BITS ) * sizeof(int32_t) );
+    prev = malloc( REDSFS_LZ_WINDOW * sizeof(int32_t) );
+    if ( ( head == NULL ) || ( prev == NULL ) ) {
+        free( head );
+        free( prev );
+        return 0;
+    }
+    memset( head, 0xff, ( 1 << LZ_HASH_BITS ) * sizeof(int32_t) );
+
+    out[0] = len;
+    out[1] = len >> 8;
+    out[2] = len >> 16;
+    out[3] = len >> 24;
+
+    while ( pos < len ) {
+        // A flag byte ahead of every 8 tokens
+        if ( flag_bits == 8 ) {
+            if ( o >= cap )
+                goto full;
+            flag_at = o++;
+            out[flag_at] = 0;
+            flag_bits = 0;
+        }
+
+        // Longest match among the last positions with the same hash
+        best_len = 0;
+        best_dist = 0;
+        if ( pos + REDSFS_LZ_MIN <= len ) {
+            cand = head[redsfs_lz_hash( in + pos )];
+            for ( depth = 0; ( depth < LZ_DEPTH ) && ( cand >= 0 ) && ( pos - cand <= REDSFS_LZ_WINDOW ); depth++ ) {
+                for ( n = 0; ( n < REDSFS_LZ_MAX ) && ( pos + n < len ) && ( in[cand + n] == in[pos + n] ); n++ )
+                    ;
+                if ( n > best_len ) {
+                    best_len = n;
+                    best_dist = pos - cand;
+                }
+                cand = prev[cand & ( REDSFS_LZ_WINDOW - 1 )];
+            }
+        }
+
+        if ( o + ( ( best_len >= REDSFS_LZ_MIN ) ? 2 : 1 ) > cap )
+            goto full;
+        if ( best_len >= REDSFS_LZ_MIN ) {
+            v = ( best_dist - 1 ) | ( ( best_len - REDSFS_LZ_MIN ) << REDSFS_LZ_WINDOW_BITS );
+            out[o++] = v;
+            out[o++] = v >> 8;
+        } else {
+            best_len = 1;
+            out[flag_at] |= 1 << flag_bits;
+            out[o++] = in[pos];
+        }
+        flag_bits++;
+
+        // Every position passed over goes into the chains
+        for ( n = 0; n < best_len; n++, pos++ ) {
+            if ( pos + REDSFS_LZ_MIN > len )
+                continue;
+            v = redsfs_lz_hash( in + pos );
+            prev[pos & ( REDSFS_LZ_WINDOW - 1 )] = head[v];
+            head[v] = pos;
+        }
+    }
+    free( head );
+    free( prev );
+    return o;
+
+full:
+    free( head );
+    free( prev );
+    return 0;
+}
+#endif
+
+static size_t redsfs_do_read( redsfs_fh * fh, char * buf, size_t size )
+{
+    if ( fh->handle < 1 )
+        return 0;
+
+#if REDSFS_USE_LZ
+    if ( fh->lz != NULL )
+        return redsfs_lz_read( fh, (uint8_t*)buf, size );
+#endif
+    return redsfs_read_chain( fh, buf, size );
+}
+
+// Move the read position of a file, returns the new position or -1.
+// Reads are rebuilt from the nearest remembered chain position, so after a first
+// pass over the file a seek only walks the headers between two skip slots.
+static int32_t redsfs_do_seek( redsfs_fh * fh, int32_t offset, int whence )
+{
+    redsfs_fs * fs = fh->fs;
+    int64_t pos;
+    ssize_t fileSize;
+    uint32_t blk_num;
+    uint32_t blk_offset;
+    uint32_t cur;
+    uint32_t chunk;
+#if REDSFS_USE_EXTENTS
+    uint32_t run;
+#endif
+    redsfs_fb hdr;
+
+    // Writers have a block in their cache still to go to flash
+    if ( ( fh->handle < 1 ) || ( fh->mode != MODE_READ ) )
+        return -1;
+
+#if REDSFS_USE_LZ
+    if ( fh->lz != NULL )
+        return redsfs_lz_seek( fh, offset, whence );
+#endif
+
+    fileSize = redsfs_do_cur_file_size( fh );
+    switch ( whence ) {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = (int64_t)fh->f_pos + offset; break;
+        case SEEK_END: pos = (int64_t)fileSize + offset; break;
+        default: return -1;
+    }
+    if ( ( pos < 0 ) || ( pos > fileSize ) )
+        return -1;
+
+    if ( fh->log )
+        return redsfs_log_seek( fh, pos );
+
+    blk_num = redsfs_pos_blk( fh, pos, &blk_offset );
+
+    // Inside the file's extents the block can be worked out directly
+#if REDSFS_USE_EXTENTS
+    chunk = redsfs_ext_blk( fh, blk_num, &run );
+    if ( chunk != REDSFS_NO_BLK ) {
+        cur = blk_num;
+    } else
+#endif
+    if ( fh->skip_cnt > 0 ) {
+        // Start from the closest known block at or before the target
+        cur = blk_num / fh->skip_stride;
+        if ( cur >= fh->skip_cnt )
+            cur = fh->skip_cnt - 1;
+        chunk = fh->skip[cur];
+        cur *= fh->skip_stride;
+    } else {
+        cur = 0;
+        chunk = fh->f_start_blk;
+    }
+#if REDSFS_USE_EXTENTS
+    // Past the extents, their last block may be closer than any skip slot
+    if ( ( fh->ext_alloc > cur + 1 ) && ( fh->ext_alloc <= blk_num ) ) {
+        cur = fh->ext_alloc - 1;
+        chunk = redsfs_ext_blk( fh, cur, &run );
+    }
+#endif
+    if ( ( fh->blk_num <= blk_num ) && ( fh->blk_num > cur ) ) {
+        cur = fh->blk_num;
+        chunk = fh->f_cur_blk;
+    }
+
+    // Walk the headers the rest of the way
+    while ( cur < blk_num ) {
+        redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+        if ( ( hdr.flags & FB_IS_LAST ) || ( hdr.next_blk_addr == 0 ) )
+            return -1;
+        chunk = fs->fs_start + hdr.next_blk_addr;
+        redsfs_skip_note( fh, ++cur, chunk );
+    }
+
+    fh->f_cur_blk = chunk;
+    fh->blk_num = blk_num;
+    fh->blk_curoffset = blk_offset;
+    fh->f_pos = pos;
+
+    return pos;
+}
+
+int32_t redsfs_tell_r( redsfs_fh * fh )
+{
+    if ( fh->handle < 1 )
+        return -1;
+
+    if ( fh->lz != NULL )
+        return fh->lz->out_pos;
+
+    return fh->f_pos;
+}
+
+int8_t redsfs_error_r( redsfs_fh * fh )
+{
+    return fh->err ? -1 : 0;
+}
+
+// Hand a batch of block pieces to flash, vectored if the fs can take it
+static void redsfs_writev( redsfs_fs * fs, redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    if ( cnt == 0 )
+        return;
+
+    if ( fs->call_writev_f ) {
+        redsfs_io_writev( fs, iov, cnt );
+    } else {
+        for ( i = 0; i < cnt; i++ )
+            redsfs_io_write( fs, iov[i].addr, iov[i].size, iov[i].buf );
+    }
+}
+
+static size_t redsfs_do_write( redsfs_fh * fh, char * buf, size_t size )
+{
+    redsfs_fs * fs = fh->fs;
+    size_t toWrite = size;
+    size_t writeSz = 0;
+    size_t cacheLeft = 0;
+    size_t writtenBytes = 0;
+    int32_t nextBlkAddr = 0;
+    int rres;
+    // Whole blocks written straight from buf, a header and a data piece each
+    redsfs_iov iov[REDSFS_WRITEV_BLOCKS * 2];
+    uint8_t hdrs[REDSFS_WRITEV_BLOCKS][BLK_OFFSET_CHUNK];
+    uint32_t blkCnt = 0;
+    redsfs_fb * hdr;
+
+    if ( fh->handle < 1 )
+        return 0;
+
+    if ( fh->mode == MODE_LOG )
+        return redsfs_log_write( fh, buf, size );
+
+#if REDSFS_USE_PACK
+    // Growing past what can be packed, the file needs blocks of its own
+    if ( fh->packed && ( fh->mode != MODE_READ ) && ( fh->f_size + size > REDSFS_PACK_MAX ) ) {
+        nextBlkAddr = redsfs_pack_spill( fh );
+        if ( nextBlkAddr < 0 )
+            return nextBlkAddr;
+    }
+#endif
+
+    // While we have bytes to write.
+    while (toWrite > 0)
+    {
+        // At the start of an empty chunk with at least a block to go, the data can go
+        // to flash from the callers buffer without passing through the cache. The cache
+        // only holds the empty chunk header, which is the same for whichever block is next.
+        if ( ( fs->call_writev_f != NULL ) && ( fh->blk_curoffset == BLK_OFFSET_CHUNK ) &&
+             ( toWrite >= BLK_DATA_CHUNK(fs) ) ) {
+            nextBlkAddr = redsfs_fh_alloc( fh );
+            if (nextBlkAddr < 0)
+                break;
+
+            hdr = (redsfs_fb*)hdrs[blkCnt];
+            hdr->flags = FB_IS_USED | FB_IS_CONT;
+            hdr->next_blk_addr = nextBlkAddr - fs->fs_start;
+            hdr->data.size = BLK_DATA_CHUNK(fs);
+            iov[blkCnt * 2].addr = fh->f_cur_blk;
+            iov[blkCnt * 2].size = BLK_OFFSET_CHUNK;
+            iov[blkCnt * 2].buf = hdrs[blkCnt];
+            iov[blkCnt * 2 + 1].addr = fh->f_cur_blk + BLK_OFFSET_CHUNK;
+            iov[blkCnt * 2 + 1].size = BLK_DATA_CHUNK(fs);
+            iov[blkCnt * 2 + 1].buf = (uint8_t*)buf + (size - toWrite);
+            redsfs_blk_seal( fs, hdrs[blkCnt], iov[blkCnt * 2 + 1].buf );
+            if ( ++blkCnt == REDSFS_WRITEV_BLOCKS ) {
+                redsfs_writev( fs, iov, blkCnt * 2 );
+                blkCnt = 0;
+            }
+
+            if ( fh->f_size >= 0 )
+                fh->f_size += BLK_DATA_CHUNK(fs);
+            fh->f_pos += BLK_DATA_CHUNK(fs);
+            toWrite -= BLK_DATA_CHUNK(fs);
+            writtenBytes += BLK_DATA_CHUNK(fs);
+
+            fh->f_cur_blk = nextBlkAddr;
+            fh->cache_blk = nextBlkAddr;
+            redsfs_skip_note( fh, ++fh->blk_num, fh->f_cur_blk );
+            continue;
+        }
+
+        // Check to see how many bytes are left in this chunk
+	cacheLeft = BLK_SZ(fs) - fh->blk_curoffset;
+
+	// If the amount to write is less than the cache leftover ensure we dont over write
+	if (toWrite >= cacheLeft) {
+	    writeSz = cacheLeft;
+	} else {  // If what we have will fit in the cache then just use that amount.
+	    writeSz = toWrite;
+        }
+
+	//printf(" Perform cache prep %s \r\n", buf);
+        //printf(" Copy to cache offset %d from %d of buf\r\n", fh->blk_curoffset, (size - toWrite));
+	if (writeSz > 0) {
+	    // Copy to the cache from buffer
+	    memcpy( fh->cache + fh->blk_curoffset, buf + (size - toWrite), writeSz );
+	}
+        // Update block size information
+	((redsfs_fb*)fh->cache)->data.size += writeSz;
+	if ( fh->f_size >= 0 )
+	    fh->f_size += writeSz;
+	fh->f_pos += writeSz;
+
+	// Update amount we have left to write in toWrite
+	toWrite -= writeSz;
+	writtenBytes += writeSz;
+
+	//printf(" toWrite now %d, writeSz was %d, chunk size is currently %d \r\n", toWrite, writeSz, ((redsfs_fb*)fh->cache)->data.size);
+        // Have we filled the current block?
+	if ( (fh->blk_curoffset + writeSz) >= BLK_SZ(fs) )  {
+	    // Reserve the next block first, so this one goes to flash once with its next pointer
+	    nextBlkAddr = redsfs_fh_alloc( fh );
+
+	    // If we've not got a new block (no space left) exit, close will commit this one as the last
+	    if (nextBlkAddr < 0) {
+	      fh->blk_curoffset += writeSz;
+              break;
+	    }
+
+	    // Unset the last block flag, point on to the next block and commit it
+            ((redsfs_fb*)fh->cache)->flags &= ~(FB_IS_LAST);
+	    ((redsfs_fb*)fh->cache)->next_blk_addr = nextBlkAddr - fs->fs_start;
+            redsfs_blk_seal( fs, fh->cache, NULL );
+            rres = redsfs_io_write( fs, fh->f_cur_blk, BLK_SZ(fs), fh->cache );
+
+            // Setup new block
+	    fh->f_cur_blk = nextBlkAddr;
+            fh->cache_blk = nextBlkAddr;
+            fh->blk_curoffset = BLK_OFFSET_CHUNK;
+            redsfs_skip_note( fh, ++fh->blk_num, fh->f_cur_blk );
+            // Clear the memory structure for file cache of block.
+            memset ( fh->cache, 0, BLK_SZ(fs) );
+            // Setup the first block flags and used flags
+            ((redsfs_fb*)fh->cache)->flags |= ( FB_IS_USED | FB_IS_CONT );
+            //printf("New chunk setup with size %d \r\n", ((redsfs_fb*)fh->cache)->data.size);
+	}
+        else { // We've finished writing but not the block yet
+	    fh->blk_curoffset += writeSz;
+	}
+    }
+
+    // Whatever whole blocks are left over
+    redsfs_writev( fs, iov, blkCnt * 2 );
+
+    if (nextBlkAddr < 0)
+        return nextBlkAddr;
+    return writtenBytes;
+}
+
+// Take a deleted file's chain for reclaiming: flag each block FB_IS_GONE, the first
+// block last. A power cut part way leaves the first block to be found dead and its
+// chain walked again, and no block of it is erased (and maybe handed out again)
+// before the first one is flagged. Returns the blocks taken.
+static uint32_t redsfs_gc_take( redsfs_fs * fs, uint32_t first )
+{
+    uint32_t chunk;
+    uint32_t blk;
+    uint32_t cnt = 0;
+    uint32_t flags;
+    redsfs_fb hdr;
+
+    redsfs_io_read( fs, first, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+    flags = hdr.flags;
+    chunk = ( ( hdr.flags & FB_IS_LAST ) || ( hdr.next_blk_addr == 0 ) ) ? REDSFS_NO_BLK : fs->fs_start + hdr.next_blk_addr;
+    redsfs_super_dirty( fs );
+
+    // Stopping short where the chain was already taken, or leaves the image or the chain
+    while ( ( chunk >= fs->fs_start ) && ( chunk < fs->fs_end ) && ( chunk != first ) ) {
+        blk = ( chunk - fs->fs_start ) / BLK_SZ(fs);
+        if ( fs->gone_map[blk >> 3] & _BV(blk & 7) )
+            break;
+        redsfs_io_read( fs, chunk, BLK_OFFSET_CHUNK, (uint8_t*)&hdr );
+        if ( ( hdr.flags & ( FB_IS_USED | FB_IS_FIRST | FB_IS_META | FB_IS_PACK ) ) != FB_IS_USED )
+            break;
+        hdr.flags |= FB_IS_GONE;
+        redsfs_io_write( fs, chunk, sizeof(hdr.flags), (uint8_t*)&hdr.flags );
+        fs->gone_map[blk >> 3] |= _BV(blk & 7);
+        cnt++;
+        chunk = ( ( hdr.flags & FB_IS_LAST ) || ( hdr.next_blk_addr == 0 ) ) ? REDSFS_NO_BLK : fs->fs_start + hdr.next_blk_addr;
+    }
+
+    blk = ( first - fs->fs_start ) / BLK_SZ(fs);
+    flags |= FB_IS_GONE;
+    redsfs_io_write( fs, first, sizeof(flags), (uint8_t*)&flags );
+    fs->gone_map[blk >> 3] |= _BV(blk & 7);
+    return cnt + 1;
+}
+
+// Give taken blocks back to the free map, up to about budget of them. With call_erase_f
+// that is every sector holding nothing else in use, erased whole (a sector that still has
+// a live block keeps its taken ones until that goes too). Without one the flash is taken
+// to be rewritable and each block is written over from the zeroed buffer given.
+// Returns the blocks given back.
+static uint32_t redsfs_gc_erase( redsfs_fs * fs, uint32_t budget, const uint8_t * zero )
+{
+    uint32_t sector = ( fs->call_erase_f && fs->fs_erase_size ) ? fs->fs_erase_size : BLK_SZ(fs);
+    uint32_t per = sector / BLK_SZ(fs);
+    uint32_t addr;
+    uint32_t blk;
+    uint32_t cnt;
+    uint32_t i;
+    uint32_t done = 0;
+
+    // Sectors go by flash address, one running off either end of the fs can not be erased
+    blk = ( sector - fs->fs_start % sector ) % sector / BLK_SZ(fs);
+    for ( ; ( blk + per <= fs->blk_count ) && ( done < budget ); blk += per ) {
+        cnt = 0;
+        for ( i = blk; i < blk + per; i++ ) {
+            if ( fs->gone_map[i >> 3] & _BV(i & 7) )
+                cnt++;
+            else if ( fs->free_map[i >> 3] & _BV(i & 7) )
+                break;
+        }
+        if ( ( i < blk + per ) || ( cnt == 0 ) )
+            continue;
+
+        addr = fs->fs_start + blk * BLK_SZ(fs);
+        if ( fs->call_erase_f != NULL )
+            redsfs_io_erase( fs, addr, sector );
+        else
+            redsfs_io_write( fs, addr, BLK_SZ(fs), (uint8_t*)zero );
+        for ( i = blk; i < blk + per; i++ ) {
+            if ( fs->gone_map[i >> 3] & _BV(i & 7) ) {
+                fs->gone_map[i >> 3] &= ~_BV(i & 7);
+                redsfs_map_mark( fs, fs->fs_start + i * BLK_SZ(fs), 0 );
+            }
+        }
+        done += cnt;
+    }
+    return done;
+}
+
+// Reclaim up to about budget blocks of deleted files. Chains are taken as a whole,
+// then blocks go back a whole erase sector at a time, so a block is only ever handed
+// out again erased.
+// Returns the blocks reclaimed, 0 once there is nothing left it can do.
+static int32_t redsfs_do_gc( redsfs_fs * fs, uint32_t budget )
+{
+#if REDSFS_STATIC
+    static const uint8_t zero[REDSFS_BLOCK_SIZE];
+#else
+    uint8_t * zero = NULL;
+#endif
+    uint32_t taken;
+    uint32_t cnt;
+    int32_t done = 0;
+
+    if ( fs->mounted != 1 )
+        return 0;
+
+#if !REDSFS_STATIC
+    if ( fs->call_erase_f == NULL ) {
+        zero = calloc( 1, BLK_SZ(fs) );
+        if ( zero == NULL )
+            return -1;
+    }
+#endif
+
+    while ( (uint32_t)done < budget ) {
+        REDSFS_LOCK(fs);
+        for ( taken = 0; ( taken < budget - done ) && ( fs->dead_cnt > 0 ); )
+            taken += redsfs_gc_take( fs, fs->dead[--fs->dead_cnt] );
+        cnt = redsfs_gc_erase( fs, budget - done, zero );
+        REDSFS_UNLOCK(fs);
+
+        done += cnt;
+        if ( ( cnt == 0 ) && ( fs->dead_cnt == 0 ) )
+            break;
+    }
+
+    REDSFS_FREE( zero );
+    return done;
+}
+
+// Commit a log without closing it, the records written so far survive a power cut.
+static int8_t redsfs_do_flush( redsfs_fh * fh )
+{
+    if ( ( fh->handle < 1 ) || ( fh->mode != MODE_LOG ) )
+        return -1;
+
+    redsfs_log_commit( fh );
+    return 0;
+}
+
+// Checkpoint the directory table and free map for the next mount, into a fresh
+// contiguous run written before the superblock that points at it.
+// Returns 0 when the superblock is clean, -1 if the image is left to be scanned.
+static int8_t redsfs_do_sync( redsfs_fs * fs )
+{
+#if REDSFS_USE_SUPER
+    uint32_t map_bytes = ( fs->blk_count + 7 ) / 8;
+    uint32_t len;
+    uint32_t need;
+    uint32_t start;
+    uint32_t got;
+    uint32_t done = 0;
+    uint32_t blk;
+    uint32_t i;
+    uint8_t * payload;
+    uint8_t * tbl;
+    redsfs_fb * hdr;
+
+    if ( ( fs->mounted != 1 ) || ( fs->sb.magic != REDSFS_SB_MAGIC ) )
+        return -1;
+
+    REDSFS_LOCK(fs);
+    if ( fs->sb.clean ) {
+        REDSFS_UNLOCK(fs);
+        return 0;
+    }
+
+    if ( !redsfs_super_room( fs ) ) {
+        REDSFS_UNLOCK(fs);
+        return -1;
+    }
+
+    // The old checkpoint went stale with the first change, its blocks go to redsfs_gc
+    for ( i = 0; i < fs->sb.table_blocks; i++ ) {
+        blk = fs->sb.table_addr / BLK_SZ(fs) + i;
+        fs->gone_map[blk >> 3] |= _BV(blk & 7);
+    }
+    fs->sb.table_blocks = 0;
+
+    len = fs->dir_cnt * sizeof(redsfs_dirent) + fs->dead_cnt * sizeof(uint32_t) + map_bytes * 2;
+    need = ( len + BLK_DATA_CHUNK(fs) - 1 ) / BLK_DATA_CHUNK(fs);
+    start = redsfs_find_run( fs, need, &got );
+    payload = REDSFS_MALLOC( len );
+    tbl = REDSFS_CALLOC( need, BLK_SZ(fs) );
+    if ( ( got < need ) || ( payload == NULL ) || ( tbl == NULL ) ) {
+        REDSFS_UNLOCK(fs);
+        REDSFS_FREE( payload );
+        REDSFS_FREE( tbl );
+        return -1;
+    }
+    for ( i = 0; i < need; i++ )
+        redsfs_map_mark( fs, fs->fs_start + ( start + i ) * BLK_SZ(fs), 1 );
+
+    // The map goes in with the checkpoint's own blocks marked used
+    memcpy( payload, fs->dir, fs->dir_cnt * sizeof(redsfs_dirent) );
+    done = fs->dir_cnt * sizeof(redsfs_dirent);
+    for ( i = 0; i < fs->dead_cnt; i++ )
+        ((uint32_t*)( payload + done ))[i] = fs->dead[i] - fs->fs_start;
+    done += fs->dead_cnt * sizeof(uint32_t);
+    memcpy( payload + done, fs->free_map, map_bytes );
+    memcpy( payload + done + map_bytes, fs->gone_map, map_bytes );
+    done = 0;
+    for ( i = 0; i < need; i++ ) {
+        hdr = (redsfs_fb*)( tbl + i * BLK_SZ(fs) );
+        hdr->flags = FB_IS_USED | FB_IS_META;
+        hdr->next_blk_addr = ( i + 1 < need ) ? ( start + i + 1 ) * BLK_SZ(fs) : 0;
+        hdr->data.size = ( len - done < BLK_DATA_CHUNK(fs) ) ? len - done : BLK_DATA_CHUNK(fs);
+        memcpy( tbl + i * BLK_SZ(fs) + BLK_OFFSET_CHUNK, payload + done, hdr->data.size );
+        done += hdr->data.size;
+    }
+    redsfs_io_write( fs, fs->fs_start + start * BLK_SZ(fs), need * BLK_SZ(fs), tbl );
+
+    fs->sb.gen++;
+    fs->sb.clean = 1;
+    fs->sb.table_addr = start * BLK_SZ(fs);
+    fs->sb.table_blocks = need;
+    fs->sb.dir_cnt = fs->dir_cnt;
+    fs->sb.dead_cnt = fs->dead_cnt;
+    fs->sb.crc = redsfs_crc32c( 0, payload, len );
+    redsfs_super_write( fs );
+    REDSFS_UNLOCK(fs);
+
+    REDSFS_FREE( payload );
+    REDSFS_FREE( tbl );
+    return 0;
+#else
+    (void)fs;
+    return -1;
+#endif
+}
+
+// Public calls, counted in the per op stats and passed to the trace hook
+
+#if REDSFS_USE_STATS
+// Flash traffic so far, to take the cost of a call from
+static void redsfs_op_mark( redsfs_fs * fs, redsfs_cost * c )
+{
+    c->calls = 0;
+    c->reads = fs->stats.reads;
+    c->read_bytes = fs->stats.read_bytes;
+    c->writes = fs->stats.writes;
+    c->write_bytes = fs->stats.write_bytes;
+    c->erases = fs->stats.erases;
+    c->blocks = fs->stats.read_blocks + fs->stats.write_blocks;
+}
+#endif
+
+static void redsfs_op_begin( redsfs_fs * fs, uint8_t op, redsfs_trace_ev * ev )
+{
+#if REDSFS_USE_STATS
+    ev->op = op;
+#if REDSFS_USE_TRACE
+    if ( fs->call_trace_f ) {
+        ev->exit = 0;
+        ev->ret = 0;
+        memset( &ev->cost, 0, sizeof(ev->cost) );
+        fs->call_trace_f( fs, ev );
+    }
+#endif
+    redsfs_op_mark( fs, &ev->cost );
+#else
+    (void)fs;
+    (void)op;
+    (void)ev;
+#endif
+}
+
+static void redsfs_op_end( redsfs_fs * fs, redsfs_trace_ev * ev, int32_t ret )
+{
+#if REDSFS_USE_STATS
+    redsfs_cost now;
+    redsfs_cost * tot = &fs->stats.op[ev->op];
+
+    redsfs_op_mark( fs, &now );
+    ev->cost.calls = 1;
+    ev->cost.reads = now.reads - ev->cost.reads;
+    ev->cost.read_bytes = now.read_bytes - ev->cost.read_bytes;
+    ev->cost.writes = now.writes - ev->cost.writes;
+    ev->cost.write_bytes = now.write_bytes - ev->cost.write_bytes;
+    ev->cost.erases = now.erases - ev->cost.erases;
+    ev->cost.blocks = now.blocks - ev->cost.blocks;
+
+    tot->calls++;
+    tot->reads += ev->cost.reads;
+    tot->read_bytes += ev->cost.read_bytes;
+    tot->writes += ev->cost.writes;
+    tot->write_bytes += ev->cost.write_bytes;
+    tot->erases += ev->cost.erases;
+    tot->blocks += ev->cost.blocks;
+
+#if REDSFS_USE_TRACE
+    if ( fs->call_trace_f ) {
+        ev->exit = 1;
+        ev->ret = ret;
+        fs->call_trace_f( fs, ev );
+    }
+#else
+    (void)ret;
+#endif
+#else
+    (void)fs;
+    (void)ev;
+    (void)ret;
+#endif
+}
+
+int8_t redsfs_mount_r( redsfs_fs * fs )
+{
+    redsfs_trace_ev ev;
+    int8_t ret;
+
+#if REDSFS_USE_STATS
+    memset( &fs->stats, 0, sizeof(fs->stats) );
+#endif
+    redsfs_op_begin( fs, REDSFS_OP_MOUNT, &ev );
+    ret = redsfs_do_mount( fs );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+uint8_t redsfs_unmount_r( redsfs_fs * fs )
+{
+    redsfs_trace_ev ev;
+    uint8_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_UNMOUNT, &ev );
+    ret = redsfs_do_unmount( fs );
+    redsfs_op_end( fs, &ev, (int8_t)ret );
+    return ret;
+}
+
+char * redsfs_next_file_r( redsfs_fs * fs )
+{
+    redsfs_trace_ev ev;
+    char * ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_NEXT_FILE, &ev );
+    ret = redsfs_do_next_file( fs, NULL );
+    redsfs_op_end( fs, &ev, ret != NULL );
+    return ret;
+}
+
+int8_t redsfs_next_file_ex_r( redsfs_fs * fs, redsfs_stat * st )
+{
+    redsfs_trace_ev ev;
+    int8_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_NEXT_FILE, &ev );
+    ret = ( redsfs_do_next_file( fs, st ) != NULL );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+int8_t redsfs_open_r( redsfs_fs * fs, redsfs_fh * fh, char * fname, uint8_t mode )
+{
+    return redsfs_open_ex_r( fs, fh, fname, mode, REDSFS_NO_HINT );
+}
+
+int8_t redsfs_open_ex_r( redsfs_fs * fs, redsfs_fh * fh, char * fname, uint8_t mode, uint32_t size_hint )
+{
+    redsfs_trace_ev ev;
+    int8_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_OPEN, &ev );
+    ret = redsfs_do_open_ex( fs, fh, fname, mode, size_hint );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+// Calls on a handle that is not open have no mount to count against
+void redsfs_close_r( redsfs_fh * fh )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+
+    if ( fh->handle < 1 ) {
+        redsfs_do_close( fh );
+        return;
+    }
+    redsfs_op_begin( fs, REDSFS_OP_CLOSE, &ev );
+    redsfs_do_close( fh );
+    redsfs_op_end( fs, &ev, 0 );
+}
+
+ssize_t redsfs_cur_file_size_r( redsfs_fh * fh )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+    ssize_t ret;
+
+    if ( fh->handle < 1 )
+        return redsfs_do_cur_file_size( fh );
+    redsfs_op_begin( fs, REDSFS_OP_SIZE, &ev );
+    ret = redsfs_do_cur_file_size( fh );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+void redsfs_seek_to_end_r( redsfs_fh * fh )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+
+    if ( fh->handle < 1 ) {
+        redsfs_do_seek_to_end( fh );
+        return;
+    }
+    redsfs_op_begin( fs, REDSFS_OP_SEEK, &ev );
+    redsfs_do_seek_to_end( fh );
+    redsfs_op_end( fs, &ev, 0 );
+}
+
+uint8_t redsfs_delete_r( redsfs_fs * fs, char * name )
+{
+    redsfs_trace_ev ev;
+    uint8_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_DELETE, &ev );
+    ret = redsfs_do_delete( fs, name );
+    redsfs_op_end( fs, &ev, (int8_t)ret );
+    return ret;
+}
+
+size_t redsfs_write_r( redsfs_fh * fh, char * buf, size_t size )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+    size_t ret;
+
+    if ( fh->handle < 1 )
+        return redsfs_do_write( fh, buf, size );
+    redsfs_op_begin( fs, REDSFS_OP_WRITE, &ev );
+    ret = redsfs_do_write( fh, buf, size );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+size_t redsfs_read_r( redsfs_fh * fh, char * buf, size_t size )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+    size_t ret;
+
+    if ( fh->handle < 1 )
+        return redsfs_do_read( fh, buf, size );
+    redsfs_op_begin( fs, REDSFS_OP_READ, &ev );
+    ret = redsfs_do_read( fh, buf, size );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+int32_t redsfs_seek_r( redsfs_fh * fh, int32_t offset, int whence )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+    int32_t ret;
+
+    if ( fh->handle < 1 )
+        return redsfs_do_seek( fh, offset, whence );
+    redsfs_op_begin( fs, REDSFS_OP_SEEK, &ev );
+    ret = redsfs_do_seek( fh, offset, whence );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+int8_t redsfs_sync_r( redsfs_fs * fs )
+{
+    redsfs_trace_ev ev;
+    int8_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_SYNC, &ev );
+    ret = redsfs_do_sync( fs );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+int8_t redsfs_flush_r( redsfs_fh * fh )
+{
+    redsfs_trace_ev ev;
+    redsfs_fs * fs = fh->fs;
+    int8_t ret;
+
+    if ( fh->handle < 1 )
+        return redsfs_do_flush( fh );
+    redsfs_op_begin( fs, REDSFS_OP_FLUSH, &ev );
+    ret = redsfs_do_flush( fh );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+int32_t redsfs_gc_r( redsfs_fs * fs, uint32_t budget )
+{
+    redsfs_trace_ev ev;
+    int32_t ret;
+
+    redsfs_op_begin( fs, REDSFS_OP_GC, &ev );
+    ret = redsfs_do_gc( fs, budget );
+    redsfs_op_end( fs, &ev, ret );
+    return ret;
+}
+
+redsfs_stats * redsfs_get_stats_r( redsfs_fs * fs )
+{
+#if REDSFS_USE_STATS
+    return &fs->stats;
+#else
+    (void)fs;
+    return NULL;
+#endif
+}
+
+// Single mount, single file global API, kept as thin wrappers over the _r calls.
+int8_t redsfs_mount(redsfs_fs *rfs)
+{
+    // Take a copy of the callers geometry and calling functions
+    r_fsys = *rfs;
+    r_fhand.handle = 0;
+
+    return redsfs_mount_r( &r_fsys );
+}
+
+uint8_t redsfs_unmount()
+{
+    if (r_fsys.mounted != 1)
+        return -1;
+
+    // If file open close it
+    if (r_fhand.handle != 0) {
+      redsfs_close();
+    }
+
+    return redsfs_unmount_r( &r_fsys );
+}
+
+char * redsfs_next_file()
+{
+    return redsfs_next_file_r( &r_fsys );
+}
+
+int8_t redsfs_next_file_ex( redsfs_stat * st )
+{
+    return redsfs_next_file_ex_r( &r_fsys, st );
+}
+
+int32_t redsfs_next_empty_block()
+{
+    return redsfs_next_empty_block_r( &r_fsys );
+}
+
+int8_t redsfs_open(char * fname, uint8_t mode)
+{
+    // Only the one global file, let go of whatever was open before
+    if (r_fhand.handle != 0) {
+      redsfs_close();
+    }
+
+    return redsfs_open_r( &r_fsys, &r_fhand, fname, mode );
+}
+
+int8_t redsfs_open_ex(char * fname, uint8_t mode, uint32_t size_hint)
+{
+    if (r_fhand.handle != 0) {
+      redsfs_close();
+    }
+
+    return redsfs_open_ex_r( &r_fsys, &r_fhand, fname, mode, size_hint );
+}
+
+void redsfs_close()
+{
+    redsfs_close_r( &r_fhand );
+}
+
+ssize_t redsfs_cur_file_size()
+{
+    return redsfs_cur_file_size_r( &r_fhand );
+}
+
+void redsfs_seek_to_end()
+{
+    redsfs_seek_to_end_r( &r_fhand );
+}
+
+uint8_t redsfs_delete( char * name )
+{
+    return redsfs_delete_r( &r_fsys, name );
+}
+
+size_t redsfs_read( char * buf, size_t size )
+{
+    return redsfs_read_r( &r_fhand, buf, size );
+}
+
+size_t redsfs_write( char * buf, size_t size )
+{
+    return redsfs_write_r( &r_fhand, buf, size );
+}
+
+int32_t redsfs_seek( int32_t offset, int whence )
+{
+    return redsfs_seek_r( &r_fhand, offset, whence );
+}
+
+int32_t redsfs_tell()
+{
+    return redsfs_tell_r( &r_fhand );
+}
+
+int8_t redsfs_error()
+{
+    return redsfs_error_r( &r_fhand );
+}
+
+int8_t redsfs_sync()
+{
+    return redsfs_sync_r( &r_fsys );
+}
+
+int8_t redsfs_flush()
+{
+    return redsfs_flush_r( &r_fhand );
+}
+
+int32_t redsfs_gc( uint32_t budget )
+{
+    return redsfs_gc_r( &r_fsys, budget );
+}
+
+redsfs_stats * redsfs_get_stats()
+{
+    return redsfs_get_stats_r( &r_fsys );
+}
@@ -3,29 +3,258 @@
  * Author: Farran Rebbeck
  */
 
+#ifndef REDSFS_H
+#define REDSFS_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 
+#include "redsfsconf.h"
+
 #define _BV(b) (1 << (b))
 
 typedef uint32_t (*flash_read)(uint32_t addr, uint32_t size, uint8_t *dst);
 typedef uint32_t (*flash_write)(uint32_t addr, uint32_t size, uint8_t *src);
 
+// One piece of a vectored flash transfer
+typedef struct redsfs__iovec {
+    uint32_t	addr;
+    uint32_t	size;
+    uint8_t *	buf;
+} redsfs_iov;
+typedef uint32_t (*flash_writev)(redsfs_iov *iov, uint32_t cnt);
+typedef uint32_t (*flash_readv)(redsfs_iov *iov, uint32_t cnt);
+typedef uint32_t (*flash_erase)(uint32_t addr, uint32_t size);
+// cnt reads of size bytes, each stride on from the one before, packed back to back into dst
+typedef uint32_t (*flash_readstride)(uint32_t addr, uint32_t size, uint32_t stride, uint32_t cnt, uint8_t *dst);
+
+// Most blocks a sequential reader has the mount's block cache fetch after the one it
+// missed on, in the same request (capped at half the cache)
+#define REDSFS_READAHEAD 4
+
+// Blocks an allocation that finds no free block asks redsfs_gc for
+#define REDSFS_GC_BATCH 16
+
+// No block, for block addresses not yet known
+#define REDSFS_NO_BLK 0xffffffff
+
+// No size hint, for redsfs_open_ex on a file whose size is not known up front
+#define REDSFS_NO_HINT 0xffffffff
+
+struct redsfs__filesystem;
+struct redsfs__mem;
+typedef void (*mount_lock)(struct redsfs__filesystem *fs, uint8_t take);
+
+// Public calls, for the per op stats and the trace hook
+#define REDSFS_OP_MOUNT     0
+#define REDSFS_OP_UNMOUNT   1
+#define REDSFS_OP_OPEN      2
+#define REDSFS_OP_CLOSE     3
+#define REDSFS_OP_READ      4
+#define REDSFS_OP_WRITE     5
+#define REDSFS_OP_SEEK      6   // redsfs_seek and redsfs_seek_to_end
+#define REDSFS_OP_SIZE      7   // redsfs_cur_file_size
+#define REDSFS_OP_DELETE    8
+#define REDSFS_OP_NEXT_FILE 9
+#define REDSFS_OP_SYNC      10
+#define REDSFS_OP_FLUSH     11
+#define REDSFS_OP_GC        12
+#define REDSFS_OPS          13
+
+// Flash traffic of one public call, or of every call of one kind so far
+typedef struct redsfs__cost {
+    uint32_t	calls;          // Public calls (per op stats only)
+    uint32_t	reads;          // call_read_f/call_readv_f calls
+    uint32_t	read_bytes;
+    uint32_t	writes;         // call_write_f/call_writev_f calls
+    uint32_t	write_bytes;
+    uint32_t	erases;         // call_erase_f calls
+    uint32_t	blocks;         // Blocks the transfers touched
+} redsfs_cost;
+
+// Counters kept by a mount since redsfs_mount, they wrap rather than saturate.
+// Handles on one mount used from several threads can lose counts.
+typedef struct redsfs__stats {
+    uint32_t	reads;          // call_read_f/call_readv_f calls
+    uint32_t	read_bytes;
+    uint32_t	read_blocks;    // Blocks those reads touched
+    uint32_t	writes;         // call_write_f/call_writev_f calls
+    uint32_t	write_bytes;
+    uint32_t	write_blocks;
+    uint32_t	erases;         // call_erase_f calls
+    uint32_t	erase_bytes;
+    uint32_t	allocs;         // Free map searches, single blocks and runs
+    uint32_t	alloc_scan;     // Free map bits those searches stepped over
+    uint32_t	cache_hits;     // Block wanted was already in the file's cache
+    uint32_t	cache_misses;
+    uint32_t	index_probes;   // First blocks read checking index hits
+    uint32_t	rcache_hits;    // Reads served by the mount's block cache
+    uint32_t	rcache_misses;  // Whole blocks it had to fetch
+    uint32_t	readahead;      // Blocks fetched ahead of a sequential reader
+    uint32_t	crc_errors;     // Block reads not matching the CRC (REDSFS_BLOCK_CRC)
+    redsfs_cost	op[REDSFS_OPS]; // Per REDSFS_OP_*
+} redsfs_stats;
+
+// Trace hook, called on entry (exit 0, cost zero) and exit (exit 1, ret and the
+// flash traffic of the call) of each public call
+typedef struct redsfs__trace_ev {
+    uint8_t	op;             // REDSFS_OP_*
+    uint8_t	exit;
+    int32_t	ret;            // Return value, 0 for calls returning nothing
+    redsfs_cost	cost;
+} redsfs_trace_ev;
+typedef void (*redsfs_trace)(struct redsfs__filesystem *fs, redsfs_trace_ev *ev);
+
+// Mount options
+#define REDSFS_OPT_INDEX _BV(0)   // Keep an in-RAM filename index for open/delete
+#define REDSFS_OPT_SUPER _BV(1)   // Superblock at the fs start with a checkpointed directory and free map,
+                                  // set by mount when the image already has one
+
+// Superblock, in slots after the chunk header of the first blocks: the erase sector
+// the fs starts on with call_erase_f, else block 0. Each update goes into the next
+// slot and the last good one counts; the blocks are erased when the slots run out.
+// It points at a checkpoint of the directory table followed by the dead list, the
+// free map and the FB_IS_GONE map, in a run of FB_IS_META blocks.
+#define REDSFS_SB_MAGIC 0x53464452   // "RDFS"
+typedef struct redsfs__superblock {
+    uint32_t	magic;
+    uint32_t	gen;            // Bumped on every checkpoint
+    uint32_t	clean;          // Checkpoint matches the blocks, cleared before the first change
+    uint32_t	block_size;
+    uint32_t	blk_count;
+    uint32_t	table_addr;     // Offset of the first checkpoint block
+    uint32_t	table_blocks;   // Contiguous blocks holding the checkpoint
+    uint32_t	dir_cnt;        // Directory entries in the checkpoint
+    uint32_t	dead_cnt;       // Deleted chains awaiting redsfs_gc, after the directory
+    uint32_t	crc;            // CRC32C of the checkpoint payload
+    uint32_t	sb_crc;         // CRC32C of the fields above
+} redsfs_sb;
+
+// Directory table entry, in RAM and in the checkpoint
+typedef struct redsfs__dirent redsfs_dirent;
+
+// Mount block cache slot
+typedef struct redsfs__cache_slot {
+    uint32_t	blk;            // Offset of the cached block, REDSFS_NO_BLK if empty
+    uint32_t	used;           // Tick of its last use, the oldest goes first
+} redsfs_rc_slot;
+
+// Filename index slot, open addressed on the name hash
+typedef struct redsfs__index_entry {
+    uint32_t	hash;           // Hash of the file name
+    uint32_t	blk;            // Block number of the first block + 1, 0 is an empty slot
+} redsfs_idx_ent;
+
 typedef struct redsfs__filesystem {
     uint32_t	fs_start;
     uint32_t	fs_block_size;
     flash_read  call_read_f;
     flash_write call_write_f;
+    flash_writev call_writev_f; // Optional, multi-block writes in one transaction
+    flash_readv call_readv_f;   // Optional, multi-block reads in one transaction
+    flash_readstride call_readstride_f; // Optional, strided reads in one transaction (mount scan)
+    mount_lock  call_lock_f;    // Optional, serialises mount state between threads. With the block
+                                // cache on it is taken again by its holder, so has to allow that.
+    flash_erase call_erase_f;   // Optional, erases (zeroes) whole fs_erase_size sectors
+    uint32_t	fs_erase_size;  // Erase sector, a multiple of the block size (0 = one block)
+#if REDSFS_USE_TRACE
+    redsfs_trace call_trace_f;  // Optional, called on entry and exit of each public call
+#endif
     uint32_t	fs_end;
+    uint32_t	fs_opts;        // REDSFS_OPT_* flags
+    uint32_t	fs_cache_blocks; // Blocks in the mount's read cache, 0 for none
+#if REDSFS_STATIC
+    struct redsfs__mem * fs_mem; // Memory the mount runs in, the caller's
+#endif
     int8_t	mounted;
+
+    // Mount state, set up by redsfs_mount_r
+    uint32_t	seek_chunk;     // For seeking through filesystem (ls)
+    uint8_t *	seek_cache;     // Block buffer for seeking/listing
+#if REDSFS_USE_PACK
+    char	seek_name[BLK_NAME_SIZE + 1]; // Packed file name returned by listing
+#endif
+    uint8_t *	free_map;       // One bit per block, set = used
+    uint8_t *	head_map;       // One bit per block, set = first block of a file or a pack block
+    uint32_t	blk_count;
+    uint32_t	free_hint;      // No free block exists below this block index
+    redsfs_idx_ent * index;     // Filename to first block index (REDSFS_OPT_INDEX)
+    uint32_t	index_cap;      // Slots, always a power of two
+    uint32_t	index_cnt;      // Slots in use
+    redsfs_dirent * dir;        // Files in listing order (REDSFS_OPT_SUPER)
+    uint32_t	dir_cap;
+    uint32_t	dir_cnt;
+    uint32_t	dir_pos;        // Next entry redsfs_next_file_r returns
+    redsfs_sb	sb;             // Superblock as last written, magic 0 if the image can not have one
+    uint32_t	sb_slot;        // Slot it was written to
+    uint32_t	sb_blocks;      // Blocks holding its slots, 0 if none
+    uint8_t *	gone_map;       // One bit per block, set = FB_IS_GONE, used until its sector is erased
+    uint32_t *	dead;           // First blocks of deleted files not yet reclaimed
+    uint32_t	dead_cap;
+    uint32_t	dead_cnt;
+#if REDSFS_USE_PACK
+    uint32_t	pack_blk;       // Pack block new small files go into, REDSFS_NO_BLK if none
+    uint32_t	pack_off;       // Where its next entry goes
+#endif
+    uint8_t *	rcache;         // fs_cache_blocks blocks, NULL without the cache
+    redsfs_rc_slot * rcache_slot;
+    uint32_t	rcache_tick;
+#if REDSFS_USE_STATS
+    redsfs_stats	stats;
+#endif
 } redsfs_fs;
 
 #define MODE_READ   0
 #define MODE_WRITE  1
 #define MODE_APPEND 2
+#define MODE_LOG    3   // Append only log file, created with FB_IS_LOG
+#define MODE_WRITE_COMP 4   // New file of redsfs_lz_compress output, created with FB_IS_COMP
+
+// Compressed files: a 4 byte uncompressed size, then LZSS tokens. Each flag byte
+// covers the next 8 tokens from its lowest bit, 1 for a literal byte and 0 for a
+// 2 byte match, distance - 1 in the low REDSFS_LZ_WINDOW_BITS and length - 3 above.
+#define REDSFS_LZ_WINDOW_BITS 10
+#define REDSFS_LZ_WINDOW  ( 1 << REDSFS_LZ_WINDOW_BITS )
+#define REDSFS_LZ_MIN     3
+#define REDSFS_LZ_MAX     ( REDSFS_LZ_MIN + ( 1 << ( 16 - REDSFS_LZ_WINDOW_BITS ) ) - 1 )
+#define REDSFS_LZ_IN      64   // Compressed bytes taken from the chain at a time
+
+// Decompressor state of a compressed file open for reading
+typedef struct redsfs__lz {
+    uint8_t	win[REDSFS_LZ_WINDOW];  // Last bytes produced
+    uint32_t	out_pos;        // Uncompressed bytes produced
+    uint32_t	raw_size;       // Uncompressed file size
+    uint8_t	flags;          // Flag byte of the current tokens
+    uint8_t	flag_bits;      // Tokens left under it
+    uint8_t	match_left;     // Bytes of the current match still to copy
+    uint16_t	match_dist;
+    uint8_t	in[REDSFS_LZ_IN];
+    uint8_t	in_pos;
+    uint8_t	in_len;
+} redsfs_lz;
+
+// Contiguous run of blocks in a file's chain
+#define REDSFS_EXTENTS 4
+typedef struct redsfs__extent {
+    uint32_t	start_addr;     // Offset of the first block of the run
+    uint32_t	blocks;         // Blocks in the run
+} redsfs_ext;
+
+// Chain positions remembered per open file for seeking, one every SKIP_STRIDE
+// blocks until SKIP_MAX slots are used, then the stride doubles.
+#define REDSFS_SKIP_STRIDE 8
+#define REDSFS_SKIP_MAX    256
+
+// A file as redsfs_next_file_ex lists it, all from the one pass over the image
+typedef struct redsfs__stat {
+    char	name[BLK_NAME_SIZE + 1];
+    uint32_t	first_blk;      // Offset of the first block, or of the pack entry of a packed file
+    int32_t	size;           // Bytes a reader gets (uncompressed), -1 if the file was never closed
+    uint32_t	flags;          // FB_* of the first block, FB_IS_USED | FB_IS_PACK for a packed file
+} redsfs_stat;
 
 typedef struct redsfs__filehandle {
     int8_t 	handle;         // Handle = 1 for basic operation 0 is "not open"
@@ -33,28 +262,110 @@ typedef struct redsfs__filehandle {
     uint32_t    f_cur_blk;      // Chunk offset for current part of file
     uint32_t	blk_curoffset;  // Block offset in the current chunk
     uint8_t     mode;
+    int32_t	f_size;         // Total file size, -1 until known
+    uint32_t	f_pos;          // Byte position in the file
+    uint32_t	blk_num;        // Chain position of the current block, first block is 0
+    uint32_t *	skip;           // Address of every skip_stride'th block in the chain
+    uint16_t	skip_cnt;       // Skip slots filled
+    uint16_t	skip_cap;       // Skip slots allocated
+    uint32_t	skip_stride;    // Blocks between skip slots
+    uint32_t	first_off;      // Offset of the data in the first block
+#if REDSFS_USE_EXTENTS
+    redsfs_ext	ext[REDSFS_EXTENTS]; // Runs the chain starts with (FB_HAS_EXTENTS)
+    uint8_t	ext_cnt;        // Runs in ext
+    uint32_t	ext_alloc;      // Blocks of the runs handed out to the chain so far (writers)
+#endif
+    redsfs_fs *	fs;             // Mount the file was opened on
+    uint8_t *	cache;          // File in/out cache of the current block
+    uint32_t	cache_blk;      // Block held in cache, REDSFS_NO_BLK if none
+    uint32_t	prog_off;       // MODE_LOG, bytes of the current block already on flash
+    uint16_t	log_marks;      // MODE_LOG, commit marker slots the current block has taken
+    uint8_t	log;            // A log file (FB_IS_LOG), whose blocks can end short
+    redsfs_lz *	lz;             // Compressed file being read (FB_IS_COMP), NULL otherwise
+#if REDSFS_USE_PACK
+    uint8_t	packed;         // File is (readers) or goes on close (writers) in a pack block
+    uint32_t	pack_old;       // Pack entry an append replaces on close, REDSFS_NO_BLK if none
+#endif
+    uint32_t	ra_blk;         // Block last fetched into the cache while reading
+    uint32_t	crc_blk;        // Block in the cache whose CRC has been checked
+    uint8_t	err;            // A read stopped at a block failing its CRC, or close lost a packed file
+#if REDSFS_STATIC
+    uint8_t	slot;           // Buffers it has in fs_mem
+#endif
 } redsfs_fh;
 
-// Block size is 256
+// Per block CRC (REDSFS_BLOCK_CRC, see redsfsconf.h)
+#if REDSFS_BLOCK_CRC
+#define REDSFS_CRC_LEN 4
+#else
+#define REDSFS_CRC_LEN 0
+#endif
+
+// Block size is fs_block_size, a power of two from 256 to 64K (256 by default)
 //   file block flags = 4  //fb
+//   optional crc     = 4  //fb (REDSFS_BLOCK_CRC, offsets below grow by 4)
 //   next block addr  = 4  //fb
 //   size = 4              //db
-//   optional char namedata = 32
-//   data block total = 256 - 5(fb) = 251
-#define BLK_OFFSET_FIRST 44
-#define BLK_OFFSET_CHUNK 12
+//   optional char namedata = 32 (BLK_NAME_SIZE)
+//   first block file size = 4, last block addr = 4
+//   optional first block extents = 32 (FB_HAS_EXTENTS)
+//   data block total = block size - 52(first) or block size - 84(first with extents)
+//                      or block size - 12(chunk)
+#define BLK_OFFSET_FIRST ( 20 + BLK_NAME_SIZE + REDSFS_CRC_LEN )
+#define BLK_OFFSET_FIRST_EXT ( BLK_OFFSET_FIRST + REDSFS_EXTENTS * sizeof(redsfs_ext) )
+#define BLK_OFFSET_CHUNK ( 12 + REDSFS_CRC_LEN )
 #define BLK_SIZE 256
+#define BLK_SIZE_MIN 256
+#define BLK_SIZE_MAX 65536
+// Block size of a mount, a constant when the build fixes it
+#if REDSFS_BLOCK_SIZE
+#define BLK_SZ(fs) ( (void)(fs), (uint32_t)REDSFS_BLOCK_SIZE )
+#else
+#define BLK_SZ(fs) ( (fs)->fs_block_size )
+#endif
+#define BLK_DATA_FIRST(fs) ( BLK_SZ(fs) - BLK_OFFSET_FIRST )
+#define BLK_DATA_CHUNK(fs) ( BLK_SZ(fs) - BLK_OFFSET_CHUNK )
 typedef struct redsfs__datablock {
     uint32_t	size; 		// 4 Size of block (!namedata/dblock total not including header)
-    char        namedata[32];   // 32 not included in size calculations in first block
-    uint8_t     dblock[212];    // 212
+    char        namedata[BLK_NAME_SIZE]; // 32 not included in size calculations in first block
+    uint32_t    file_size;      // 4 First block only, total size of the file (FB_IS_SIZED)
+    uint32_t    last_blk_addr;  // 4 First block only, offset of the last block (FB_IS_SIZED)
+    redsfs_ext  ext[REDSFS_EXTENTS]; // 32 First block only, only there with FB_HAS_EXTENTS
+    // Block data follows up to fs_block_size
 } redsfs_db;
 
+struct redsfs__dirent {
+    char	name[BLK_NAME_SIZE];
+    uint32_t	first_blk_addr; // Offset of the first block
+    int32_t	file_size;      // -1 if not known
+};
+
 //
 #define FB_IS_USED    _BV(0)
 #define FB_IS_FIRST   _BV(1)
 #define FB_IS_CONT    _BV(2)
 #define FB_IS_LAST    _BV(3)
+#define FB_IS_SIZED   _BV(4)   // First block file_size/last_blk_addr are valid
+#define FB_HAS_EXTENTS _BV(5)  // First block carries an extent table before its data
+#define FB_IS_META    _BV(6)   // Superblock or checkpoint block, not part of any file
+#define FB_IS_LOG     _BV(7)   // First block of a log file, the size of its tail is in commit markers
+#define FB_IS_DEAD    _BV(8)   // First block of a deleted file, its chain waits for redsfs_gc
+#define FB_IS_COMP    _BV(9)   // File data is a compressed stream, sizes in the headers are of the stream
+#define FB_IS_PACK    _BV(10)  // Pack block, small files packed one after another after the chunk header
+#define FB_HAS_CRC    _BV(11)  // crc holds the block's CRC32C (REDSFS_BLOCK_CRC)
+#define FB_IS_GONE    _BV(12)  // Taken by redsfs_gc, free once its erase sector has nothing else in use
+
+// Packed small files: files of up to REDSFS_PACK_MAX bytes created with a size hint
+// share pack blocks. Each is an entry header, its name (not terminated) and its data,
+// entries follow on from BLK_OFFSET_CHUNK and a zero name_len ends them. Deleting one
+// only flags it dead, the block goes to redsfs_gc once every entry in it is.
+#define REDSFS_PACK_MAX 64
+#define PACK_DEAD     _BV(0)
+typedef struct redsfs__pack_ent {
+    uint8_t	name_len;       // 0 ends the entries
+    uint8_t	flags;          // PACK_*
+    uint16_t	size;           // Data bytes after the name
+} redsfs_pack_ent;
 
 typedef struct redsfs__fb {
     //bool	used;
@@ -62,19 +373,102 @@ typedef struct redsfs__fb {
     //bool	iscontinuing;
     //bool	islast;
     uint32_t	flags;
+#if REDSFS_BLOCK_CRC
+    uint32_t	crc;
+#endif
     uint32_t    next_blk_addr;
     redsfs_db	data;
 } redsfs_fb;
 
+#if REDSFS_STATIC
+// Everything a mount of a static build works in, for the caller to place where it
+// likes and point fs_mem at before mounting. Open files take a slot each of the
+// fh_ arrays. The mount scan borrows the file caches for the headers it reads,
+// before any file can be open, so REDSFS_SCAN_BATCH of them have to fit there.
+typedef struct redsfs__mem {
+    uint8_t	seek_cache[REDSFS_BLOCK_SIZE];
+    uint8_t	free_map[( REDSFS_MAX_BLOCKS + 7 ) / 8];
+    uint8_t	head_map[( REDSFS_MAX_BLOCKS + 7 ) / 8];
+    uint8_t	gone_map[( REDSFS_MAX_BLOCKS + 7 ) / 8];
+    uint32_t	dead[REDSFS_MAX_DEAD];
+#if REDSFS_USE_INDEX
+    redsfs_idx_ent index[REDSFS_INDEX_SLOTS];
+#endif
+#if REDSFS_USE_CACHE
+    uint8_t	rcache[REDSFS_CACHE_BLOCKS * REDSFS_BLOCK_SIZE];
+    redsfs_rc_slot rcache_slot[REDSFS_CACHE_BLOCKS];
+#endif
+    uint8_t	fh_cache[REDSFS_MAX_OPEN][REDSFS_BLOCK_SIZE];
+    uint32_t	fh_skip[REDSFS_MAX_OPEN][REDSFS_SKIP_SLOTS];
+#if REDSFS_USE_LZ
+    redsfs_lz	fh_lz[REDSFS_MAX_OPEN];
+#endif
+    uint32_t	fh_used;        // Bit per slot taken
+} redsfs_mem;
+#if REDSFS_SCAN_BATCH * BLK_OFFSET_FIRST > REDSFS_MAX_OPEN * REDSFS_BLOCK_SIZE
+#error "REDSFS_SCAN_BATCH headers do not fit in the file caches"
+#endif
+#endif
+
 // Callable functions.
 int8_t redsfs_mount(redsfs_fs *rfs);
 char * redsfs_next_file();
+int8_t redsfs_next_file_ex( redsfs_stat * st );
 ssize_t redsfs_cur_file_size();
 int32_t redsfs_next_empty_block();
 int8_t redsfs_open(char * fname, uint8_t mode);
+int8_t redsfs_open_ex(char * fname, uint8_t mode, uint32_t size_hint);
 void redsfs_close();
 uint8_t redsfs_delete(char * name);
 void redsfs_seek_to_end();
 uint8_t redsfs_unmount();
 size_t redsfs_write( char * buf, size_t size );
 size_t redsfs_read( char * buf, size_t size );
+int32_t redsfs_seek( int32_t offset, int whence );
+int32_t redsfs_tell();
+int8_t redsfs_error();
+int8_t redsfs_sync();
+int8_t redsfs_flush();
+int32_t redsfs_gc( uint32_t budget );
+redsfs_stats * redsfs_get_stats();
+
+// Reentrant versions, each mount and open file is its own instance.
+// Fill in the geometry and calling functions of a zeroed redsfs_fs, then mount it.
+int8_t redsfs_mount_r( redsfs_fs * fs );
+uint8_t redsfs_unmount_r( redsfs_fs * fs );
+char * redsfs_next_file_r( redsfs_fs * fs );
+// Next file with its size and where it is, 1 with st filled in, 0 after the last one
+int8_t redsfs_next_file_ex_r( redsfs_fs * fs, redsfs_stat * st );
+int32_t redsfs_next_empty_block_r( redsfs_fs * fs );
+int8_t redsfs_open_r( redsfs_fs * fs, redsfs_fh * fh, char * fname, uint8_t mode );
+int8_t redsfs_open_ex_r( redsfs_fs * fs, redsfs_fh * fh, char * fname, uint8_t mode, uint32_t size_hint );
+void redsfs_close_r( redsfs_fh * fh );
+ssize_t redsfs_cur_file_size_r( redsfs_fh * fh );
+void redsfs_seek_to_end_r( redsfs_fh * fh );
+uint8_t redsfs_delete_r( redsfs_fs * fs, char * name );
+size_t redsfs_write_r( redsfs_fh * fh, char * buf, size_t size );
+size_t redsfs_read_r( redsfs_fh * fh, char * buf, size_t size );
+int32_t redsfs_seek_r( redsfs_fh * fh, int32_t offset, int whence );
+int32_t redsfs_tell_r( redsfs_fh * fh );
+// -1 once a read on the file has stopped at a block failing its CRC, or close could not
+// write it out as a packed file, 0 otherwise
+int8_t redsfs_error_r( redsfs_fh * fh );
+int8_t redsfs_sync_r( redsfs_fs * fs );
+int8_t redsfs_flush_r( redsfs_fh * fh );
+int32_t redsfs_gc_r( redsfs_fs * fs, uint32_t budget );
+redsfs_stats * redsfs_get_stats_r( redsfs_fs * fs );
+
+#if REDSFS_USE_LZ && !REDSFS_STATIC
+// Compress len bytes of in into out for a MODE_WRITE_COMP file. Returns the stream
+// size, 0 if it would not fit in cap (4 + len + len / 8 + 1 always does).
+size_t redsfs_lz_compress( const uint8_t * in, size_t len, uint8_t * out, size_t cap );
+#endif
+
+// CRC32C of len bytes of buf carrying on from crc (0 to start)
+uint32_t redsfs_crc32c( uint32_t crc, const uint8_t * buf, size_t len );
+
+// What the crc of the file block with header hdr should be, its data at data (NULL when
+// it follows the header). The header tells how long it is and how much data there is.
+uint32_t redsfs_block_crc( const uint8_t * hdr, const uint8_t * data, uint32_t blk_sz );
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Image check for redsimg
+ *
+ * A serial pass over the block flags finds where the chains start, the workers
+ * then follow them, claiming each block they step on for its chain. A block
+ * claimed twice is in two chains, or a loop in one. Deleted chains are claimed
+ * too, but redsfs_gc may be part way through them so they are not judged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "redsfsck.h"
+
+typedef struct fsck__job {
+    uint8_t *	image;
+    uint32_t	size;
+    uint32_t	blk_sz;
+    uint32_t	blk_cnt;
+    uint32_t *	owner;          // Per block, the first block of its chain + 1, 0 for none
+    uint32_t *	heads;          // First blocks and pack blocks
+    uint32_t	cnt;
+    uint32_t	next;           // Next chain for a worker to take
+    uint32_t	files;
+    uint32_t	packed;
+    uint32_t	blocks;         // Blocks some chain holds
+    uint32_t	errors;
+    uint32_t	crc_errors;
+    uint32_t	reported;
+} fsck_job;
+
+static void fsck_report ( fsck_job * job, const char * what, const char * name, uint32_t blk )
+{
+    if ( __atomic_fetch_add( &job->reported, 1, __ATOMIC_RELAXED ) < FSCK_MAX_REPORT )
+        printf("Check: %s, %s at block %u\r\n", name, what, blk);
+}
+
+// Take a block for the chain starting at head, the owner it already had otherwise
+static uint32_t fsck_claim ( fsck_job * job, uint32_t blk, uint32_t head )
+{
+    uint32_t none = 0;
+
+    if ( __atomic_compare_exchange_n( &job->owner[blk], &none, head + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+        __atomic_fetch_add( &job->blocks, 1, __ATOMIC_RELAXED );
+        return 0;
+    }
+    return none;
+}
+
+// Entries have to fit the block and end with a zero name_len or at its end
+static void fsck_pack ( fsck_job * job, uint32_t head )
+{
+    uint8_t * base = job->image + head * job->blk_sz;
+    redsfs_pack_ent ent;
+    uint32_t off = BLK_OFFSET_CHUNK;
+    uint32_t live = 0;
+
+    if ( fsck_claim( job, head, head ) != 0 ) {
+        fsck_report( job, "pack block also in another chain", "(packed)", head );
+        __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    while ( off + sizeof(ent) <= job->blk_sz ) {
+        memcpy( &ent, base + off, sizeof(ent) );
+        if ( ent.name_len == 0 )
+            break;
+        if ( ( ent.name_len > BLK_NAME_SIZE ) || ( ent.size > REDSFS_PACK_MAX ) ||
+             ( off + sizeof(ent) + ent.name_len + ent.size > job->blk_sz ) ) {
+            fsck_report( job, "pack entry runs past its block", "(packed)", head );
+            __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+            break;
+        }
+        if ( ( ent.flags & PACK_DEAD ) == 0 )
+            live++;
+        off += sizeof(ent) + ent.name_len + ent.size;
+    }
+    __atomic_fetch_add( &job->packed, live, __ATOMIC_RELAXED );
+}
+
+static void fsck_chain ( fsck_job * job, uint32_t head )
+{
+    redsfs_fb * first = (redsfs_fb*)( job->image + head * job->blk_sz );
+    redsfs_fb * fb;
+    uint8_t dead = ( first->flags & FB_IS_DEAD ) != 0;
+    char name[BLK_NAME_SIZE + 1];
+    uint32_t blk = head;
+    uint32_t hdr_len;
+    uint32_t total = 0;
+    uint32_t owner;
+    uint32_t k;
+
+    if ( first->flags & FB_IS_PACK ) {
+        fsck_pack( job, head );
+        return;
+    }
+
+    memcpy( name, first->data.namedata, BLK_NAME_SIZE );
+    name[BLK_NAME_SIZE] = 0;
+
+    for ( k = 0; ; k++ ) {
+        owner = fsck_claim( job, blk, head );
+        if ( owner != 0 ) {
+            if ( !dead ) {
+                fsck_report( job, ( owner == head + 1 ) ? "chain loops back" : "chain runs into another file", name, blk );
+                __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+            }
+            return;
+        }
+
+        fb = (redsfs_fb*)( job->image + blk * job->blk_sz );
+        if ( ( k > 0 ) && ( ( ( fb->flags & FB_IS_USED ) == 0 ) ||
+                            ( fb->flags & ( FB_IS_FIRST | FB_IS_META | FB_IS_PACK ) ) ) ) {
+            if ( !dead ) {
+                fsck_report( job, "chain runs into a block not of a chain", name, blk );
+                __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+            }
+            return;
+        }
+
+        hdr_len = BLK_OFFSET_CHUNK;
+        if ( k == 0 )
+            hdr_len = ( fb->flags & FB_HAS_EXTENTS ) ? BLK_OFFSET_FIRST_EXT : BLK_OFFSET_FIRST;
+        if ( fb->data.size > job->blk_sz - hdr_len ) {
+            if ( !dead ) {
+                fsck_report( job, "block holds more than fits", name, blk );
+                __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+            }
+            return;
+        }
+#if REDSFS_BLOCK_CRC
+        if ( !dead && ( fb->flags & FB_HAS_CRC ) &&
+             ( fb->crc != redsfs_block_crc( (uint8_t*)fb, NULL, job->blk_sz ) ) ) {
+            fsck_report( job, "CRC does not match", name, blk );
+            __atomic_fetch_add( &job->crc_errors, 1, __ATOMIC_RELAXED );
+        }
+#endif
+        total += fb->data.size;
+
+        // A log's tail is the block that does not point on yet
+        if ( ( fb->flags & FB_IS_LAST ) || ( ( first->flags & FB_IS_LOG ) && ( fb->next_blk_addr == 0 ) ) )
+            break;
+        if ( ( fb->next_blk_addr == 0 ) || ( fb->next_blk_addr % job->blk_sz ) ||
+             ( fb->next_blk_addr >= job->size ) ) {
+            if ( !dead ) {
+                fsck_report( job, "chain broken", name, blk );
+                __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+            }
+            return;
+        }
+        blk = fb->next_blk_addr / job->blk_sz;
+    }
+
+    if ( dead )
+        return;
+    __atomic_fetch_add( &job->files, 1, __ATOMIC_RELAXED );
+
+    // A log's size is its commit marker, the chain can run on past it
+    if ( ( first->flags & FB_IS_SIZED ) && ( ( first->flags & FB_IS_LOG ) == 0 ) &&
+         ( ( first->data.file_size != total ) || ( first->data.last_blk_addr != blk * job->blk_sz ) ) ) {
+        fsck_report( job, "size in the first block does not match the chain", name, head );
+        __atomic_fetch_add( &job->errors, 1, __ATOMIC_RELAXED );
+    }
+}
+
+static void * fsck_worker ( void * arg )
+{
+    fsck_job * job = arg;
+    uint32_t i;
+
+    while ( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->cnt )
+        fsck_chain( job, job->heads[i] );
+    return NULL;
+}
+
+int redsfsck_image ( uint8_t * image, uint32_t size, uint32_t blk_sz, uint32_t threads )
+{
+    fsck_job job;
+    pthread_t * tid;
+    redsfs_fb * fb;
+    uint32_t unref = 0;
+    uint32_t used = 0;
+    uint32_t blk;
+    uint32_t i;
+
+    memset( &job, 0, sizeof(job) );
+    job.image = image;
+    job.size = size;
+    job.blk_sz = blk_sz;
+    job.blk_cnt = size / blk_sz;
+    job.owner = calloc( job.blk_cnt, sizeof(uint32_t) );
+    job.heads = malloc( job.blk_cnt * sizeof(uint32_t) );
+    if ( ( job.owner == NULL ) || ( job.heads == NULL ) ) {
+        printf("Check: out of memory\r\n");
+        free( job.owner );
+        free( job.heads );
+        return -1;
+    }
+
+    for ( blk = 0; blk < job.blk_cnt; blk++ ) {
+        fb = (redsfs_fb*)( image + blk * blk_sz );
+        // Blocks redsfs_gc has taken only wait for their erase
+        if ( ( ( fb->flags & FB_IS_USED ) == 0 ) || ( fb->flags & ( FB_IS_META | FB_IS_GONE ) ) )
+            continue;
+        used++;
+        if ( fb->flags & ( FB_IS_FIRST | FB_IS_PACK ) )
+            job.heads[job.cnt++] = blk;
+    }
+
+    if ( threads < 1 )
+        threads = 1;
+    if ( threads > job.cnt )
+        threads = job.cnt ? job.cnt : 1;
+    tid = malloc( threads * sizeof(pthread_t) );
+    for ( i = 0; ( tid != NULL ) && ( i < threads ); i++ ) {
+        if ( pthread_create( &tid[i], NULL, fsck_worker, &job ) != 0 )
+            break;
+    }
+    // No thread would start, do the work here
+    if ( i == 0 )
+        fsck_worker( &job );
+    while ( i > 0 )
+        pthread_join( tid[--i], NULL );
+    free( tid );
+
+    // Left behind by a write that never finished, space lost rather than damage
+    for ( blk = 0; blk < job.blk_cnt; blk++ ) {
+        fb = (redsfs_fb*)( image + blk * blk_sz );
+        if ( ( fb->flags & FB_IS_USED ) && ( ( fb->flags & ( FB_IS_META | FB_IS_GONE ) ) == 0 ) && ( job.owner[blk] == 0 ) )
+            unref++;
+    }
+
+    printf("Checked %u files and %u packed files in %u of %u used blocks with %u threads: "
+           "%u errors, %u CRC errors, %u blocks in no chain\r\n", job.files, job.packed, job.blocks, used,
+           threads, job.errors, job.crc_errors, unref);
+    free( job.owner );
+    free( job.heads );
+    return ( job.errors || job.crc_errors ) ? -1 : (int)( job.files + job.packed );
+}
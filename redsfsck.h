@@ -0,0 +1,23 @@
+/*
+ * Image check for redsimg
+ *
+ * Walks every chain of an image straight from the mapped file, without
+ * mounting it, with worker threads taking a chain at a time. Block CRCs are
+ * checked where the image has them (REDSFS_BLOCK_CRC builds).
+ */
+
+#ifndef REDSFSCK_H
+#define REDSFSCK_H
+
+#include <stdint.h>
+
+#include "redsfs.h"
+
+// Problems printed before the rest are only counted
+#define FSCK_MAX_REPORT 32
+
+// Check the image of size bytes at image with threads workers. Returns the number
+// of files, -1 if any chain is broken, cross linked or fails its CRC.
+int redsfsck_image ( uint8_t * image, uint32_t size, uint32_t blk_sz, uint32_t threads );
+
+#endif
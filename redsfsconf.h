@@ -0,0 +1,133 @@
+/*
+ * REally Dang Simple File System build configuration
+ *
+ * Everything here is a default that -D on the compiler line, or a header of
+ * your own named by REDSFS_CONFIG and read first, can override:
+ *   -DREDSFS_CONFIG='"board_redsfs.h"'
+ * The defaults build the full library on the heap, as redsimg uses it.
+ */
+
+#ifndef REDSFSCONF_H
+#define REDSFSCONF_H
+
+#ifdef REDSFS_CONFIG
+#include REDSFS_CONFIG
+#endif
+
+// Static build: redsfs.c never calls malloc. A mount runs in the redsfs_mem the
+// caller points fs_mem at, sized by the limits below, and what a heap build grows
+// into when it needs to is not there (the index is dropped when it fills, deleted
+// chains past REDSFS_MAX_DEAD wait for the next mount, seeks thin out the skip
+// slots sooner). Needs REDSFS_BLOCK_SIZE, and leaves out the superblock and
+// redsfs_lz_compress, which want buffers the size of the image's directory.
+#ifndef REDSFS_STATIC
+#define REDSFS_STATIC 0
+#endif
+
+// Block size fixed at build time, 0 for the fs_block_size given at mount. Fixed,
+// block offsets and sizes are constants the compiler can fold and fs_block_size
+// may be left 0 (anything else has to match).
+#ifndef REDSFS_BLOCK_SIZE
+#define REDSFS_BLOCK_SIZE 0
+#endif
+
+// Parts that can be left out, 0 to build without them
+#ifndef REDSFS_USE_INDEX
+#define REDSFS_USE_INDEX 1      // Filename index (REDSFS_OPT_INDEX)
+#endif
+#ifndef REDSFS_USE_CACHE
+#define REDSFS_USE_CACHE 1      // Mount block cache and read ahead (fs_cache_blocks)
+#endif
+#ifndef REDSFS_USE_SUPER
+#define REDSFS_USE_SUPER ( !REDSFS_STATIC )  // Superblock and checkpoint (REDSFS_OPT_SUPER)
+#endif
+#ifndef REDSFS_USE_LZ
+#define REDSFS_USE_LZ 1         // Reading compressed files (FB_IS_COMP), which fail to open without
+#endif
+#ifndef REDSFS_USE_STATS
+#define REDSFS_USE_STATS 1      // Mount stats and per op costs (redsfs_get_stats gives NULL without)
+#endif
+#ifndef REDSFS_USE_TRACE
+#define REDSFS_USE_TRACE REDSFS_USE_STATS  // Trace hook (call_trace_f), costs come from the stats
+#endif
+#ifndef REDSFS_USE_EXTENTS
+#define REDSFS_USE_EXTENTS 1    // Runs reserved from a size hint, without them files grow a block at a
+#endif                          // time and runs already in an image are followed by their chain
+#ifndef REDSFS_USE_PACK
+#define REDSFS_USE_PACK 1       // Packed small files, images holding pack blocks do not mount without
+#endif
+
+// Per block CRC32C is a build option, as it moves the data of every block along
+// and images built with and without it do not mix. Built with it, file blocks are
+// written with FB_HAS_CRC and a CRC32C from next_blk_addr to the end of their data
+// (flags are left out, they change after the block is written), checked as they
+// are read. Log and pack blocks are written a piece at a time and go without.
+#ifndef REDSFS_BLOCK_CRC
+#define REDSFS_BLOCK_CRC 0
+#endif
+
+// Longest file name, stored without a terminator when it is this long. It sets where
+// the data of a first block starts, so images only mount on builds with the same one.
+// A multiple of 4.
+#ifndef BLK_NAME_SIZE
+#define BLK_NAME_SIZE 32
+#endif
+
+// Limits of a static build, what redsfs_mem holds
+#ifndef REDSFS_MAX_BLOCKS
+#define REDSFS_MAX_BLOCKS 4096  // Blocks in the image, for the free and head maps
+#endif
+#ifndef REDSFS_MAX_OPEN
+#define REDSFS_MAX_OPEN 2       // Files open at once, redsfs_delete takes one for the call
+#endif
+#ifndef REDSFS_INDEX_SLOTS
+#define REDSFS_INDEX_SLOTS 64   // Filename index, a power of two, good for 3/4 as many files
+#endif
+#ifndef REDSFS_CACHE_BLOCKS
+#define REDSFS_CACHE_BLOCKS 2   // Most blocks fs_cache_blocks can ask for
+#endif
+#ifndef REDSFS_MAX_DEAD
+#define REDSFS_MAX_DEAD 16      // Deleted chains waiting for redsfs_gc
+#endif
+#ifndef REDSFS_SKIP_SLOTS
+#define REDSFS_SKIP_SLOTS 16    // Chain positions each open file keeps for seeking
+#endif
+
+// Stack a call can take. Most blocks a single redsfs_write/redsfs_read hands to
+// call_writev_f/call_readv_f at once, and blocks the mount scan takes the flags of
+// in one strided or vectored read. A static build's scan reads the headers of a
+// batch into the file caches, so the batch there is what fits in them.
+#ifndef REDSFS_WRITEV_BLOCKS
+#define REDSFS_WRITEV_BLOCKS 16
+#endif
+#ifndef REDSFS_READV_BLOCKS
+#define REDSFS_READV_BLOCKS  16
+#endif
+#ifndef REDSFS_SCAN_BATCH
+#if REDSFS_STATIC
+#define REDSFS_SCAN_BATCH 8
+#else
+#define REDSFS_SCAN_BATCH 64
+#endif
+#endif
+
+#if REDSFS_STATIC && !REDSFS_BLOCK_SIZE
+#error "REDSFS_STATIC needs REDSFS_BLOCK_SIZE"
+#endif
+#if REDSFS_STATIC && REDSFS_USE_SUPER
+#error "REDSFS_STATIC builds go without the superblock (REDSFS_USE_SUPER 0)"
+#endif
+#if REDSFS_USE_TRACE && !REDSFS_USE_STATS
+#error "REDSFS_USE_TRACE needs REDSFS_USE_STATS"
+#endif
+#if REDSFS_STATIC && ( REDSFS_MAX_OPEN > 32 )
+#error "REDSFS_MAX_OPEN is at most 32"
+#endif
+#if REDSFS_BLOCK_SIZE & ( REDSFS_BLOCK_SIZE - 1 )
+#error "REDSFS_BLOCK_SIZE has to be a power of two"
+#endif
+#if BLK_NAME_SIZE & 3
+#error "BLK_NAME_SIZE has to be a multiple of 4"
+#endif
+
+#endif
@@ -21,9 +21,16 @@
 #include <dirent.h>
 
 #include "redsfs.h"
+#include "flashsim.h"
+#include "redsbench.h"
+#include "redsbuild.h"
+#include "redsexport.h"
+#include "redsupdate.h"
+#include "redsfsck.h"
 
 static int retcode = 0;
 static uint8_t *flash;
+static bool compress = false;
 
 // Die with an error message
 void die(char * msg)
@@ -47,6 +54,70 @@ uint32_t linux_fs_write ( uint32_t addr, uint32_t size, uint8_t * src )
     return 0;
 }
 
+// Mapped function for vectored writing (for micros a single SPI/FLASH transaction)
+uint32_t linux_fs_writev ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    for (i = 0; i < cnt; i++)
+        memcpy ( flash + iov[i].addr, iov[i].buf, iov[i].size );
+    return 0;
+}
+
+// Mapped function for vectored reading (for micros a single SPI/FLASH transaction)
+uint32_t linux_fs_readv ( redsfs_iov * iov, uint32_t cnt )
+{
+    uint32_t i;
+
+    for (i = 0; i < cnt; i++)
+        memcpy ( iov[i].buf, flash + iov[i].addr, iov[i].size );
+    return 0;
+}
+
+// Mapped function for strided reading (for micros a single SPI/FLASH transaction)
+uint32_t linux_fs_readstride ( uint32_t addr, uint32_t size, uint32_t stride, uint32_t cnt, uint8_t * dest )
+{
+    uint32_t i;
+
+    for (i = 0; i < cnt; i++)
+        memcpy ( dest + i * size, flash + addr + i * stride, size );
+    return 0;
+}
+
+// Store the file compressed when that makes it smaller, -1 leaves it to the plain copy
+int import_compressed ( int fin, char * path, size_t size )
+{
+    uint8_t * raw = malloc( size + 1 );
+    uint8_t * comp = malloc( size + 1 );
+    size_t got = 0;
+    size_t clen = 0;
+    ssize_t n;
+
+    if ( raw && comp ) {
+        while ( ( got < size ) && ( ( n = read( fin, raw + got, size - got ) ) > 0 ) )
+            got += n;
+        if ( got == size )
+            clen = redsfs_lz_compress( raw, size, comp, size );
+    }
+    free( raw );
+    lseek( fin, 0, SEEK_SET );
+
+    // Not smaller (or not read), copied as it is
+    if ( ( clen == 0 ) || ( clen >= size ) ) {
+        free( comp );
+        return -1;
+    }
+    if ( redsfs_open_ex( path, MODE_WRITE_COMP, clen ) < 0 ) {
+        free( comp );
+        return -1;
+    }
+    if ( redsfs_write( (char*)comp, clen ) != clen )
+        die("Write issue (out of space?)\r\n");
+    redsfs_close();
+    free( comp );
+    return 0;
+}
+
 int import_file ( char * dir, char * path )
 {
     int n;
@@ -55,10 +126,8 @@ int import_file ( char * dir, char * path )
     int pathlen;
     int dirlen;
     char * filepath;
-
-    // Open reds file for writing
-    int file = redsfs_open( path, MODE_WRITE );
-        if (file < 0) return -1;
+    struct stat st = {0};
+    int file;
 
     // Open file for reading to copy into redsfs
     filepathlen = strlen(dir) + strlen(path) + 2;
@@ -72,6 +141,17 @@ int import_file ( char * dir, char * path )
     int fin = open( filepath, O_RDONLY );
         if (fin < 0) return fin;
 
+    fstat( fin, &st );
+    if ( compress && ( import_compressed( fin, path, st.st_size ) == 0 ) ) {
+        close(fin);
+        free(filepath);
+        return 0;
+    }
+
+    // Open reds file for writing, sized so its blocks can be reserved in one run
+    file = redsfs_open_ex( path, MODE_WRITE, st.st_size );
+        if (file < 0) return -1;
+
     while ((n = read(fin, buf, sizeof(buf)))) {
         retcode = redsfs_write ( buf, n );
         if (retcode < 0) die("Write issue (out of space?)\r\n");
@@ -79,6 +159,7 @@ int import_file ( char * dir, char * path )
 
     // Close the reds file (complete the copy);
     redsfs_close();
+    if ( redsfs_error() < 0 ) die("Write issue (out of space?)\r\n");
     close(fin);
     free(filepath);
     return 0;
@@ -106,81 +187,40 @@ int import_dir ( char * path )
     return 0;
 }
 
-int export_file ( char * dir, char * path )
-{
-    int n;
-    char buf[256];
-    int filepathlen;
-    int pathlen;
-    int dirlen;
-    char * filepath;
-
-    // Open reds file for writing
-    int file = redsfs_open( path, MODE_WRITE );
-    if (file < 0) return -1;
-
-    // Open file for reading to copy into redsfs
-    filepathlen = strlen(dir) + strlen(path) + 2;
-    pathlen = strlen(path);
-    dirlen = strlen(dir);
-    filepath = malloc( filepathlen );
-    memset( filepath, 0, filepathlen );
-    memcpy( filepath, dir, dirlen );
-    memcpy( filepath+dirlen, "/", 1);
-    memcpy( filepath+dirlen+1, path, pathlen);
-    
-    FILE * fout = fopen( filepath, "w" );
-    if (fout < 0) return -1;
-    ssize_t fSize = redsfs_cur_file_size();
-    printf("Size=%zd\r\n", fSize);
-    
-    while ((n = redsfs_read( buf, sizeof(buf)))) {
-        retcode = fwrite ( buf, 1, n, fout );
-    }
-
-    // Close the reds file (complete the copy);
-    redsfs_close();
-    fclose(fout);
-    free(filepath);
-    return 0;
-}
-
-int export_dir ( char * path )
-{
-    uint8_t file;
-    char * fname;
-
-    // Check our export directory has been created
-    struct stat st = {0};
-    if (stat(path, &st) == -1) {
-        mkdir(path, 0755);
-    }
-
-    // Start export/list
-    printf("Exporting/Listing files...\r\n");
-    while ( (fname = redsfs_next_file()) != NULL ) {
-        printf("Exporting file: %s \r\n", fname);
-        export_file( path, fname );
-    }
-
-    return 0;
-}
-
+// Name, size, first block and kind of every file, from the listing pass alone
 void list_files()
 {
-    uint8_t file;
-    char * fname;
+    redsfs_stat st;
+    char size[16];
+    uint32_t files = 0;
+    uint64_t bytes = 0;
 
     printf("Files in redsfs image:\r\n");
-    while ( ( fname = redsfs_next_file() ) != NULL ) {
-        printf(" - %s\r\n", fname);
+    while ( redsfs_next_file_ex( &st ) > 0 ) {
+        if ( st.size < 0 )
+            strcpy( size, "?" );
+        else
+            snprintf( size, sizeof(size), "%d", st.size );
+        printf(" - %-32s %10s  @%08x%s%s%s\r\n", st.name, size, st.first_blk,
+               ( st.flags & FB_IS_PACK ) ? "  packed" : "",
+               ( st.flags & FB_IS_COMP ) ? "  compressed" : "",
+               ( st.flags & FB_IS_LOG ) ? "  log" : "");
+        files++;
+        if ( st.size > 0 )
+            bytes += st.size;
     }
+    printf("%u files, %llu bytes\r\n", files, (unsigned long long)bytes);
 }
 
+// Records written to the log by readwrite_test
+#define LOG_TEST_RECS 120
+
 int readwrite_test()
 {
     char buf[256];
+    char rec[16];
     int bufSz;
+    int i;
 
     printf ("Opening a file to write...\r\n");
     int file = redsfs_open( "test.txt", MODE_APPEND );
@@ -236,6 +276,51 @@ int readwrite_test()
     }
     //printf("Deleting file\r\n");
     //redsfs_delete("test.txt");
+
+    // Records over a few blocks, committed now and then, with the log reopened half way
+    printf("Logging records to log.txt\r\n");
+    for (i = 0; i < LOG_TEST_RECS; i++) {
+        if ((i % ( LOG_TEST_RECS / 2 )) == 0) {
+            if (i > 0)
+                redsfs_close();
+            if (redsfs_open("log.txt", MODE_LOG) < 0) {
+                redsfs_unmount();
+                die("Couldn't open log...");
+            }
+        }
+        snprintf(buf, sizeof(buf), "record %04d\n", i);
+        if (redsfs_write(buf, 12) != 12) {
+            redsfs_close();
+            redsfs_unmount();
+            die("Couldn't write to log...");
+        }
+        if ((i % 10) == 9)
+            redsfs_flush();
+    }
+    redsfs_close();
+
+    printf("Reading the log back\r\n");
+    redsfs_open("log.txt", MODE_READ);
+    if (redsfs_cur_file_size() != LOG_TEST_RECS * 12) {
+        redsfs_close();
+        redsfs_unmount();
+        die("Log is the wrong size...");
+    }
+    for (i = 0; i < LOG_TEST_RECS; i++) {
+        snprintf(rec, sizeof(rec), "record %04d\n", i);
+        if ((redsfs_read(buf, 12) != 12) || (memcmp(buf, rec, 12) != 0))
+            break;
+    }
+    // And from part way in
+    if ((i == LOG_TEST_RECS) && (redsfs_seek(77 * 12, SEEK_SET) == 77 * 12) &&
+        (redsfs_read(buf, 12) == 12))
+        snprintf(rec, sizeof(rec), "record %04d\n", 77);
+    redsfs_close();
+    if ((i != LOG_TEST_RECS) || (memcmp(buf, rec, 12) != 0)) {
+        redsfs_unmount();
+        die("Log did not read back...");
+    }
+
     printf("Read/Write tests passed\r\n");
     return 0;
 }
@@ -245,21 +330,45 @@ int main( int argc, char *argv[] )
     int opt;
     const char *fname = 0;
     bool create = false;
-    enum { CMD_NONE, CMD_LIST, CMD_IMPORT, CMD_EXPORT, CMD_TEST } command = CMD_NONE;
+    enum { CMD_NONE, CMD_LIST, CMD_IMPORT, CMD_EXPORT, CMD_TEST, CMD_BENCH, CMD_BUILD, CMD_UPDATE, CMD_PATCH, CMD_CHECK } command = CMD_NONE;
     size_t sz = 0;
+    uint32_t blk_sz = BLK_SIZE;
+    uint32_t cache_blks = 0;
     char *imp_dir = 0;
     char *exp_dir = 0;
-
-    while ((opt = getopt (argc, argv, "f:c:li:e:t")) != -1)
+    char *delta = 0;
+    uint8_t *base = 0;
+    bool super = false;
+    char *sim = 0;
+    flashsim_config sim_cfg;
+    redsbench_config bench_cfg;
+    uint32_t threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt (argc, argv, "f:c:b:C:SF:li:I:u:D:P:Vj:e:tB:z")) != -1)
     {
         switch (opt)
 	{
           case 'f': fname = optarg; break;
           case 'c': create = true; sz = strtoul (optarg, 0, 0); break;
+          case 'b': blk_sz = strtoul (optarg, 0, 0); break;
+          case 'C': cache_blks = strtoul (optarg, 0, 0); break;
+          case 'S': super = true; break;
+          case 'F': sim = optarg; break;
           case 'l': command = CMD_LIST; break;
           case 'i': command = CMD_IMPORT; imp_dir = optarg; break;
+          case 'I': command = CMD_BUILD; imp_dir = optarg; break;
+          case 'u': command = CMD_UPDATE; imp_dir = optarg; break;
+          case 'D': delta = optarg; break;
+          case 'P': command = CMD_PATCH; delta = optarg; break;
+          case 'V': command = CMD_CHECK; break;
+          case 'j': threads = strtoul (optarg, 0, 0); break;
           case 'e': command = CMD_EXPORT; exp_dir = optarg; break;
           case 't': command = CMD_TEST; break;
+          case 'z': compress = true; break;
+          case 'B': command = CMD_BENCH;
+                    if (redsbench_parse (&bench_cfg, optarg) < 0)
+                        die ("bad bench spec");
+                    break;
           default: die("no options");
        }
     }
@@ -283,8 +392,11 @@ int main( int argc, char *argv[] )
         sz = offs;
     }
 
-    if (sz & (BLK_SIZE -1)) 
-        die ("file size not multiple of page size");
+    if ((blk_sz < BLK_SIZE_MIN) || (blk_sz > BLK_SIZE_MAX) || (blk_sz & (blk_sz - 1)))
+        die ("block size not a power of two from 256 to 65536");
+
+    if (sz & (blk_sz -1)) 
+        die ("file size not multiple of block size");
 
     flash = mmap (0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (!flash)
@@ -292,24 +404,126 @@ int main( int argc, char *argv[] )
     if (create) {
         memset (flash, 0, sz);
     }
+    // Build straight into the fresh image, the mount below then reads it like any other
+    if (command == CMD_BUILD)
+    {
+        if (!create)
+            die ("building needs a new image (-c)");
+        if (compress)
+            die ("-z works with -i, not -I");
+        if (redsbuild_dir (flash, sz, blk_sz, super ? 1 : 0, imp_dir, threads) < 0)
+            die ("build");
+    }
+
+    if ((command == CMD_UPDATE) && compress)
+        die ("-z works with -i, not -u");
+
+    // Checked as it is, a mount would already trust it
+    if (command == CMD_CHECK)
+    {
+        int ret = redsfsck_image (flash, sz, blk_sz, threads);
+        munmap (flash, sz);
+        close (fd);
+        return (ret < 0) ? -1 : 0;
+    }
+
+    // A delta goes on the image as it is, without mounting it
+    if (command == CMD_PATCH)
+    {
+        int ret = redsupdate_apply (flash, sz, blk_sz, delta);
+        munmap (flash, sz);
+        close (fd);
+        return (ret < 0) ? -1 : 0;
+    }
+
+    // Keep the image as it was to diff against after unmount
+    if (delta)
+    {
+        if (create)
+            die ("a delta needs an existing image");
+        base = malloc (sz);
+        if (!base)
+            die ("out of memory for the delta");
+        memcpy (base, flash, sz);
+    }
+
     redsfs_fs redsfs_mnt;
+    memset (&redsfs_mnt, 0, sizeof(redsfs_mnt));
     redsfs_mnt.fs_start = 0;
-    redsfs_mnt.fs_block_size = 256;
-    redsfs_mnt.call_read_f = linux_fs_read;
-    redsfs_mnt.call_write_f = linux_fs_write;;
+    redsfs_mnt.fs_block_size = blk_sz;
+    if (sim)
+    {
+        // Same image, driven through the simulated part's timing and erase rules
+        if (flashsim_parse (&sim_cfg, sim) < 0)
+            die ("bad flash sim spec");
+        if (flashsim_init (&sim_cfg, flash, sz) < 0)
+            die ("flash sim needs a power of two sector and page dividing the image");
+        redsfs_mnt.call_read_f = flashsim_read;
+        redsfs_mnt.call_write_f = flashsim_write;
+        redsfs_mnt.call_writev_f = flashsim_writev;
+        redsfs_mnt.call_readv_f = flashsim_readv;
+        redsfs_mnt.call_readstride_f = flashsim_readstride;
+        redsfs_mnt.call_erase_f = flashsim_erase;
+        redsfs_mnt.fs_erase_size = (sim_cfg.sector > blk_sz) ? sim_cfg.sector : blk_sz;
+    }
+    else
+    {
+        redsfs_mnt.call_read_f = linux_fs_read;
+        redsfs_mnt.call_write_f = linux_fs_write;
+        redsfs_mnt.call_writev_f = linux_fs_writev;
+        redsfs_mnt.call_readv_f = linux_fs_readv;
+        redsfs_mnt.call_readstride_f = linux_fs_readstride;
+    }
     redsfs_mnt.fs_end = sz;
+    redsfs_mnt.fs_opts = REDSFS_OPT_INDEX | ( super ? REDSFS_OPT_SUPER : 0 );
+    redsfs_mnt.fs_cache_blocks = cache_blks;
+
+    // Count what the workload asks of whichever backend is in use
+    if (command == CMD_BENCH)
+        redsbench_hook (&redsfs_mnt);
+
+    // Export and update go through a reentrant mount of their own. Export workers
+    // share it, the simulated part takes one transaction at a time.
+    redsfs_fs own_mnt;
+    int status = 0;
+    int rfmt;
 
     printf("Mounting redsfs...\r\n");
-    int rfmt = redsfs_mount( &redsfs_mnt );
+    if (command == CMD_EXPORT)
+    {
+        own_mnt = redsfs_mnt;
+        own_mnt.call_lock_f = redsexport_lock;
+        if (sim)
+            threads = 1;
+        rfmt = redsfs_mount_r( &own_mnt );
+    }
+    else if (command == CMD_UPDATE)
+    {
+        own_mnt = redsfs_mnt;
+        rfmt = redsfs_mount_r( &own_mnt );
+    }
+    else
+    {
+        rfmt = redsfs_mount( &redsfs_mnt );
+    }
+    if (rfmt < 0)
+        die ("mount");
 
     if (command == CMD_IMPORT)
     { 
         import_dir( imp_dir );
     }
+
+    if (command == CMD_UPDATE)
+    {
+        if (redsupdate_dir (&own_mnt, imp_dir) < 0)
+            status = -1;
+    }
     
     if (command == CMD_EXPORT)
     {
-        export_dir( exp_dir );
+        if (redsexport_dir (&own_mnt, exp_dir, threads) < 0)
+            status = -1;
     }
 
     if (command == CMD_LIST)
@@ -322,12 +536,34 @@ int main( int argc, char *argv[] )
         readwrite_test();
     }
 
+    if (command == CMD_BENCH)
+    {
+        if (redsbench_run (&bench_cfg, &redsfs_mnt, stdout) != 0)
+            status = -1;
+    }
+
     printf("Unmounting... \r\n");
-    redsfs_unmount();
+    if ((command == CMD_EXPORT) || (command == CMD_UPDATE))
+        redsfs_unmount_r( &own_mnt );
+    else
+        redsfs_unmount();
+
+    if (sim)
+    {
+        flashsim_report (stdout);
+        flashsim_free ();
+    }
+
+    if (base)
+    {
+        if (redsupdate_delta (base, flash, sz, blk_sz, delta) < 0)
+            status = -1;
+        free (base);
+    }
 
     munmap(flash, sz);
     close(fd);
 
-    return 0;
+    return status;
 }
 
@@ -0,0 +1,324 @@
+/*
+ * Incremental image update for redsimg
+ *
+ * Files are compared by a hash of their contents as redsfs reads them back, so
+ * compressed ones compare by what they hold. Everything that goes is deleted and
+ * collected before anything is written, which leaves the free map's lowest runs
+ * where the old copies were for the new ones to take, and the delta small.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "redsupdate.h"
+
+typedef struct update__ent {
+    char	name[BLK_NAME_SIZE + 1];
+    int32_t	size;           // -1 if not known
+    uint8_t	keep;           // Same contents as the host file of that name
+} update_ent;
+
+// FNV-1a, 64 bit
+#define UPDATE_HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t update_hash ( uint64_t h, const uint8_t * buf, size_t len )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ ) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int update_hash_host ( char * path, char * buf, uint64_t * hash )
+{
+    uint64_t h = UPDATE_HASH_INIT;
+    ssize_t n;
+    int fd;
+
+    fd = open( path, O_RDONLY );
+    if ( fd < 0 )
+        return -1;
+    while ( ( n = read( fd, buf, UPDATE_BUF_SIZE ) ) > 0 )
+        h = update_hash( h, (uint8_t*)buf, n );
+    close( fd );
+    *hash = h;
+    return ( n < 0 ) ? -1 : 0;
+}
+
+static int update_hash_image ( redsfs_fs * fs, char * name, char * buf, uint64_t * hash )
+{
+    uint64_t h = UPDATE_HASH_INIT;
+    redsfs_fh fh;
+    size_t n;
+
+    memset( &fh, 0, sizeof(fh) );
+    if ( redsfs_open_r( fs, &fh, name, MODE_READ ) < 0 )
+        return -1;
+    while ( ( n = redsfs_read_r( &fh, buf, UPDATE_BUF_SIZE ) ) > 0 )
+        h = update_hash( h, (uint8_t*)buf, n );
+    redsfs_close_r( &fh );
+    *hash = h;
+    return 0;
+}
+
+// Copy a host file in, sized so its blocks can be reserved in one run (or packed)
+static int update_write ( redsfs_fs * fs, char * path, char * name, char * buf )
+{
+    redsfs_fh fh;
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    fd = open( path, O_RDONLY );
+    if ( fd < 0 )
+        return -1;
+    fstat( fd, &st );
+
+    memset( &fh, 0, sizeof(fh) );
+    if ( redsfs_open_ex_r( fs, &fh, name, MODE_WRITE, st.st_size ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    while ( ( n = read( fd, buf, UPDATE_BUF_SIZE ) ) > 0 ) {
+        if ( redsfs_write_r( &fh, buf, n ) != (size_t)n ) {
+            printf("Update: writing %s failed (out of space?)\r\n", name);
+            n = -1;
+            break;
+        }
+    }
+    redsfs_close_r( &fh );
+    if ( ( n >= 0 ) && ( redsfs_error_r( &fh ) < 0 ) ) {
+        printf("Update: writing %s failed (out of space?)\r\n", name);
+        n = -1;
+    }
+    close( fd );
+    return ( n < 0 ) ? -1 : 0;
+}
+
+int redsupdate_dir ( redsfs_fs * fs, char * dir )
+{
+    update_ent * ent = NULL;
+    char (*todo)[BLK_NAME_SIZE + 1] = NULL;
+    char path[PATH_MAX];
+    struct dirent * de;
+    struct stat st;
+    redsfs_stat rst;
+    uint64_t h_host;
+    uint64_t h_img;
+    uint32_t cnt = 0;
+    uint32_t cap = 0;
+    uint32_t todo_cnt = 0;
+    uint32_t todo_cap = 0;
+    uint32_t same = 0;
+    uint32_t gone = 0;
+    uint32_t failed = 0;
+    int32_t freed;
+    char * buf;
+    DIR * d;
+    uint32_t i;
+
+    buf = malloc( UPDATE_BUF_SIZE );
+    d = opendir( dir );
+    if ( ( buf == NULL ) || ( d == NULL ) ) {
+        printf("Update: can not read %s\r\n", dir);
+        free( buf );
+        if ( d != NULL )
+            closedir( d );
+        return -1;
+    }
+
+    // The listing position is mount state, so the names are taken once up front,
+    // with their sizes from the same pass
+    while ( redsfs_next_file_ex_r( fs, &rst ) > 0 ) {
+        if ( cnt == cap ) {
+            cap = cap ? cap * 2 : 64;
+            ent = realloc( ent, cap * sizeof(*ent) );
+            if ( ent == NULL ) {
+                printf("Update: out of memory\r\n");
+                closedir( d );
+                free( buf );
+                return -1;
+            }
+        }
+        memcpy( ent[cnt].name, rst.name, sizeof(ent[cnt].name) );
+        ent[cnt].size = rst.size;
+        ent[cnt].keep = 0;
+        cnt++;
+    }
+
+    while ( ( de = readdir( d ) ) != NULL ) {
+        snprintf( path, sizeof(path), "%s/%s", dir, de->d_name );
+        if ( ( stat( path, &st ) == -1 ) || !S_ISREG( st.st_mode ) )
+            continue;
+        if ( strlen( de->d_name ) > BLK_NAME_SIZE ) {
+            printf("Update: name too long, skipping %s\r\n", de->d_name);
+            continue;
+        }
+
+        for ( i = 0; i < cnt; i++ ) {
+            if ( strcmp( ent[i].name, de->d_name ) == 0 )
+                break;
+        }
+        // A size that differs settles it without reading either copy
+        if ( ( i < cnt ) && ( ( ent[i].size < 0 ) || ( ent[i].size == st.st_size ) ) &&
+             ( update_hash_host( path, buf, &h_host ) == 0 ) &&
+             ( update_hash_image( fs, ent[i].name, buf, &h_img ) == 0 ) && ( h_host == h_img ) ) {
+            ent[i].keep = 1;
+            same++;
+            continue;
+        }
+
+        if ( todo_cnt == todo_cap ) {
+            todo_cap = todo_cap ? todo_cap * 2 : 64;
+            todo = realloc( todo, todo_cap * sizeof(*todo) );
+            if ( todo == NULL ) {
+                printf("Update: out of memory\r\n");
+                closedir( d );
+                free( ent );
+                free( buf );
+                return -1;
+            }
+        }
+        strcpy( todo[todo_cnt++], de->d_name );
+    }
+    closedir( d );
+
+    // Changed and removed files go first, and their blocks are taken back for the new copies
+    for ( i = 0; i < cnt; i++ ) {
+        if ( ent[i].keep )
+            continue;
+        if ( redsfs_delete_r( fs, ent[i].name ) != 0 )
+            failed++;
+        else
+            gone++;
+    }
+    freed = redsfs_gc_r( fs, fs->blk_count );
+
+    for ( i = 0; i < todo_cnt; i++ ) {
+        printf("Updating file : %s\n", todo[i]);
+        snprintf( path, sizeof(path), "%s/%s", dir, todo[i] );
+        if ( update_write( fs, path, todo[i], buf ) < 0 )
+            failed++;
+    }
+
+    printf("Updated %u files, %u unchanged, %u deleted, %d blocks reclaimed\r\n",
+           todo_cnt, same, gone, ( freed > 0 ) ? freed : 0);
+    free( todo );
+    free( ent );
+    free( buf );
+    return failed ? -1 : (int)todo_cnt;
+}
+
+int redsupdate_delta ( uint8_t * base, uint8_t * image, uint32_t size, uint32_t blk_sz, char * path )
+{
+    update_delta_hdr hdr;
+    uint32_t blk_cnt = size / blk_sz;
+    uint32_t blocks = 0;
+    uint32_t run[2];
+    uint32_t blk;
+    FILE * f;
+
+    memset( &hdr, 0, sizeof(hdr) );
+    hdr.magic = DELTA_MAGIC;
+    hdr.blk_sz = blk_sz;
+    hdr.size = size;
+    hdr.base_hash = update_hash( UPDATE_HASH_INIT, base, size );
+    hdr.new_hash = update_hash( UPDATE_HASH_INIT, image, size );
+    for ( blk = 0; blk < blk_cnt; blk++ ) {
+        if ( ( memcmp( base + blk * blk_sz, image + blk * blk_sz, blk_sz ) != 0 ) &&
+             ( ( blk == 0 ) || ( memcmp( base + ( blk - 1 ) * blk_sz, image + ( blk - 1 ) * blk_sz, blk_sz ) == 0 ) ) )
+            hdr.runs++;
+    }
+
+    f = fopen( path, "wb" );
+    if ( f == NULL ) {
+        printf("Delta: can not create %s\r\n", path);
+        return -1;
+    }
+    fwrite( &hdr, sizeof(hdr), 1, f );
+
+    for ( blk = 0; blk < blk_cnt; blk += run[1] ) {
+        run[0] = blk;
+        run[1] = 0;
+        while ( ( blk + run[1] < blk_cnt ) &&
+                ( memcmp( base + ( blk + run[1] ) * blk_sz, image + ( blk + run[1] ) * blk_sz, blk_sz ) != 0 ) )
+            run[1]++;
+        if ( run[1] == 0 ) {
+            run[1] = 1;
+            continue;
+        }
+        fwrite( run, sizeof(run), 1, f );
+        fwrite( image + blk * blk_sz, blk_sz, run[1], f );
+        blocks += run[1];
+    }
+
+    if ( fclose( f ) != 0 ) {
+        printf("Delta: writing %s failed\r\n", path);
+        return -1;
+    }
+    printf("Delta: %u of %u blocks changed in %u runs, %lu bytes\r\n", blocks, blk_cnt, hdr.runs,
+           (unsigned long)( sizeof(hdr) + hdr.runs * sizeof(run) + (size_t)blocks * blk_sz ));
+    return blocks;
+}
+
+int redsupdate_apply ( uint8_t * image, uint32_t size, uint32_t blk_sz, char * path )
+{
+    update_delta_hdr hdr;
+    uint8_t * work;
+    uint32_t blocks = 0;
+    uint32_t run[2];
+    uint32_t i;
+    FILE * f;
+
+    f = fopen( path, "rb" );
+    if ( f == NULL ) {
+        printf("Delta: can not open %s\r\n", path);
+        return -1;
+    }
+    if ( ( fread( &hdr, sizeof(hdr), 1, f ) != 1 ) || ( hdr.magic != DELTA_MAGIC ) ||
+         ( hdr.blk_sz != blk_sz ) || ( hdr.size != size ) ) {
+        printf("Delta: %s is not for an image of this size and block size\r\n", path);
+        fclose( f );
+        return -1;
+    }
+    if ( hdr.base_hash != update_hash( UPDATE_HASH_INIT, image, size ) ) {
+        printf("Delta: %s was made from another image\r\n", path);
+        fclose( f );
+        return -1;
+    }
+
+    // Into a copy, the image is only changed once the whole delta checks out
+    work = malloc( size );
+    if ( work == NULL ) {
+        fclose( f );
+        return -1;
+    }
+    memcpy( work, image, size );
+    for ( i = 0; i < hdr.runs; i++ ) {
+        if ( ( fread( run, sizeof(run), 1, f ) != 1 ) || ( run[0] > size / blk_sz ) ||
+             ( run[1] > size / blk_sz - run[0] ) ||
+             ( fread( work + run[0] * blk_sz, blk_sz, run[1], f ) != run[1] ) )
+            break;
+        blocks += run[1];
+    }
+    fclose( f );
+
+    if ( ( i != hdr.runs ) || ( hdr.new_hash != update_hash( UPDATE_HASH_INIT, work, size ) ) ) {
+        printf("Delta: %s is truncated or corrupt\r\n", path);
+        free( work );
+        return -1;
+    }
+    memcpy( image, work, size );
+    free( work );
+    printf("Delta: applied %u blocks in %u runs\r\n", blocks, hdr.runs);
+    return blocks;
+}
@@ -0,0 +1,46 @@
+/*
+ * Incremental image update for redsimg
+ *
+ * Brings a mounted image in line with a directory, rewriting only the files
+ * whose contents differ, and diffs two images block by block into a delta
+ * that can be shipped and applied in place of the whole image.
+ */
+
+#ifndef REDSUPDATE_H
+#define REDSUPDATE_H
+
+#include <stdint.h>
+
+#include "redsfs.h"
+
+// Bytes read from a file at a time when hashing or copying it
+#define UPDATE_BUF_SIZE ( 64 * 1024 )
+
+// Delta file header, followed by runs of a uint32_t first block, a uint32_t block
+// count and that many blocks of new image data
+#define DELTA_MAGIC 0x544c4452  // "RDLT"
+
+typedef struct update__delta_hdr {
+    uint32_t	magic;
+    uint32_t	blk_sz;
+    uint32_t	size;           // Image bytes, the same before and after
+    uint32_t	runs;
+    uint64_t	base_hash;      // Image the delta applies to
+    uint64_t	new_hash;       // Image after applying it
+} update_delta_hdr;
+
+// Make the files of the mounted fs those of dir. Files that hash the same as the one
+// of that name on the image are left as they are, changed and removed ones are deleted
+// and their blocks reclaimed before the changed and new ones are written, so they go
+// back into the freed space. Returns the number of files written, -1 on a failure.
+int redsupdate_dir ( redsfs_fs * fs, char * dir );
+
+// Write the blocks of image that differ from base, both size bytes, to path.
+// Returns the number of blocks in the delta, -1 if it can not be written.
+int redsupdate_delta ( uint8_t * base, uint8_t * image, uint32_t size, uint32_t blk_sz, char * path );
+
+// Apply the delta at path to the image, after checking it was made from this image.
+// Returns the number of blocks written, -1 if the delta does not fit the image.
+int redsupdate_apply ( uint8_t * image, uint32_t size, uint32_t blk_sz, char * path );
+
+#endif